@@ -1,6 +1,12 @@
 /**
  * @file
  * @brief UNVMe fio plugin engine.
+ *
+ * Besides plain reads and writes, reads may be issued as NDP translations
+ * (ndp=1): the SLS configuration is written to the io offset and the
+ * pooled results are read back, with the embedding geometry set by the
+ * ndp_* options.  With unvme_batch=1 the queued io_us are staged and
+ * submitted together in ->commit() with one doorbell write.
  */
 
 #include <stdio.h>
@@ -9,6 +15,7 @@
 #include <error.h>
 #include <assert.h>
 #include <pthread.h>
+#include <stddef.h>
 
 #include "unvme.h"
 
@@ -18,10 +25,50 @@
 
 #define TDEBUG(fmt, arg...) //printf("#%s.%d " fmt "\n", __func__, td->thread_number, ##arg)
 
+/// NDP SLS configuration (as laid out by test/unvme/unvme_embed_lib.c)
+typedef struct {
+    u32                 attribute_size;
+    u32                 embedding_length;
+    u32                 result_embeddings;
+    u32                 input_embeddings;
+    u32                 table_id;
+    u32                 embedding_id_list[];
+} unvme_ndp_config_t;
+
+/// engine options
+typedef struct {
+    void*               pad;        ///< required by fio
+    unsigned int        ndp;        ///< issue reads as NDP translations
+    unsigned int        ndp_vlen;   ///< embedding vector length
+    unsigned int        ndp_lookups; ///< rows pooled per translation
+    unsigned int        ndp_rows;   ///< table rows to pick lookups from
+    unsigned int        ndp_table;  ///< table id
+    unsigned int        batch;      ///< stage io_us until ->commit()
+} unvme_options_t;
+
+struct _unvme_data;
+
+/// outstanding io_u (the completion callback context of its commands)
 typedef struct {
+    struct io_u*        io_u;
+    struct _unvme_data* udata;
+    int                 cmds;       ///< commands still outstanding
+} unvme_pending_t;
+
+typedef struct _unvme_data {
     struct io_u**       iocq;
     int                 head;
     int                 tail;
+    int                 depth;      ///< iodepth (iocq has depth + 1 entries)
+    int                 ready;      ///< completed io_us not yet returned
+    unvme_pending_t*    pending;    ///< outstanding io_u slots
+    unvme_pending_t**   freeslots;  ///< free pending slots
+    int                 nfree;
+    unvme_ioreq_t*      reqs;       ///< staged commands (batch mode)
+    struct io_u**       reqio;      ///< io_u of each staged command
+    int                 nreqs;
+    int                 cmdsperio;  ///< most commands per io_u
+    u64                 rng;        ///< NDP lookup id random state
 } unvme_data_t;
 
 typedef struct {
@@ -35,6 +82,72 @@ typedef struct {
 // Static variables
 static unvme_context_t  unvme = { .mutex = PTHREAD_MUTEX_INITIALIZER };
 
+static struct fio_option options[] = {
+    {
+        .name       = "ndp",
+        .lname      = "NDP translate reads",
+        .type       = FIO_OPT_BOOL,
+        .off1       = offsetof(unvme_options_t, ndp),
+        .help       = "Issue reads as NDP translations (config write + result read)",
+        .def        = "0",
+        .category   = FIO_OPT_C_ENGINE,
+        .group      = FIO_OPT_G_INVALID,
+    },
+    {
+        .name       = "ndp_vlen",
+        .lname      = "NDP embedding length",
+        .type       = FIO_OPT_INT,
+        .off1       = offsetof(unvme_options_t, ndp_vlen),
+        .help       = "Embedding vector length (floats) of NDP translations",
+        .def        = "64",
+        .category   = FIO_OPT_C_ENGINE,
+        .group      = FIO_OPT_G_INVALID,
+    },
+    {
+        .name       = "ndp_lookups",
+        .lname      = "NDP lookups",
+        .type       = FIO_OPT_INT,
+        .off1       = offsetof(unvme_options_t, ndp_lookups),
+        .help       = "Rows pooled per NDP translation",
+        .def        = "80",
+        .category   = FIO_OPT_C_ENGINE,
+        .group      = FIO_OPT_G_INVALID,
+    },
+    {
+        .name       = "ndp_rows",
+        .lname      = "NDP table rows",
+        .type       = FIO_OPT_INT,
+        .off1       = offsetof(unvme_options_t, ndp_rows),
+        .help       = "Table rows that NDP lookups are picked from at random",
+        .def        = "700000",
+        .category   = FIO_OPT_C_ENGINE,
+        .group      = FIO_OPT_G_INVALID,
+    },
+    {
+        .name       = "ndp_table",
+        .lname      = "NDP table id",
+        .type       = FIO_OPT_INT,
+        .off1       = offsetof(unvme_options_t, ndp_table),
+        .help       = "Table id of NDP translations",
+        .def        = "0",
+        .category   = FIO_OPT_C_ENGINE,
+        .group      = FIO_OPT_G_INVALID,
+    },
+    {
+        .name       = "unvme_batch",
+        .lname      = "UNVMe batched submit",
+        .type       = FIO_OPT_BOOL,
+        .off1       = offsetof(unvme_options_t, batch),
+        .help       = "Stage queued io_us and submit them together on commit",
+        .def        = "0",
+        .category   = FIO_OPT_C_ENGINE,
+        .group      = FIO_OPT_G_INVALID,
+    },
+    {
+        .name       = NULL,
+    },
+};
+
 
 /**
  * Read tsc.
@@ -128,14 +241,49 @@ static int fio_unvme_get_file_size(struct thread_data *td, struct fio_file *f)
  */
 static int fio_unvme_init(struct thread_data *td)
 {
+    unvme_options_t* o = td->eo;
     unvme_data_t* udata = calloc(1, sizeof(unvme_data_t));
     if (!udata) return 1;
 
+    // an NDP translation is its config block writes and a result read
+    udata->cmdsperio = 1;
+    if (o->ndp) {
+        if (!unvme.ns) do_unvme_init(td);
+        u64 cfgsize = sizeof(unvme_ndp_config_t) + 8UL * o->ndp_lookups;
+        int cfgnlb = (cfgsize + unvme.ns->blocksize - 1) >> unvme.ns->blockshift;
+        if (!o->ndp_vlen || !o->ndp_lookups || !o->ndp_rows)
+            error(1, 0, "ndp_vlen, ndp_lookups and ndp_rows must be > 0");
+        if (cfgsize > td->o.min_bs[DDIR_READ])
+            error(1, 0, "NDP config of %lu bytes exceeds read bs", cfgsize);
+        if (td->o.iodepth * (cfgnlb + 1) >= unvme.ns->qsize)
+            error(1, 0, "iodepth %d with %d command NDP requests exceeds queue size",
+                  td->o.iodepth, cfgnlb + 1);
+        udata->cmdsperio = cfgnlb + 1;
+    }
+    udata->rng = 0x9E3779B97F4A7C15UL * td->thread_number;
+
+    int ncmds = td->o.iodepth * udata->cmdsperio;
+    int i;
+    udata->depth = td->o.iodepth;
     udata->iocq = calloc(td->o.iodepth + 1, sizeof(void*));
-    if (!udata->iocq) {
+    udata->pending = calloc(td->o.iodepth, sizeof(unvme_pending_t));
+    udata->freeslots = calloc(td->o.iodepth, sizeof(void*));
+    udata->reqs = calloc(ncmds, sizeof(unvme_ioreq_t));
+    udata->reqio = calloc(ncmds, sizeof(void*));
+    if (!udata->iocq || !udata->pending || !udata->freeslots ||
+        !udata->reqs || !udata->reqio) {
+        free(udata->iocq);
+        free(udata->pending);
+        free(udata->freeslots);
+        free(udata->reqs);
+        free(udata->reqio);
         free (udata);
         return 1;
     }
+    for (i = 0; i < (int)td->o.iodepth; i++) {
+        udata->pending[i].udata = udata;
+        udata->freeslots[udata->nfree++] = udata->pending + i;
+    }
 
     td->io_ops_data = udata;
     return 0;
@@ -151,6 +299,10 @@ static void fio_unvme_cleanup(struct thread_data *td)
     unvme_data_t* udata = td->io_ops_data;
     if (udata) {
         if (udata->iocq) free(udata->iocq);
+        free(udata->pending);
+        free(udata->freeslots);
+        free(udata->reqs);
+        free(udata->reqio);
         free(udata);
     }
 }
@@ -224,36 +376,108 @@ static struct io_u* fio_unvme_event(struct thread_data *td, int event)
 static int fio_unvme_getevents(struct thread_data *td, unsigned int min,
                                unsigned int max, const struct timespec *t)
 {
-    int i;
-    struct io_u* io_u;
-    int events = 0;
     u64 endtsc = 0;
     unvme_data_t* udata = td->io_ops_data;
+    int q = td->thread_number - 1;
 
+    if (max > td->o.iodepth) max = td->o.iodepth;
     do {
-        io_u_qiter(&td->io_u_all, io_u, i) {
-            if (io_u->engine_data) {
-                int stat = unvme_apoll(io_u->engine_data, 0);
-                if (stat == 0) {
-                    io_u->engine_data = NULL;
-                    udata->iocq[udata->tail] = io_u;
-                    TDEBUG("PUT.%d %p", udata->tail, io_u->buf);
-                    if (++udata->tail > td->o.iodepth) udata->tail = 0;
-                    if (++events >= min) return events;
-                } else if (stat == -1) {
-                    if (endtsc == 0) endtsc = rdtsc() + unvme.rdtsc_timeout;
-                } else {
-                    error(1, 0, "\nunvme_apoll return %#x", stat);
-                }
-            }
+        // the callbacks queue the io_us completed by their last command
+        if (udata->ready < (int)max)
+            unvme_progress(unvme.ns, q, (max - udata->ready) * udata->cmdsperio);
+        if (udata->ready >= (int)min) {
+            int events = udata->ready < (int)max ? udata->ready : (int)max;
+            udata->ready -= events;
+            return events;
         }
+        if (endtsc == 0) endtsc = rdtsc() + unvme.rdtsc_timeout;
         sched_yield();
     } while (rdtsc() < endtsc);
 
-    error(1, 0, "\nunvme_apoll timeout");
+    error(1, 0, "\nunvme_progress timeout");
     return 0;
 }
 
+/*
+ * Return the next NDP lookup row (xorshift64*).
+ */
+static inline u32 ndp_row(unvme_data_t* udata, u32 rows)
+{
+    udata->rng ^= udata->rng >> 12;
+    udata->rng ^= udata->rng << 25;
+    udata->rng ^= udata->rng >> 27;
+    return (udata->rng * 0x2545F4914F6CDD1DUL >> 32) % rows;
+}
+
+/*
+ * Lay out an NDP SLS configuration at the start of an io_u buffer, with
+ * random lookup rows pooled round robin into the results it reads back.
+ * Returns the number of configuration blocks.
+ */
+static int ndp_config(struct thread_data *td, struct io_u *io_u)
+{
+    unvme_options_t* o = td->eo;
+    unvme_data_t* udata = td->io_ops_data;
+    unvme_ndp_config_t* config = io_u->buf;
+    u32 results = io_u->xfer_buflen / (4 * o->ndp_vlen);
+    u32 i;
+
+    if (!results) results = 1;
+    config->attribute_size = 4;
+    config->embedding_length = o->ndp_vlen;
+    config->result_embeddings = results;
+    config->input_embeddings = o->ndp_lookups;
+    config->table_id = o->ndp_table;
+    for (i = 0; i < o->ndp_lookups; i++) {
+        config->embedding_id_list[2*i] = i % results;
+        config->embedding_id_list[2*i+1] = ndp_row(udata, o->ndp_rows);
+    }
+    return udata->cmdsperio - 1;
+}
+
+/*
+ * Completion callback of a command, which queues its io_u for ->event()
+ * once the io_u has no more outstanding commands.
+ */
+static void unvme_complete(const unvme_cpl_t* cpl, void* arg)
+{
+    unvme_pending_t* p = arg;
+    unvme_data_t* udata = p->udata;
+    if (cpl->stat) error(1, 0, "\nunvme_progress return %#x", cpl->stat);
+    if (--p->cmds) return;
+
+    udata->iocq[udata->tail] = p->io_u;
+    if (++udata->tail > udata->depth) udata->tail = 0;
+    udata->ready++;
+    udata->freeslots[udata->nfree++] = p;
+}
+
+/*
+ * Track an outstanding command of an io_u (see ->queue()).
+ */
+static void add_pending(unvme_data_t* udata, struct io_u* io_u, unvme_iod_t iod)
+{
+    unvme_pending_t* p = io_u->engine_data;
+    p->cmds++;
+    if (unvme_set_callback(iod, unvme_complete, p))
+        error(1, 0, "\nunvme_set_callback");
+}
+
+/*
+ * Stage a command of an io_u for the next ->commit().
+ */
+static void stage(unvme_data_t* udata, struct io_u* io_u, void* buf,
+                  u64 slba, u32 nlb, int write, int trans)
+{
+    unvme_ioreq_t* req = udata->reqs + udata->nreqs;
+    req->buf = buf;
+    req->slba = slba;
+    req->nlb = nlb;
+    req->write = write;
+    req->trans = trans;
+    udata->reqio[udata->nreqs++] = io_u;
+}
+
 /*
  * The ->queue() hook is responsible for initiating io on the io_u
  * being passed in. If the io engine is a synchronous one, io may complete
@@ -271,23 +495,69 @@ static int fio_unvme_queue(struct thread_data *td, struct io_u *io_u)
      */
     fio_ro_check(td, io_u);
 
+    unvme_options_t* o = td->eo;
+    unvme_data_t* udata = td->io_ops_data;
     void* buf = io_u->buf;
     u64 slba = io_u->offset >> unvme.ns->blockshift;
     int nlb = io_u->xfer_buflen >> unvme.ns->blockshift;
     int q = td->thread_number - 1;
-
+    unvme_iod_t iod;
+    int i, cfgnlb;
+
+    // the io_u takes a pending slot for the callbacks of its commands
+    unvme_pending_t* p = udata->freeslots[--udata->nfree];
+    p->io_u = io_u;
+    p->cmds = 0;
+    io_u->engine_data = p;
     switch (io_u->ddir) {
     case DDIR_READ:
+        if (o->ndp) {
+            // config blocks go to consecutive lbas, the results come from slba
+            cfgnlb = ndp_config(td, io_u);
+            TDEBUG("NDP q%d %p %#lx %d %d", q, buf, slba, nlb, cfgnlb);
+            for (i = 0; i < cfgnlb; i++) {
+                void* cfgbuf = buf + ((u64)i << unvme.ns->blockshift);
+                if (o->batch) {
+                    stage(udata, io_u, cfgbuf, slba + i, 1, 1, 1);
+                } else {
+                    if (!(iod = unvme_atranslate(unvme.ns, q, cfgbuf, slba + i)))
+                        error(1, 0, "\nunvme_atranslate q=%d slba=%#lx", q, slba + i);
+                    add_pending(udata, io_u, iod);
+                }
+            }
+            if (o->batch) {
+                stage(udata, io_u, buf, slba, nlb, 0, 1);
+                return FIO_Q_QUEUED;
+            }
+            if ((iod = unvme_atranslate_read(unvme.ns, q, buf, slba, nlb))) {
+                add_pending(udata, io_u, iod);
+                return FIO_Q_QUEUED;
+            }
+            error(1, 0, "\nunvme_atranslate_read q=%d slba=%#lx nlb=%d", q, slba, nlb);
+            break;
+        }
         TDEBUG("READ q%d %p %#lx %d", q, buf, slba, nlb);
-        if ((io_u->engine_data = unvme_aread(unvme.ns, q, buf, slba, nlb)))
+        if (o->batch) {
+            stage(udata, io_u, buf, slba, nlb, 0, 0);
             return FIO_Q_QUEUED;
+        }
+        if ((iod = unvme_aread(unvme.ns, q, buf, slba, nlb))) {
+            add_pending(udata, io_u, iod);
+            return FIO_Q_QUEUED;
+        }
         error(1, 0, "\nunvme_aread q=%d slba=%#lx nlb=%d", q, slba, nlb);
         break;
 
     case DDIR_WRITE:
         TDEBUG("WRITE q%d %p %#lx %d", q, buf, slba, nlb);
-        if ((io_u->engine_data = unvme_awrite(unvme.ns, q, buf, slba, nlb)))
+        if (o->batch) {
+            stage(udata, io_u, buf, slba, nlb, 1, 0);
+            return FIO_Q_QUEUED;
+        }
+        if ((iod = unvme_awrite(unvme.ns, q, buf, slba, nlb))) {
+            add_pending(udata, io_u, iod);
             return FIO_Q_QUEUED;
+        }
         error(1, 0, "\nunvme_awrite q=%d slba=%#lx nlb=%d", q, slba, nlb);
         break;
 
@@ -295,9 +565,32 @@ static int fio_unvme_queue(struct thread_data *td, struct io_u *io_u)
         break;
     }
 
+    udata->freeslots[udata->nfree++] = p;
     return FIO_Q_COMPLETED;
 }
 
+/*
+ * The ->commit() hook submits the commands staged by ->queue() (in batch
+ * mode) with one doorbell write.  Translation commands stay in order on
+ * the queue, as the device requires.
+ */
+static int fio_unvme_commit(struct thread_data *td)
+{
+    unvme_data_t* udata = td->io_ops_data;
+    int q = td->thread_number - 1;
+    int i;
+
+    if (!udata->nreqs) return 0;
+    unvme_iod_t iods[udata->nreqs];
+    int n = unvme_submit_batch(unvme.ns, q, udata->reqs, udata->nreqs, iods);
+    if (n < udata->nreqs)
+        error(1, 0, "\nunvme_submit_batch q=%d %d of %d", q, n, udata->nreqs);
+    TDEBUG("COMMIT q%d %d", q, n);
+    for (i = 0; i < n; i++) add_pending(udata, udata->reqio[i], iods[i]);
+    udata->nreqs = 0;
+    return 0;
+}
+
 
 // Note that the structure is exported, so that fio can get it via
 // dlsym(..., "ioengine");
@@ -312,8 +605,11 @@ struct ioengine_ops ioengine = {
     .iomem_alloc        = fio_unvme_iomem_alloc,
     .iomem_free         = fio_unvme_iomem_free,
     .queue              = fio_unvme_queue,
+    .commit             = fio_unvme_commit,
     .getevents          = fio_unvme_getevents,
     .event              = fio_unvme_event,
     .flags              = FIO_NOEXTEND | FIO_RAWIO,
+    .options            = options,
+    .option_struct_size = sizeof(unvme_options_t),
 };
 
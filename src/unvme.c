@@ -81,6 +81,18 @@ int unvme_close(const unvme_ns_t* ns)
     return unvme_do_close(ns);
 }
 
+/**
+ * Keep the controller of a device closed by its last session initialized,
+ * so the next open of the device in this process (with the same or default
+ * queue count and size) reuses it without a controller reset and queue
+ * setup.  Disabling releases the devices kept so far.
+ * @param   enable      1 to keep closed devices, 0 to release them
+ */
+void unvme_set_keepalive(int enable)
+{
+    unvme_do_set_keepalive(enable);
+}
+
 /**
  * Allocate an I/O buffer associated with a session.
  * @param   ns          namespace handle
@@ -93,11 +105,39 @@ void* unvme_alloc(const unvme_ns_t* ns, u64 size)
 }
 
 /**
- * Map an I/O buffer associated with a session.
+ * Allocate an I/O buffer backed by hugepages (falling back to normal pages
+ * if none is available).  The size is rounded up to the hugepage size.
  * @param   ns          namespace handle
  * @param   size        buffer size
+ * @param   hugeshift   UNVME_HUGEPAGE_2MB or UNVME_HUGEPAGE_1GB
+ * @return  the allocated buffer or NULL if failure.
+ */
+void* unvme_alloc_huge(const unvme_ns_t* ns, u64 size, int hugeshift)
+{
+    return unvme_do_alloc_huge(ns, size, hugeshift);
+}
+
+/**
+ * Set the hugepage size used by unvme_alloc for the session buffers
+ * too large for the buffer pool.
+ * @param   ns          namespace handle
+ * @param   hugeshift   UNVME_HUGEPAGE_2MB, UNVME_HUGEPAGE_1GB, or 0 for none
+ * @return  0 if ok else -1.
  */
-void unvme_map(const unvme_ns_t* ns, u64 size, void* pmb)
+int unvme_set_hugepage(const unvme_ns_t* ns, int hugeshift)
+{
+    return unvme_do_set_hugepage(ns, hugeshift);
+}
+
+/**
+ * Map (and pin) caller memory for I/O, e.g. to write a tensor in place.
+ * The mapping is released with unvme_free, which leaves the memory itself.
+ * @param   ns          namespace handle
+ * @param   size        buffer size
+ * @param   pmb         page aligned memory
+ * @return  0 if ok else -1.
+ */
+int unvme_map(const unvme_ns_t* ns, u64 size, void* pmb)
 {
     return unvme_do_map(ns, size, pmb);
 }
@@ -113,6 +153,21 @@ int unvme_free(const unvme_ns_t* ns, void* buf)
     return unvme_do_free(ns, buf);
 }
 
+/**
+ * Get a pre-resolved handle of an I/O buffer range, so that subsequent
+ * I/O on the handle can skip the buffer address lookup.  The handle is
+ * valid until the containing buffer is freed.
+ * @param   ns          namespace handle
+ * @param   buf         buffer pointer (within a buffer from unvme_alloc)
+ * @param   size        buffer range size
+ * @param   ubuf        returned buffer handle
+ * @return  0 if ok else -1.
+ */
+int unvme_getbuf(const unvme_ns_t* ns, void* buf, u64 size, unvme_buf_t* ubuf)
+{
+    return unvme_do_getbuf(ns, buf, size, ubuf);
+}
+
 /**
  * Read data from specified logical blocks on device.
  * @param   ns          namespace handle
@@ -142,6 +197,80 @@ unvme_iod_t unvme_awrite(const unvme_ns_t* ns, int qid,
     return (unvme_iod_t)unvme_rw(ns, qid, NVME_CMD_WRITE, (void*)buf, slba, nlb);
 }
 
+/**
+ * Read data into a pre-resolved buffer handle.
+ * @param   ns          namespace handle
+ * @param   qid         client queue index
+ * @param   ubuf        buffer handle (from unvme_getbuf)
+ * @param   slba        starting logical block
+ * @param   nlb         number of logical blocks
+ * @return  I/O descriptor or NULL if failed.
+ */
+unvme_iod_t unvme_aread_buf(const unvme_ns_t* ns, int qid,
+                            const unvme_buf_t* ubuf, u64 slba, u32 nlb)
+{
+    if (((u64)nlb << ns->blockshift) > ubuf->size) {
+        ERROR("buffer overrun");
+        return NULL;
+    }
+    return (unvme_iod_t)unvme_rw_buf(ns, qid, NVME_CMD_READ,
+                                     ubuf->buf, ubuf->addr, slba, nlb, 0);
+}
+
+/**
+ * Write data from a pre-resolved buffer handle.
+ * @param   ns          namespace handle
+ * @param   qid         client queue index
+ * @param   ubuf        buffer handle (from unvme_getbuf)
+ * @param   slba        starting logical block
+ * @param   nlb         number of logical blocks
+ * @return  I/O descriptor or NULL if failed.
+ */
+unvme_iod_t unvme_awrite_buf(const unvme_ns_t* ns, int qid,
+                             const unvme_buf_t* ubuf, u64 slba, u32 nlb)
+{
+    if (((u64)nlb << ns->blockshift) > ubuf->size) {
+        ERROR("buffer overrun");
+        return NULL;
+    }
+    return (unvme_iod_t)unvme_rw_buf(ns, qid, NVME_CMD_WRITE,
+                                     ubuf->buf, ubuf->addr, slba, nlb, 0);
+}
+
+/**
+ * Read data from specified logical blocks on device into an I/O vector of
+ * allocated buffers.  Only the first element may start within a page
+ * (block aligned), only the last element may end within a page, and the
+ * total size must be a multiple of the block size.
+ * @param   ns          namespace handle
+ * @param   qid         client queue index
+ * @param   iov         I/O vector (buffers from unvme_alloc)
+ * @param   iovcnt      number of I/O vector elements (max UNVME_MAXIOV)
+ * @param   slba        starting logical block
+ * @return  I/O descriptor or NULL if failed.
+ */
+unvme_iod_t unvme_areadv(const unvme_ns_t* ns, int qid,
+                         const unvme_iovec_t* iov, int iovcnt, u64 slba)
+{
+    return (unvme_iod_t)unvme_rwv(ns, qid, NVME_CMD_READ, iov, iovcnt, slba);
+}
+
+/**
+ * Write data from an I/O vector of allocated buffers to specified logical
+ * blocks on device (see unvme_areadv for the vector alignment).
+ * @param   ns          namespace handle
+ * @param   qid         client queue index
+ * @param   iov         I/O vector (buffers from unvme_alloc)
+ * @param   iovcnt      number of I/O vector elements (max UNVME_MAXIOV)
+ * @param   slba        starting logical block
+ * @return  I/O descriptor or NULL if failed.
+ */
+unvme_iod_t unvme_awritev(const unvme_ns_t* ns, int qid,
+                          const unvme_iovec_t* iov, int iovcnt, u64 slba)
+{
+    return (unvme_iod_t)unvme_rwv(ns, qid, NVME_CMD_WRITE, iov, iovcnt, slba);
+}
+
 /**
  * Write configuration data for translation.
  *
@@ -177,6 +306,22 @@ unvme_iod_t unvme_atranslate_read(const unvme_ns_t* ns, int qid,
     return (unvme_iod_t)unvme_rw_extended(ns, qid, NVME_CMD_READ, (void*)buf, slba, nlb, 1);
 }
 
+/**
+ * Submit a batch of read/write requests on a queue.  All the commands
+ * are staged before the device is signaled with one doorbell write.
+ * @param   ns          namespace handle
+ * @param   qid         client queue index
+ * @param   reqs        array of I/O requests
+ * @param   count       number of requests
+ * @param   iods        returned array of I/O descriptors
+ * @return  number of requests submitted (less than count on failure).
+ */
+int unvme_submit_batch(const unvme_ns_t* ns, int qid,
+                       const unvme_ioreq_t* reqs, int count, unvme_iod_t* iods)
+{
+    return unvme_do_submit_batch(ns, qid, reqs, count, iods);
+}
+
 /**
  * Poll for completion status of a previous IO submission.
  * If there's no error, the descriptor will be freed.
@@ -202,6 +347,177 @@ int unvme_apoll_cs(unvme_iod_t iod, int timeout, u32* cqe_cs)
     return unvme_do_poll((unvme_desc_t*)iod, timeout, cqe_cs);
 }
 
+/**
+ * Set how waits for a queue's completions are done: busy polling (the
+ * default), sleeping on the queue's MSIX interrupt, or polling for spinus
+ * microseconds before sleeping.  The queue must have no pending I/O.
+ * With the UNVME_QMODE_NONBLOCK flag, a submission that does not fit in the
+ * queue (after processing the completions already posted) fails with errno
+ * EAGAIN instead of waiting, and nothing of it is submitted.
+ * @param   ns          namespace handle
+ * @param   qid         client queue index
+ * @param   mode        UNVME_QMODE_POLL, UNVME_QMODE_INTR, or UNVME_QMODE_HYBRID
+ *                      optionally or'ed with UNVME_QMODE_NONBLOCK
+ * @param   spinus      poll time in microseconds for UNVME_QMODE_HYBRID
+ * @return  0 if ok else -1.
+ */
+int unvme_set_qmode(const unvme_ns_t* ns, int qid, int mode, int spinus)
+{
+    return unvme_do_set_qmode(ns, qid, mode, spinus);
+}
+
+/**
+ * Attach a completion callback to an asynchronous I/O descriptor, as
+ * returned by the submit call.  The callback is fired (with the descriptor
+ * already released) by the unvme_progress call of the queue that completes
+ * it, so the descriptor must not be polled nor its queue reaped.
+ * A completed descriptor is kept until that call, so attaching right after
+ * the submission cannot miss the completion.
+ * @param   iod         I/O descriptor
+ * @param   cb          callback function (NULL to detach)
+ * @param   arg         user context passed to the callback
+ * @return  0 if ok else -1.
+ */
+int unvme_set_callback(unvme_iod_t iod, unvme_cb_t cb, void* arg)
+{
+    return unvme_do_set_callback((unvme_desc_t*)iod, cb, arg);
+}
+
+/**
+ * Process the completions of a queue without waiting and fire the
+ * callbacks of the completed submissions (see unvme_set_callback).
+ * Callbacks may submit new I/O, including to the same queue.
+ * @param   ns          namespace handle
+ * @param   qid         client queue index
+ * @param   max         max number of callbacks to fire
+ * @return  number of callbacks fired.
+ */
+int unvme_progress(const unvme_ns_t* ns, int qid, int max)
+{
+    return unvme_do_progress(ns, qid, max);
+}
+
+/**
+ * Get the number of commands that can be submitted to a queue without
+ * waiting (less the reserved slots for plain writes, see unvme_set_qprio).
+ * A request takes one command per maxbpio blocks (a translation at least two).
+ * Completions are only counted once processed by unvme_apoll or unvme_reap.
+ * @param   ns          namespace handle
+ * @param   qid         client queue index
+ * @return  number of free queue slots.
+ */
+int unvme_qfree(const unvme_ns_t* ns, int qid)
+{
+    return unvme_do_qfree(ns, qid);
+}
+
+/**
+ * Set the scheduling class of a queue.  The priority selects the queue's
+ * class under the device's weighted round robin arbitration (ns->wrr), so
+ * latency critical lookups on high priority queues are fetched ahead of
+ * bulk writes on low priority ones.  Independently of the device, reserve
+ * queue slots are kept from plain writes, leaving them to the reads and
+ * translation (NDP) requests sharing the queue.  A priority change recreates
+ * the queue pair, so the queue must then have no pending I/O.
+ * @param   ns          namespace handle
+ * @param   qid         client queue index
+ * @param   prio        UNVME_QPRIO_URGENT, HIGH, MEDIUM (default), or LOW
+ * @param   reserve     queue slots writes may not take (0 for none)
+ * @return  0 if ok else -1.
+ */
+int unvme_set_qprio(const unvme_ns_t* ns, int qid, int prio, int reserve)
+{
+    return unvme_do_set_qprio(ns, qid, prio, reserve);
+}
+
+/**
+ * Reap the completed I/O submissions of a queue in one pass.  A reaped
+ * descriptor is released (i.e. like a successful unvme_apoll), so a queue
+ * being reaped must not also have its descriptors polled with unvme_apoll.
+ * @param   ns          namespace handle
+ * @param   qid         client queue index
+ * @param   cpls        returned array of completions
+ * @param   max         max number of completions to return
+ * @param   timeout     in seconds to wait for a first completion (0 for none)
+ * @return  number of completions returned.
+ */
+int unvme_reap(const unvme_ns_t* ns, int qid, unvme_cpl_t* cpls,
+               int max, int timeout)
+{
+    return unvme_do_reap(ns, qid, cpls, max, timeout);
+}
+
+/**
+ * Bind the calling thread to an I/O queue, preferring the queue of its
+ * current CPU.  A queue is owned by one thread unless it is bound with
+ * UNVME_QBIND_SHARED, in which case its I/O calls are serialized by a
+ * queue lock.  Calling it again from a bound thread returns the same queue.
+ * @param   ns          namespace handle
+ * @param   flags       UNVME_QBIND_AFFINITY and/or UNVME_QBIND_SHARED
+ * @return  client queue index or -1 if no queue is available.
+ */
+int unvme_qbind(const unvme_ns_t* ns, int flags)
+{
+    return unvme_do_qbind(ns, flags);
+}
+
+/**
+ * Release the I/O queue binding of the calling thread.
+ * @param   ns          namespace handle
+ * @return  0 if ok else -1.
+ */
+int unvme_qunbind(const unvme_ns_t* ns)
+{
+    return unvme_do_qunbind(ns);
+}
+
+/**
+ * Get the I/O statistics of a queue.  The counters are updated live by the
+ * queue owner, so a copy taken while I/O is in flight may be slightly off.
+ * @param   ns          namespace handle
+ * @param   qid         client queue index (-1 to sum all the queues)
+ * @param   stats       returned statistics
+ * @return  0 if ok else -1.
+ */
+int unvme_get_stats(const unvme_ns_t* ns, int qid, unvme_qstats_t* stats)
+{
+    return unvme_do_get_stats(ns, qid, stats);
+}
+
+/**
+ * Clear the I/O statistics of all the queues of a device.
+ * @param   ns          namespace handle
+ */
+void unvme_reset_stats(const unvme_ns_t* ns)
+{
+    unvme_do_reset_stats(ns);
+}
+
+/**
+ * Estimate a latency percentile from a histogram.
+ * @param   hist        latency histogram
+ * @param   pct         percentile (e.g. 99.9)
+ * @return  latency in nanoseconds (upper bound of the percentile bucket).
+ */
+u64 unvme_stats_percentile(const unvme_lat_hist_t* hist, double pct)
+{
+    if (hist->count == 0) return 0;
+    u64 rank = (u64)(hist->count * pct / 100.0 + 0.5);
+    if (rank == 0) rank = 1;
+    u64 n = 0;
+    int i;
+    for (i = 0; i < UNVME_STAT_BUCKETS; i++) {
+        n += hist->bucket[i];
+        if (n >= rank) break;
+    }
+    if (i < (1 << UNVME_STAT_SUBBITS)) return i;
+
+    int sub = 1 << UNVME_STAT_SUBBITS;
+    int shift = (i >> UNVME_STAT_SUBBITS) - 1;
+    u64 ns = ((u64)(sub | (i & (sub - 1))) + 1) << shift;
+    return ns - 1 < hist->maxns ? ns - 1 : hist->maxns;
+}
+
 /**
  * Read data from specified logical blocks on device.
  * @param   ns          namespace handle
@@ -251,62 +567,82 @@ int unvme_write(const unvme_ns_t* ns, int qid,
     return -1;
 }
 
+/**
+ * Read data from specified logical blocks on device into an I/O vector.
+ * @param   ns          namespace handle
+ * @param   qid         client queue index
+ * @param   iov         I/O vector (buffers from unvme_alloc)
+ * @param   iovcnt      number of I/O vector elements
+ * @param   slba        starting logical block
+ * @return  0 if ok else error status.
+ */
+int unvme_readv(const unvme_ns_t* ns, int qid,
+                const unvme_iovec_t* iov, int iovcnt, u64 slba)
+{
+    unvme_desc_t* desc = unvme_rwv(ns, qid, NVME_CMD_READ, iov, iovcnt, slba);
+    if (desc) {
+        sched_yield();
+        return unvme_do_poll(desc, UNVME_TIMEOUT, NULL);
+    }
+    return -1;
+}
+
+/**
+ * Write data from an I/O vector to specified logical blocks on device.
+ * @param   ns          namespace handle
+ * @param   qid         client queue index
+ * @param   iov         I/O vector (buffers from unvme_alloc)
+ * @param   iovcnt      number of I/O vector elements
+ * @param   slba        starting logical block
+ * @return  0 if ok else error status.
+ */
+int unvme_writev(const unvme_ns_t* ns, int qid,
+                 const unvme_iovec_t* iov, int iovcnt, u64 slba)
+{
+    unvme_desc_t* desc = unvme_rwv(ns, qid, NVME_CMD_WRITE, iov, iovcnt, slba);
+    if (desc) {
+        sched_yield();
+        return unvme_do_poll(desc, UNVME_TIMEOUT, NULL);
+    }
+    return -1;
+}
+
+/**
+ * Submit a translation (NDP) request asynchronously: the configuration
+ * write from the first blocks of the buffer followed by the result reads
+ * into the buffer.  The returned descriptor covers all the commands, and
+ * is completed via unvme_apoll or unvme_reap.
+ * @param   ns          namespace handle
+ * @param   qid         client queue index
+ * @param   buf         data buffer (from unvme_alloc)
+ * @param   slba        starting logical block
+ * @param   nlb         number of result logical blocks
+ * @param   config_nlb  number of configuration logical blocks
+ * @return  I/O descriptor or NULL if failed.
+ */
+unvme_iod_t unvme_atranslate_region(const unvme_ns_t* ns, int qid,
+                    void* buf, u64 slba, u32 nlb, u32 config_nlb)
+{
+    return (unvme_iod_t)unvme_translate(ns, qid, buf, slba, nlb, config_nlb);
+}
+
 /**
  * Read column data in specified logical blocks on device.
  * @param   ns          namespace handle
  * @param   qid         client queue index
  * @param   buf         data buffer (from unvme_alloc)
  * @param   slba        starting logical block
- * @param   nlb         number of logical blocks
+ * @param   nlb         number of result logical blocks
+ * @param   config_nlb  number of configuration logical blocks
  * @return  0 if ok else error status.
  */
 int unvme_translate_region(const unvme_ns_t* ns, int qid,
                     void* buf, u64 slba, u32 nlb, u32 config_nlb)
 {
-  unsigned int nrequests = (nlb / ns->maxbpio) + !!(nlb % ns->maxbpio) + 1;
-  unvme_desc_t** desc = malloc(ns->maxiopq * sizeof(unvme_desc_t*));
-  unsigned int readOffset = 0;
-
-  int i = 0;
-  desc[i] = unvme_rw_extended(ns, qid, NVME_CMD_WRITE, (void*)buf, slba, config_nlb, 1);
-  for (i = 1; i < ns->maxiopq; i++)
-  {
-    if (i >= nrequests) break;
-    desc[i] = unvme_rw_extended(ns, qid, NVME_CMD_READ,
-        (void*)buf+readOffset, slba,
-        (i == nrequests-1 && nlb % ns->maxbpio) ?
-          nlb % ns->maxbpio : ns->maxbpio, 1);
-    readOffset += ns->maxbpio * ns->blocksize;
-  }
-
-  int pending = i;
-  int j = 0;
-  int maxj = (ns->maxbpio < nrequests) ? ns->maxbpio : nrequests;
-  do {
-    if (desc[j])
-    {
-      sched_yield();
-      if (unvme_do_poll(desc[j], UNVME_TIMEOUT, NULL) == 0)
-      {
-        if (i < nrequests)
-        {
-          desc[j] = unvme_rw_extended(ns, qid, NVME_CMD_READ,
-              (void*)buf+readOffset, slba,
-              (i == nrequests-1 && nlb % ns->maxbpio) ?
-                nlb % ns->maxbpio : ns->maxbpio, 1);
-          readOffset += ns->maxbpio * ns->blocksize;
-          i++;
-        }
-        else
-        {
-          desc[j] = 0;
-          pending--;
-        }
-      }
+    unvme_desc_t* desc = unvme_translate(ns, qid, buf, slba, nlb, config_nlb);
+    if (desc) {
+        sched_yield();
+        return unvme_do_poll(desc, UNVME_TIMEOUT, NULL);
     }
-    if (++j == maxj) j = 0;
-  } while (pending > 0);
-
-  free(desc);
-  return 0;
+    return -1;
 }
@@ -39,6 +39,10 @@
 
 #include <stdint.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #ifndef _U_TYPE
 #define _U_TYPE                     ///< bit size data types
 typedef int8_t          s8;         ///< 8-bit signed
@@ -53,6 +57,38 @@ typedef uint64_t        u64;        ///< 64-bit unsigned
 
 #define UNVME_TIMEOUT   30          ///< default I/O timeout in seconds
 #define UNVME_QSIZE     256         ///< default I/O queue size
+#define UNVME_PRPPAGES  2           ///< chained PRP list pages per command
+#define UNVME_MAXIOV    256         ///< max I/O vector elements per request
+#define UNVME_HUGEPAGE_2MB  21      ///< 2MB hugepage size shift
+#define UNVME_HUGEPAGE_1GB  30      ///< 1GB hugepage size shift
+
+#define UNVME_QMODE_POLL    0       ///< busy poll for completions
+#define UNVME_QMODE_INTR    1       ///< sleep on completion interrupts
+#define UNVME_QMODE_HYBRID  2       ///< poll for a while then sleep
+#define UNVME_QMODE_NONBLOCK 0x10   ///< flag: fail submissions on a full queue
+
+#define UNVME_QPRIO_URGENT  0       ///< served ahead of all other queues
+#define UNVME_QPRIO_HIGH    1       ///< high weighted round robin class
+#define UNVME_QPRIO_MEDIUM  2       ///< medium class (default)
+#define UNVME_QPRIO_LOW     3       ///< low class (e.g. bulk table writes)
+#define UNVME_WRR_HIGH      16      ///< high class arbitration weight
+#define UNVME_WRR_MEDIUM    4       ///< medium class arbitration weight
+#define UNVME_WRR_LOW       1       ///< low class arbitration weight
+#define UNVME_WRR_BURST     3       ///< arbitration burst (2^n commands)
+
+#define UNVME_QBIND_AFFINITY 1      ///< pin the thread to its current CPU
+#define UNVME_QBIND_SHARED  2       ///< share a locked queue if none is free
+
+#define UNVME_STAT_READ     0       ///< read commands
+#define UNVME_STAT_WRITE    1       ///< write commands
+#define UNVME_STAT_NDP_READ 2       ///< translation (NDP) result reads
+#define UNVME_STAT_NDP_WRITE 3      ///< translation (NDP) configuration writes
+#define UNVME_STAT_OTHER    4       ///< flush and other commands
+#define UNVME_STAT_CLASSES  5       ///< number of command classes
+#define UNVME_STAT_SUBBITS  3       ///< latency buckets per power of 2 (shift)
+#define UNVME_STAT_BUCKETS  304     ///< latency buckets (up to 2^40 ns)
+#define UNVME_STAT_QDBUCKETS 17     ///< queue depth buckets (powers of 2)
+#define UNVME_STAT_MAGIC    0x54534d56  ///< stats file magic ("VMST")
 
 /// Namespace attributes structure
 typedef struct _unvme_ns {
@@ -79,6 +115,7 @@ typedef struct _unvme_ns {
     u16                 qsize;      ///< I/O queue size
     u16                 maxqsize;   ///< max queue size supported
     u16                 nscount;    ///< number of namespaces available
+    u16                 wrr;        ///< weighted round robin queue arbitration
     void*               ses;        ///< associated session
 } unvme_ns_t;
 
@@ -92,26 +129,120 @@ typedef struct _unvme_iod {
     u32                 id;         ///< descriptor id
 } *unvme_iod_t;
 
+/// Pre-resolved I/O buffer handle (a byte offset may be added to both
+/// buf and addr, and subtracted from size, to address a sub-range)
+typedef struct _unvme_buf {
+    void*               buf;        ///< buffer virtual address
+    u64                 addr;       ///< buffer I/O DMA address
+    u64                 size;       ///< buffer size
+} unvme_buf_t;
+
+/// I/O vector element (see unvme_areadv)
+typedef struct _unvme_iovec {
+    void*               buf;        ///< data buffer (from unvme_alloc)
+    u64                 size;       ///< size in bytes
+} unvme_iovec_t;
+
+/// Batched I/O request (see unvme_submit_batch)
+typedef struct _unvme_ioreq {
+    void*               buf;        ///< data buffer (from unvme_alloc)
+    u64                 slba;       ///< starting logical block
+    u32                 nlb;        ///< number of logical blocks
+    u16                 write;      ///< 1 for write else read
+    u16                 trans;      ///< 1 for translation command
+} unvme_ioreq_t;
+
+/// I/O completion (see unvme_reap)
+typedef struct _unvme_cpl {
+    unvme_iod_t         iod;        ///< completed (released) descriptor
+    void*               buf;        ///< data buffer (submitted)
+    u64                 slba;       ///< starting lba (submitted)
+    u32                 nlb;        ///< number of blocks (submitted)
+    int                 stat;       ///< 0 if ok else NVMe error status
+    u32                 cs;         ///< CQE command specific DW0
+} unvme_cpl_t;
+
+/// I/O completion callback (see unvme_set_callback)
+typedef void (*unvme_cb_t)(const unvme_cpl_t* cpl, void* arg);
+
+/// Latency histogram with log-linear nanosecond buckets of 12.5% width
+typedef struct _unvme_lat_hist {
+    u64                 count;      ///< number of completions
+    u64                 sumns;      ///< total latency in nanoseconds
+    u64                 maxns;      ///< max latency in nanoseconds
+    u64                 bucket[UNVME_STAT_BUCKETS]; ///< completion counts
+} unvme_lat_hist_t;
+
+/// I/O queue statistics (see unvme_get_stats)
+typedef struct _unvme_qstats {
+    u64                 submits[UNVME_STAT_CLASSES]; ///< submitted commands
+    u64                 errors[UNVME_STAT_CLASSES];  ///< failed commands
+    unvme_lat_hist_t    lat[UNVME_STAT_CLASSES];     ///< submit to complete
+    u64                 qdepth[UNVME_STAT_QDBUCKETS]; ///< depth at submission
+    u64                 sqdb;       ///< submission doorbell writes
+    u64                 cqdb;       ///< completion doorbell writes
+    u64                 sqfull;     ///< submissions stalled on a full queue
+                                    ///< or on its reserved slots
+} unvme_qstats_t;
+
+/// Statistics shared memory file layout (/dev/shm/unvme.BB:DD.F.stats)
+typedef struct _unvme_stats_shm {
+    u32                 magic;      ///< UNVME_STAT_MAGIC
+    u32                 size;       ///< file size
+    u32                 qcount;     ///< number of queues
+    u32                 qsize;      ///< queue size
+    u64                 tscsec;     ///< rdtsc per second
+    char                device[16]; ///< PCI device name
+    unvme_qstats_t      q[];        ///< per queue statistics
+} unvme_stats_shm_t;
+
 // Export functions
 const unvme_ns_t* unvme_open(const char* pciname);
 const unvme_ns_t* unvme_openq(const char* pciname, int qcount, int qsize);
 int unvme_close(const unvme_ns_t* ns);
+void unvme_set_keepalive(int enable);
 
 void* unvme_alloc(const unvme_ns_t* ns, u64 size);
-void unvme_map(const unvme_ns_t* ns, u64 size, void* pmb);
+void* unvme_alloc_huge(const unvme_ns_t* ns, u64 size, int hugeshift);
+int unvme_set_hugepage(const unvme_ns_t* ns, int hugeshift);
+int unvme_map(const unvme_ns_t* ns, u64 size, void* pmb);
 int unvme_free(const unvme_ns_t* ns, void* buf);
+int unvme_getbuf(const unvme_ns_t* ns, void* buf, u64 size, unvme_buf_t* ubuf);
 
 int unvme_write(const unvme_ns_t* ns, int qid, const void* buf, u64 slba, u32 nlb);
 int unvme_read(const unvme_ns_t* ns, int qid, void* buf, u64 slba, u32 nlb);
 int unvme_flush(const unvme_ns_t* ns, int qid);
+int unvme_readv(const unvme_ns_t* ns, int qid, const unvme_iovec_t* iov, int iovcnt, u64 slba);
+int unvme_writev(const unvme_ns_t* ns, int qid, const unvme_iovec_t* iov, int iovcnt, u64 slba);
 int unvme_translate_region(const unvme_ns_t* ns, int qid, void* buf, u64 slba, u32 nlb, u32 config_nlb);
 
 unvme_iod_t unvme_awrite(const unvme_ns_t* ns, int qid, const void* buf, u64 slba, u32 nlb);
 unvme_iod_t unvme_aread(const unvme_ns_t* ns, int qid, void* buf, u64 slba, u32 nlb);
+unvme_iod_t unvme_awrite_buf(const unvme_ns_t* ns, int qid, const unvme_buf_t* ubuf, u64 slba, u32 nlb);
+unvme_iod_t unvme_aread_buf(const unvme_ns_t* ns, int qid, const unvme_buf_t* ubuf, u64 slba, u32 nlb);
+unvme_iod_t unvme_areadv(const unvme_ns_t* ns, int qid, const unvme_iovec_t* iov, int iovcnt, u64 slba);
+unvme_iod_t unvme_awritev(const unvme_ns_t* ns, int qid, const unvme_iovec_t* iov, int iovcnt, u64 slba);
 unvme_iod_t unvme_atranslate(const unvme_ns_t* ns, int qid, void* buf, u64 slba);
 unvme_iod_t unvme_atranslate_read(const unvme_ns_t* ns, int qid, void* buf, u64 slba, u32 nlb);
+unvme_iod_t unvme_atranslate_region(const unvme_ns_t* ns, int qid, void* buf, u64 slba, u32 nlb, u32 config_nlb);
+int unvme_submit_batch(const unvme_ns_t* ns, int qid, const unvme_ioreq_t* reqs, int count, unvme_iod_t* iods);
 int unvme_apoll(unvme_iod_t iod, int timeout);
 int unvme_apoll_cs(unvme_iod_t iod, int timeout, u32* cqe_cs);
+int unvme_set_qmode(const unvme_ns_t* ns, int qid, int mode, int spinus);
+int unvme_set_qprio(const unvme_ns_t* ns, int qid, int prio, int reserve);
+int unvme_qfree(const unvme_ns_t* ns, int qid);
+int unvme_reap(const unvme_ns_t* ns, int qid, unvme_cpl_t* cpls, int max, int timeout);
+int unvme_set_callback(unvme_iod_t iod, unvme_cb_t cb, void* arg);
+int unvme_progress(const unvme_ns_t* ns, int qid, int max);
+int unvme_qbind(const unvme_ns_t* ns, int flags);
+int unvme_qunbind(const unvme_ns_t* ns);
+int unvme_get_stats(const unvme_ns_t* ns, int qid, unvme_qstats_t* stats);
+void unvme_reset_stats(const unvme_ns_t* ns);
+u64 unvme_stats_percentile(const unvme_lat_hist_t* hist, double pct);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif // _UNVME_H
 
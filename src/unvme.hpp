@@ -0,0 +1,172 @@
+/**
+ * Copyright (c) 2015-2016, Micron Technology, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file
+ * @brief UNVMe C++ asynchronous I/O header file.
+ *
+ * Thin wrappers over the completion callbacks of the client API (see
+ * unvme_set_callback).  An operation is submitted when it is created and
+ * completes in the unvme_progress call of its queue, which the caller's
+ * event loop drives, so one thread may have many operations in flight:
+ *
+ *     unvme::io_result r = co_await unvme::read(ns, qid, buf, slba, nlb);
+ *
+ * Without C++20 coroutines, an operation is consumed by then() or future().
+ */
+
+#ifndef _UNVME_HPP
+#define _UNVME_HPP
+
+#include <future>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine)
+#include <coroutine>
+#define UNVME_COROUTINE 1           ///< io_op is awaitable
+#endif
+
+#include "unvme.h"
+
+namespace unvme {
+
+/// Completion of an asynchronous operation
+struct io_result {
+    int                 stat;       ///< 0 if ok, NVMe error status, or -1 if not submitted
+    u32                 cs;         ///< CQE command specific DW0
+
+    /// true if the operation succeeded
+    explicit operator bool() const { return stat == 0; }
+};
+
+/// Submitted asynchronous operation, to be consumed exactly once
+class io_op {
+public:
+    /// Wrap the descriptor returned by an asynchronous submit call
+    explicit io_op(unvme_iod_t iod) : iod_(iod), res_{-1, 0} {}
+
+    /// Descriptor of the operation (NULL if the submission failed)
+    unvme_iod_t iod() const { return iod_; }
+
+    /**
+     * Call f(io_result) on completion (or right away if not submitted).
+     * @return  false if the operation was not submitted.
+     */
+    template <class F>
+    bool then(F&& f)
+    {
+        typedef typename std::decay<F>::type fn_t;
+        fn_t* fn = new fn_t(std::forward<F>(f));
+        if (!iod_ || unvme_set_callback(iod_, &io_op::call<fn_t>, fn)) {
+            std::unique_ptr<fn_t> p(fn);
+            (*p)(res_);
+            return false;
+        }
+        iod_ = NULL;
+        return true;
+    }
+
+    /// Get a future of the completion
+    std::future<io_result> future()
+    {
+        auto p = std::make_shared<std::promise<io_result>>();
+        std::future<io_result> f = p->get_future();
+        then([p](io_result r) { p->set_value(r); });
+        return f;
+    }
+
+#ifdef UNVME_COROUTINE
+    /// Resume without suspending if the operation was not submitted
+    bool await_ready() const noexcept { return !iod_; }
+
+    /// Resume the coroutine from the completion callback
+    bool await_suspend(std::coroutine_handle<> h) noexcept
+    {
+        handle_ = h;
+        return unvme_set_callback(iod_, &io_op::resume, this) == 0;
+    }
+
+    /// Completion of the operation
+    io_result await_resume() const noexcept { return res_; }
+#endif
+
+private:
+    template <class F>
+    static void call(const unvme_cpl_t* cpl, void* arg)
+    {
+        std::unique_ptr<F> fn(static_cast<F*>(arg));
+        (*fn)(io_result{cpl->stat, cpl->cs});
+    }
+
+#ifdef UNVME_COROUTINE
+    static void resume(const unvme_cpl_t* cpl, void* arg)
+    {
+        io_op* op = static_cast<io_op*>(arg);
+        op->res_ = io_result{cpl->stat, cpl->cs};
+        op->handle_.resume();
+    }
+
+    std::coroutine_handle<> handle_;
+#endif
+    unvme_iod_t         iod_;       ///< pending descriptor
+    io_result           res_;       ///< completion
+};
+
+/// Read blocks asynchronously (see unvme_aread)
+inline io_op read(const unvme_ns_t* ns, int qid, void* buf, u64 slba, u32 nlb)
+{
+    return io_op(unvme_aread(ns, qid, buf, slba, nlb));
+}
+
+/// Write blocks asynchronously (see unvme_awrite)
+inline io_op write(const unvme_ns_t* ns, int qid, const void* buf, u64 slba, u32 nlb)
+{
+    return io_op(unvme_awrite(ns, qid, buf, slba, nlb));
+}
+
+/// Send a translation (NDP) request (see unvme_atranslate_region)
+inline io_op translate_region(const unvme_ns_t* ns, int qid, void* buf,
+                              u64 slba, u32 nlb, u32 config_nlb)
+{
+    return io_op(unvme_atranslate_region(ns, qid, buf, slba, nlb, config_nlb));
+}
+
+/// Fire the callbacks of a queue's completed operations (see unvme_progress)
+inline int progress(const unvme_ns_t* ns, int qid, int max = UNVME_QSIZE)
+{
+    return unvme_progress(ns, qid, max);
+}
+
+} // namespace unvme
+
+#endif // _UNVME_HPP
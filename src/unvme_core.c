@@ -35,9 +35,16 @@
  */
 
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
 #include <string.h>
+#include <errno.h>
 #include <signal.h>
 #include <sched.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "rdtsc.h"
 #include "unvme_core.h"
@@ -68,32 +75,76 @@
 #define PDEBUG(fmt, arg...) //fprintf(stderr, fmt "\n", ##arg)
 
 /// Log and print an unrecoverable error message and exit
-#define FATAL(fmt, arg...)  do { ERROR(fmt, ##arg); abort(); } while (0)
+#define FATAL(fmt, arg...)  do { ERROR(fmt, ##arg); log_flush(); abort(); } while (0)
 
 
 // Global static variables
 static const char*      unvme_log = "/dev/shm/unvme.log";   ///< Log filename
 static unvme_session_t* unvme_ses = NULL;                   ///< session list
 static unvme_lock_t     unvme_lock = 0;                     ///< session lock
+static unvme_device_t*  unvme_kept = NULL;          ///< kept alive devices
+static int              unvme_keepalive = 0;        ///< keep closed devices
 static u64              unvme_rdtsec;                   ///< rdtsc per second
+static u64              unvme_nsmul;            ///< tsc to nsec (<< 20) multiplier
+static __thread const unvme_ns_t* unvme_tns = NULL;     ///< thread bound ns
+static __thread int     unvme_tqid = -1;                ///< thread bound queue
 
 
 /**
- * Get a descriptor entry by moving from the free to the use list.
+ * Allocate zeroed cache line aligned memory.
+ * @param   size    size in bytes
+ * @return  the allocated memory.
+ */
+static void* unvme_zalloc_aligned(size_t size)
+{
+    void* p;
+    if (posix_memalign(&p, 64, size))
+        FATAL("posix_memalign %#lx", size);
+    return memset(p, 0, size);
+}
+
+/**
+ * Add a block of queue size descriptors to the free stack of a queue.
+ * A queue starts with one block, which covers a descriptor per cid, and
+ * only grows when more completed descriptors are left unpolled.
  * @param   ioq     IO queue context
- * @return  the descriptor added to the use list.
  */
-static unvme_desc_t* unvme_desc_get(unvme_ioq_t* ioq)
+static void unvme_desc_grow(unvme_ioq_t* ioq)
 {
-    unvme_desc_t* desc;
+    int n = ioq->nvmeq.size;
+    unvme_desc_t* block = unvme_zalloc_aligned(n * sizeof(unvme_desc_t));
+    ioq->descpool = realloc(ioq->descpool,
+                            (ioq->descpools + 1) * sizeof(unvme_desc_t*));
+    ioq->descpool[ioq->descpools++] = block;
 
-    if (ioq->descfree) {
-        desc = ioq->descfree;
-        LIST_DEL(ioq->descfree, desc);
-    } else {
-        desc = zalloc(sizeof(unvme_desc_t) + ioq->masksize);
-        desc->ioq = ioq;
+    int i;
+    for (i = n - 1; i >= 0; i--) {
+        block[i].ioq = ioq;
+        block[i].next = ioq->descfree;
+        ioq->descfree = block + i;
     }
+}
+
+/**
+ * Get a descriptor entry by moving from the free stack to the use list.
+ * @param   ioq     IO queue context
+ * @return  the descriptor added to the use list.
+ */
+static unvme_desc_t* unvme_desc_get(unvme_ioq_t* ioq)
+{
+    if (!ioq->descfree) unvme_desc_grow(ioq);
+    unvme_desc_t* desc = ioq->descfree;
+    ioq->descfree = desc->next;
+
+    // clear only what the submission does not set
+    desc->buf = desc->sentinel = NULL;
+    desc->slba = 0;
+    desc->nlb = 0;
+    desc->error = 0;
+    desc->cs = 0;
+    desc->cb = NULL;
+    desc->cbarg = NULL;
+    desc->staging = 1;
     LIST_ADD(ioq->desclist, desc);
 
     if (desc == desc->next) {
@@ -108,26 +159,175 @@ static unvme_desc_t* unvme_desc_get(unvme_ioq_t* ioq)
 }
 
 /**
- * Put a descriptor entry back by moving it from the use to the free list.
+ * Append a descriptor whose cids have all completed to the reap list.
+ * @param   desc    descriptor
+ */
+static void unvme_done_add(unvme_desc_t* desc)
+{
+    unvme_ioq_t* ioq = desc->ioq;
+    unvme_desc_t* head = ioq->donelist;
+
+    if (head) {
+        desc->donenext = head;
+        desc->doneprev = head->doneprev;
+        head->doneprev->donenext = desc;
+        head->doneprev = desc;
+    } else {
+        desc->donenext = desc->doneprev = desc;
+        ioq->donelist = desc;
+    }
+}
+
+/**
+ * Remove a descriptor from the reap list.
+ * @param   desc    descriptor
+ */
+static void unvme_done_del(unvme_desc_t* desc)
+{
+    unvme_ioq_t* ioq = desc->ioq;
+
+    if (desc->donenext != desc) {
+        desc->donenext->doneprev = desc->doneprev;
+        desc->doneprev->donenext = desc->donenext;
+        if (ioq->donelist == desc) ioq->donelist = desc->donenext;
+    } else {
+        ioq->donelist = NULL;
+    }
+    desc->donenext = desc->doneprev = NULL;
+}
+
+/**
+ * Mark a descriptor as having all its commands submitted, adding it to the
+ * reap list if they have already completed.
+ * @param   desc    descriptor
+ */
+static void unvme_desc_staged(unvme_desc_t* desc)
+{
+    desc->staging = 0;
+    if (desc->cidcount == 0) unvme_done_add(desc);
+}
+
+/**
+ * Put a descriptor entry back by moving it from the use list to the free
+ * stack.
  * @param   desc    descriptor
  */
 static void unvme_desc_put(unvme_desc_t* desc)
 {
     unvme_ioq_t* ioq = desc->ioq;
 
+    if (desc->donenext) unvme_done_del(desc);
+
     if (ioq->descnext == desc) {
         if (desc != desc->next) ioq->descnext = desc->next;
         else ioq->descnext = NULL;
     }
 
     LIST_DEL(ioq->desclist, desc);
-    memset(desc, 0, sizeof(unvme_desc_t) + ioq->masksize);
-    desc->ioq = ioq;
-    LIST_ADD(ioq->descfree, desc);
+    desc->id = 0;
+    desc->buf = desc->sentinel = NULL;
+    desc->next = ioq->descfree;
+    ioq->descfree = desc;
 
     ioq->desccount--;
 }
 
+/**
+ * Sleep on a queue's completion event until it is signaled or endtsc.
+ * @param   ioq         io queue context
+ * @param   endtsc      tsc to wake up by
+ */
+static void unvme_ioq_sleep(unvme_ioq_t* ioq, u64 endtsc)
+{
+    u64 tsc = rdtsc();
+    if (tsc >= endtsc) return;
+
+    // an interrupt since the last check leaves the event readable
+    struct pollfd pfd = { .fd = ioq->efd, .events = POLLIN };
+    int ms = (endtsc - tsc) * 1000 / unvme_rdtsec + 1;
+    if (poll(&pfd, 1, ms) > 0) {
+        u64 count;
+        if (read(ioq->efd, &count, sizeof(count)) < 0) sched_yield();
+    }
+}
+
+/**
+ * Lock an I/O queue if it is shared by multiple threads.
+ * @param   ioq         IO queue
+ * @return  1 if locked else 0.
+ */
+static inline int unvme_ioq_lock(unvme_ioq_t* ioq)
+{
+    if (!ioq->shared) return 0;
+    unvme_lockw(&ioq->lock);
+    return 1;
+}
+
+/**
+ * Unlock an I/O queue locked by unvme_ioq_lock.
+ * @param   ioq         IO queue
+ * @param   locked      unvme_ioq_lock return value
+ */
+static inline void unvme_ioq_unlock(unvme_ioq_t* ioq, int locked)
+{
+    if (locked) unvme_unlockw(&ioq->lock);
+}
+
+/**
+ * Ring the submission doorbell of a queue if it has new entries.
+ * @param   ioq         IO queue
+ */
+static inline void unvme_ring_sq(unvme_ioq_t* ioq)
+{
+    ioq->stats->sqdb += nvme_ring_sq(&ioq->nvmeq);
+}
+
+/**
+ * Ring the completion doorbell of a queue if it has consumed entries.
+ * @param   ioq         IO queue
+ */
+static inline void unvme_ring_cq(unvme_ioq_t* ioq)
+{
+    ioq->stats->cqdb += nvme_ring_cq(&ioq->nvmeq);
+}
+
+/**
+ * Get the statistics class of a command.
+ * @param   opc         op code
+ * @param   rsvd12      translation command flag
+ * @return  statistics class.
+ */
+static inline int unvme_stat_class(int opc, int rsvd12)
+{
+    if (opc == NVME_CMD_READ)
+        return rsvd12 ? UNVME_STAT_NDP_READ : UNVME_STAT_READ;
+    if (opc == NVME_CMD_WRITE)
+        return rsvd12 ? UNVME_STAT_NDP_WRITE : UNVME_STAT_WRITE;
+    return UNVME_STAT_OTHER;
+}
+
+/**
+ * Record a completion latency in a log-linear histogram.
+ * @param   hist        latency histogram
+ * @param   tsc         latency in tsc
+ */
+static inline void unvme_stat_latency(unvme_lat_hist_t* hist, u64 tsc)
+{
+    u64 ns = (tsc * unvme_nsmul) >> 20;
+    int sub = 1 << UNVME_STAT_SUBBITS;
+    int b = ns;
+    if (ns >= sub) {
+        int msb = 63 - __builtin_clzll(ns);
+        b = ((msb - UNVME_STAT_SUBBITS + 1) << UNVME_STAT_SUBBITS) +
+            ((ns >> (msb - UNVME_STAT_SUBBITS)) & (sub - 1));
+        if (b >= UNVME_STAT_BUCKETS) b = UNVME_STAT_BUCKETS - 1;
+    }
+    hist->bucket[b]++;
+    hist->count++;
+    hist->sumns += ns;
+    if (ns > hist->maxns) hist->maxns = ns;
+}
+
 /**
  * Process an I/O completion.
  * @param   ioq         io queue context
@@ -139,30 +339,47 @@ static int unvme_complete_io(unvme_ioq_t* ioq, int timeout, u32* cqe_cs)
 {
     // wait for completion
     int err, cid;
-    u64 endtsc = 0;
+    u32 cs;
+    u64 endtsc = 0, sleeptsc = 0;
     do {
-        cid = nvme_check_completion(&ioq->nvmeq, &err, cqe_cs);
-        if (cid >= 0 || timeout == 0) break;
-        if (endtsc == 0) endtsc = rdtsc() + timeout * unvme_rdtsec;
-        else sched_yield();
+        cid = nvme_check_completion(&ioq->nvmeq, &err, &cs);
+        if (cid >= 0) break;
+        // nothing to reap, so signal any deferred doorbells before waiting
+        if (endtsc == 0) {
+            unvme_ring_sq(ioq);
+            unvme_ring_cq(ioq);
+        }
+        if (timeout == 0) break;
+        if (endtsc == 0) {
+            u64 tsc = rdtsc();
+            endtsc = tsc + timeout * unvme_rdtsec;
+            sleeptsc = tsc + ioq->spintsc;
+        } else if (ioq->efd >= 0 && rdtsc() >= sleeptsc) {
+            unvme_ioq_sleep(ioq, endtsc);
+        } else {
+            sched_yield();
+        }
     } while (rdtsc() < endtsc);
     if (cid < 0) return cid;
+    if (cqe_cs) *cqe_cs = cs;
 
-    // find the pending cid in the descriptor list to clear it
-    unvme_desc_t* desc = ioq->descnext;
+    // look up the descriptor owning the pending cid to clear it
     int b = cid >> 6;
     u64 mask = (u64)1 << (cid & 63);
-    while ((desc->cidmask[b] & mask) == 0) {
-        desc = desc->next;
-        if (desc == ioq->descnext) {
-            ERROR("pending cid %d not found", cid);
-            abort();
-        }
-    }
+    unvme_desc_t* desc = cid < ioq->nvmeq.size ? ioq->cidmap[cid] : NULL;
+    if (!desc || (ioq->cidmask[b] & mask) == 0)
+        FATAL("pending cid %d not found", cid);
+    ioq->cidmap[cid] = NULL;
     if (err) desc->error = err;
+    desc->cs = cs;
+
+    int cls = ioq->cidclass[cid];
+    unvme_stat_latency(&ioq->stats->lat[cls], rdtsc() - ioq->cidtsc[cid]);
+    if (err) ioq->stats->errors[cls]++;
 
-    desc->cidmask[b] &= ~mask;
-    desc->cidcount--;
+    // a descriptor still being submitted (whose earlier commands completed
+    // to free a slot) is added once all its commands are submitted
+    if (--desc->cidcount == 0 && !desc->staging) unvme_done_add(desc);
     ioq->cidmask[b] &= ~mask;
     ioq->cidcount--;
     ioq->cid = cid;
@@ -171,117 +388,317 @@ static int unvme_complete_io(unvme_ioq_t* ioq, int timeout, u32* cqe_cs)
     if (ioq->cidcount) {
         while (ioq->descnext->cidcount == 0) ioq->descnext = ioq->descnext->next;
     }
-    PDEBUG("# c q%d={%d %d %#lx} d={%d %d %#lx} @%d",
+    PDEBUG("# c q%d={%d %d %#lx} d={%d %d} @%d",
            ioq->nvmeq.id, cid, ioq->cidcount, *ioq->cidmask,
-           desc->id, desc->cidcount, *desc->cidmask, ioq->descnext->id);
+           desc->id, desc->cidcount, ioq->descnext->id);
     return err;
 }
 
 /**
- * Submit a single read/write command within the device limit.
+ * Find the index of the allocated memory containing a buffer address.
+ * The iomem map is kept sorted by buffer address, so this is a binary search.
+ * @param   iomem       IO memory tracker
+ * @param   buf         buffer address
+ * @return  map index or -1 if not found.
+ */
+static int unvme_iomem_find(unvme_iomem_t* iomem, void* buf)
+{
+    int lo = 0, hi = iomem->count - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) >> 1;
+        vfio_dma_t* dma = iomem->map[mid];
+        if (buf < dma->buf) hi = mid - 1;
+        else if (buf >= (dma->buf + dma->size)) lo = mid + 1;
+        else return mid;
+    }
+    return -1;
+}
+
+/**
+ * Add an allocated memory to the iomem map in buffer address order.
+ * Caller must hold the iomem write lock.
+ * @param   iomem       IO memory tracker
+ * @param   dma         dma memory
+ */
+static void unvme_iomem_add(unvme_iomem_t* iomem, vfio_dma_t* dma)
+{
+    if (iomem->count == iomem->size) {
+        iomem->size += 256;
+        iomem->map = realloc(iomem->map, iomem->size * sizeof(void*));
+    }
+
+    int lo = 0, hi = iomem->count;
+    while (lo < hi) {
+        int mid = (lo + hi) >> 1;
+        if (iomem->map[mid]->buf < dma->buf) lo = mid + 1;
+        else hi = mid;
+    }
+    memmove(iomem->map + lo + 1, iomem->map + lo,
+            (iomem->count - lo) * sizeof(void*));
+    iomem->map[lo] = dma;
+    iomem->count++;
+}
+
+/**
+ * Resolve a buffer to its I/O DMA address.
  * @param   ns          namespace handle
- * @param   desc        descriptor
  * @param   buf         data buffer
- * @param   slba        starting lba
- * @param   nlb         number of logical blocks
- * @return  cid if ok else -1.
+ * @param   size        data size
+ * @param   addr        returned DMA address
+ * @return  0 if ok else -1.
  */
-static int unvme_submit_io(const unvme_ns_t* ns, unvme_desc_t* desc,
-                           void* buf, u64 slba, u32 nlb, int rsvd12)
+static int unvme_dma_addr(const unvme_ns_t* ns, void* buf, u64 size, u64* addr)
 {
     unvme_device_t* dev = ((unvme_session_t*)ns->ses)->dev;
-    unvme_ioq_t* ioq = desc->ioq;
 
-    if (nlb > ns->maxbpio) {
-        ERROR("block count %d exceeds limit %d", nlb, ns->maxbpio);
+    unvme_lockr(&dev->iomem.lock);
+    int i = unvme_iomem_find(&dev->iomem, buf);
+    vfio_dma_t* dma = i < 0 ? NULL : dev->iomem.map[i];
+    unvme_unlockr(&dev->iomem.lock);
+    if (!dma) {
+        ERROR("invalid I/O buffer address");
         return -1;
     }
 
-    u64 addr = 0;
-    int i;
-    // Flush commands don't need a buffer address
-    if (desc->opc != NVME_CMD_FLUSH)
-    {
-        // find DMA buffer address
-        vfio_dma_t* dma = NULL;
-        unvme_lockr(&dev->iomem.lock);
-        for (i = 0; i < dev->iomem.count; i++) {
-            dma = dev->iomem.map[i];
-            if (dma->buf <= buf && buf < (dma->buf + dma->size)) break;
-        }
-        unvme_unlockr(&dev->iomem.lock);
-        if (i == dev->iomem.count) {
-            ERROR("invalid I/O buffer address");
-            return -1;
-        }
+    *addr = dma->addr + (u64)(buf - dma->buf);
+    if ((*addr & (ns->blocksize - 1)) != 0) {
+        ERROR("unaligned buffer address");
+        return -1;
+    }
+    if ((*addr + size) > (dma->addr + dma->size)) {
+        ERROR("buffer overrun");
+        return -1;
+    }
+    return 0;
+}
 
-        addr = dma->addr + (u64)(buf - dma->buf);
-        if ((addr & (ns->blocksize - 1)) != 0) {
-            ERROR("unaligned buffer address");
-            return -1;
-        }
-        if ((addr + nlb * ns->blocksize) > (dma->addr + dma->size)) {
-            ERROR("buffer overrun");
+/**
+ * Add an entry to the PRP list of a command, chaining to the next list page
+ * of the command when only the last entry of a page is left and more
+ * entries are to follow.
+ * @param   prp         PRP list cursor
+ * @param   page        page DMA address
+ * @param   left        number of entries left including this one
+ */
+static inline void unvme_prp_add(unvme_prp_t* prp, u64 page, int left)
+{
+    if (prp->slot == prp->epp - 1 && left > 1) {
+        prp->next += prp->epp << 3;
+        *prp->list++ = prp->next;
+        prp->slot = 0;
+    }
+    *prp->list++ = page;
+    prp->slot++;
+}
+
+/**
+ * Get the queue depth limit of a command: plain writes count the slots
+ * reserved for the other classes as full.
+ * @param   ns          namespace handle
+ * @param   ioq         IO queue
+ * @param   opc         op code
+ * @param   rsvd12      translation command flag
+ * @return  the number of cids the command may bring the queue up to.
+ */
+static inline int unvme_ioq_limit(const unvme_ns_t* ns, unvme_ioq_t* ioq,
+                                  int opc, int rsvd12)
+{
+    if (opc == NVME_CMD_WRITE && !rsvd12) return ns->qsize - ioq->reserve;
+    return ns->qsize;
+}
+
+/**
+ * Make room for the commands of a request on a non-blocking queue, so a
+ * request is either submitted whole or not at all.  Completions already
+ * posted are processed, but never waited for.
+ * @param   ns          namespace handle
+ * @param   ioq         IO queue
+ * @param   opc         op code
+ * @param   rsvd12      translation command flag
+ * @param   count       number of commands of the request
+ * @return  0 if ok else -1 with errno EAGAIN (queue full) or EINVAL.
+ */
+static int unvme_ioq_room(const unvme_ns_t* ns, unvme_ioq_t* ioq,
+                          int opc, int rsvd12, int count)
+{
+    if (!ioq->nonblock) return 0;
+    int limit = unvme_ioq_limit(ns, ioq, opc, rsvd12);
+    if (count >= limit) {
+        ERROR("%d commands exceed q%d depth %d", count, ioq->nvmeq.id, limit - 1);
+        errno = EINVAL;
+        return -1;
+    }
+    while ((ioq->cidcount + count) >= limit) {
+        if (unvme_complete_io(ioq, 0, NULL) == -1) {
+            ioq->stats->sqfull++;
+            errno = EAGAIN;
             return -1;
         }
     }
+    return 0;
+}
+
+/**
+ * Get the number of blocks of the next command of a read/write, which ends
+ * on a page boundary when unaligned to stay within maxppio.
+ * @param   ns          namespace handle
+ * @param   addr        command data DMA address (block aligned)
+ * @param   nlb         number of logical blocks left
+ * @return  the number of blocks.
+ */
+static inline u32 unvme_chunk_nlb(const unvme_ns_t* ns, u64 addr, u32 nlb)
+{
+    u32 n = ns->maxbpio - ((addr & (ns->pagesize - 1)) >> ns->blockshift);
+    return n < nlb ? n : nlb;
+}
+
+/**
+ * Count the commands unvme_submit_chunks splits a read/write into.
+ * @param   ns          namespace handle
+ * @param   sg          data buffer DMA segments
+ * @param   nlb         number of logical blocks
+ * @return  the number of commands.
+ */
+static int unvme_chunk_count(const unvme_ns_t* ns, const unvme_sg_t* sg, u32 nlb)
+{
+    u64 off = 0;
+    int count = 0;
+    while (nlb) {
+        u32 n = unvme_chunk_nlb(ns, sg->addr + off, nlb);
+        count++;
+        nlb -= n;
+        off += (u64)n << ns->blockshift;
+        while (nlb && off >= sg->len) off -= (sg++)->len;
+    }
+    return count;
+}
+
+/**
+ * Submit a single read/write command within the device limit.  The command
+ * data starts at an offset of the first DMA segment and may continue into
+ * the following segments, which must start on a page boundary.
+ * @param   ns          namespace handle
+ * @param   desc        descriptor
+ * @param   opc         op code
+ * @param   sg          data buffer DMA segments
+ * @param   off         data offset in the first segment
+ * @param   slba        starting lba
+ * @param   nlb         number of logical blocks
+ * @param   rsvd12      translation command flag (cdw12 reserved bits)
+ * @return  cid if ok else -1.
+ */
+static int unvme_submit_io(const unvme_ns_t* ns, unvme_desc_t* desc, int opc,
+                           const unvme_sg_t* sg, u64 off, u64 slba, u32 nlb,
+                           int rsvd12)
+{
+    unvme_ioq_t* ioq = desc->ioq;
+
+    if (nlb > ns->maxbpio) {
+        ERROR("block count %d exceeds limit %d", nlb, ns->maxbpio);
+        return -1;
+    }
 
     // find a free cid
     // if submission queue is full then process a pending entry first
     u16 cid;
-    if ((ioq->cidcount + 1) < ns->qsize) {
-        cid = ioq->cid;
-        while (ioq->cidmask[cid >> 6] & ((u64)1 << (cid & 63))) {
-            if (++cid >= ns->qsize) cid = 0;
+    int limit = unvme_ioq_limit(ns, ioq, opc, rsvd12);
+    if ((ioq->cidcount + 1) < limit) {
+        // scan the pending mask a word at a time from the last used cid
+        // (bits beyond qsize are preset so a free cid is always in range)
+        int b = ioq->cid >> 6;
+        u64 avail = ~ioq->cidmask[b] & (~(u64)0 << (ioq->cid & 63));
+        while (!avail) {
+            if (++b == (ioq->masksize >> 3)) b = 0;
+            avail = ~ioq->cidmask[b];
         }
+        cid = (b << 6) + __builtin_ctzll(avail);
         ioq->cid = cid;
     } else {
-        // if process completion error, clear the current pending descriptor
-        unvme_desc_t* desc = ioq->descnext;
-        int err = unvme_complete_io(ioq, UNVME_TIMEOUT, NULL);
-        if (err != 0) {
-            if (err == -1) {
-                ERROR("q%d timeout", ioq->nvmeq.id);
-                abort();
-            }
-            while (desc->cidcount) {
-                if (unvme_complete_io(ioq, UNVME_TIMEOUT, NULL) == -1) {
-                    ERROR("q%d timeout", ioq->nvmeq.id);
-                    abort();
+        // any completion (including a failed one) frees its cid, and the
+        // error status is left on the owning descriptor for its poll
+        ioq->stats->sqfull++;
+        do {
+            if (ioq->nonblock) {
+                if (unvme_complete_io(ioq, 0, NULL) == -1) {
+                    errno = EAGAIN;
+                    return -1;
                 }
+            } else if (unvme_complete_io(ioq, UNVME_TIMEOUT, NULL) == -1) {
+                ERROR("q%d timeout", ioq->nvmeq.id);
+                errno = ETIMEDOUT;
+                return -1;
             }
-        }
+        } while ((ioq->cidcount + 1) >= limit);
         cid = ioq->cid;
     }
 
     // compose PRPs based on cid
-    int numpages = (nlb + ns->nbpp - 1) >> ns->bpshift;
+    // a DMA segment is contiguous in IO address space, so the pages after
+    // the first (which may start at a block offset) are derived from addr
+    u64 pagemask = ns->pagesize - 1;
+    u64 len = (u64)nlb << ns->blockshift;
+    u64 addr = sg->addr + off;
+    u64 seglen = sg->len - off;
     u64 prp1 = addr;
     u64 prp2 = 0;
-    if (numpages == 2) {
-        prp2 = addr + ns->pagesize;
+    int numpages;
+    if (len <= seglen) {
+        numpages = ((addr & pagemask) + len + pagemask) >> ns->pageshift;
+    } else {
+        const unvme_sg_t* s = sg;
+        u64 n = len - seglen;
+        numpages = ((addr & pagemask) + seglen + pagemask) >> ns->pageshift;
+        while (n) {
+            u64 bytes = (++s)->len < n ? s->len : n;
+            numpages += (bytes + pagemask) >> ns->pageshift;
+            n -= bytes;
+        }
+    }
+
+    if (numpages == 2 && len <= seglen) {
+        prp2 = (addr & ~pagemask) + ns->pagesize;
+    } else if (numpages == 2) {
+        prp2 = sg[1].addr;
     } else if (numpages > 2) {
-        int prpoff = cid << ns->pageshift;
-        u64* prplist = ioq->prplist->buf + prpoff;
-        prp2 = ioq->prplist->addr + prpoff;
-        for (i = 1; i < numpages; i++) {
-            addr += ns->pagesize;
-            *prplist++ = addr;
+        int prpoff = (cid * UNVME_PRPPAGES) << ns->pageshift;
+        unvme_prp_t prp = { .list = ioq->prplist.buf + prpoff, .slot = 0,
+                            .epp = ns->pagesize >> 3,
+                            .next = ioq->prplist.addr + prpoff };
+        prp2 = prp.next;
+        int left = numpages - 1;
+        const unvme_sg_t* s = sg;
+        u64 page = addr & ~pagemask;
+        u64 end = addr + (len < seglen ? len : seglen);
+        for (;;) {
+            for (page += ns->pagesize; page < end; page += ns->pagesize)
+                unvme_prp_add(&prp, page, left--);
+            if (!left) break;
+            // continue at the (page aligned) start of the next segment
+            len -= end - addr;
+            addr = page = (++s)->addr;
+            end = addr + (len < s->len ? len : s->len);
+            unvme_prp_add(&prp, page, left--);
         }
     }
 
-    if (nvme_cmd_rw_extended(&ioq->nvmeq, desc->opc, cid,
+    if (nvme_cmd_rw_extended(&ioq->nvmeq, opc, cid,
                     ns->id, slba, nlb, prp1, prp2, rsvd12) == 0) {
         int b = cid >> 6;
         u64 mask = (u64)1 << (cid & 63);
         ioq->cidmask[b] |= mask;
         ioq->cidcount++;
-        desc->cidmask[b] |= mask;
+        ioq->cidmap[cid] = desc;
         desc->cidcount++;
-        PDEBUG("# %c %#lx %#x q%d={%d %d %#lx} d={%d %d %#lx}",
-               desc->opc == NVME_CMD_READ ? 'r' : 'w', slba, nlb,
+
+        int cls = unvme_stat_class(opc, rsvd12);
+        ioq->cidtsc[cid] = rdtsc();
+        ioq->cidclass[cid] = cls;
+        ioq->stats->submits[cls]++;
+        ioq->stats->qdepth[31 - __builtin_clz(ioq->cidcount)]++;
+        PDEBUG("# %c %#lx %#x q%d={%d %d %#lx} d={%d %d}",
+               opc == NVME_CMD_READ ? 'r' : 'w', slba, nlb,
                ioq->nvmeq.id, cid, ioq->cidcount, *ioq->cidmask,
-               desc->id, desc->cidcount, *desc->cidmask);
+               desc->id, desc->cidcount);
         return cid;
     }
     else
@@ -321,7 +738,33 @@ static void unvme_adminq_delete(unvme_device_t* dev)
 }
 
 /**
- * Create an I/O queue.
+ * Return the page aligned bytes of a queue memory area.
+ */
+static inline u64 unvme_qarea(const unvme_device_t* dev, u64 size)
+{
+    return (size + dev->ns.pagesize - 1) & ~(u64)(dev->ns.pagesize - 1);
+}
+
+/**
+ * Allocate the submission and completion rings and the PRP lists of all I/O
+ * queues as one DMA region, so a device takes a single IOMMU mapping for
+ * them however many queues are used.  Each queue takes a page aligned slice.
+ * @param   dev         device context
+ */
+static void unvme_qdma_create(unvme_device_t* dev)
+{
+    u64 qsize = dev->ns.qsize;
+    dev->qslice = unvme_qarea(dev, qsize * sizeof(nvme_sq_entry_t)) +
+                  unvme_qarea(dev, qsize * sizeof(nvme_cq_entry_t)) +
+                  ((qsize * UNVME_PRPPAGES) << dev->ns.pageshift);
+    dev->qdma = vfio_dma_alloc_huge(&dev->vfiodev, dev->qslice * dev->ns.qcount,
+                                    UNVME_HUGEPAGE_2MB);
+    if (!dev->qdma)
+        FATAL("vfio_dma_alloc");
+}
+
+/**
+ * Create an I/O queue in its slice of the queue DMA region.
  * @param   dev         device context
  * @param   q           queue index starting at 0
  */
@@ -329,28 +772,36 @@ static void unvme_ioq_create(unvme_device_t* dev, int q)
 {
     unvme_ioq_t* ioq = dev->ioqs + q;
     int qsize = dev->ns.qsize;
-    ioq->sqdma = vfio_dma_alloc(&dev->vfiodev, qsize * sizeof(nvme_sq_entry_t));
-    ioq->cqdma = vfio_dma_alloc(&dev->vfiodev, qsize * sizeof(nvme_sq_entry_t));
-    if (!ioq->sqdma || !ioq->cqdma)
-        FATAL("vfio_dma_alloc");
+    u64 off = dev->qslice * q;
+    unvme_dmaseg_t* segs[] = { &ioq->sqdma, &ioq->cqdma, &ioq->prplist };
+    u64 sizes[] = { unvme_qarea(dev, qsize * sizeof(nvme_sq_entry_t)),
+                    unvme_qarea(dev, qsize * sizeof(nvme_cq_entry_t)),
+                    ((u64)qsize * UNVME_PRPPAGES) << dev->ns.pageshift };
+    int i;
+    for (i = 0; i < 3; i++) {
+        segs[i]->buf = dev->qdma->buf + off;
+        segs[i]->addr = dev->qdma->addr + off;
+        segs[i]->size = sizes[i];
+        off += sizes[i];
+    }
+
     if (!nvme_create_ioq(&dev->nvmedev, &ioq->nvmeq, q + 1, qsize,
-                         ioq->sqdma->buf, ioq->sqdma->addr,
-                         ioq->cqdma->buf, ioq->cqdma->addr))
+                         ioq->sqdma.buf, ioq->sqdma.addr,
+                         ioq->cqdma.buf, ioq->cqdma.addr))
         FATAL("nvme_create_ioq %d failed", q + 1);
+    ioq->nvmeq.batch = 1;
+    ioq->efd = -1;
+    ioq->cidtsc = zalloc(qsize * sizeof(u64));
+    ioq->cidclass = zalloc(qsize);
 
     // setup descriptors and pending masks
     ioq->masksize = ((qsize + 63) >> 6) << 3; // ((qsize + 63) / 64) * sizeof(u64);
     ioq->cidmask = zalloc(ioq->masksize);
-    int i;
-    for (i = 0; i < 16; i++) unvme_desc_get(ioq);
-    ioq->descfree = ioq->desclist;
-    ioq->desclist = NULL;
-    ioq->desccount = 0;
-
-    // allocate PRP list pages (assume maxppio fits in 1 PRP list page)
-    ioq->prplist = vfio_dma_alloc(&dev->vfiodev, qsize << dev->ns.pageshift);
-    if (!ioq->prplist)
-        FATAL("vfio_dma_alloc");
+    for (i = qsize; i < (ioq->masksize << 3); i++)
+        ioq->cidmask[i >> 6] |= (u64)1 << (i & 63);
+    ioq->cidmap = zalloc(qsize * sizeof(unvme_desc_t*));
+    unvme_desc_grow(ioq);
+    __atomic_store_n(&ioq->ready, 1, __ATOMIC_RELEASE);
 
     DEBUG_FN("%x q=%d qd=%d db=%#04lx", dev->vfiodev.pci, ioq->nvmeq.id, qsize,
              (u64)ioq->nvmeq.sq_doorbell - (u64)dev->nvmedev.reg);
@@ -363,27 +814,89 @@ static void unvme_ioq_create(unvme_device_t* dev, int q)
  */
 static void unvme_ioq_delete(unvme_device_t* dev, int q)
 {
-    DEBUG_FN("%x %d", dev->vfiodev.pci, q + 1);
     unvme_ioq_t* ioq = &dev->ioqs[q];
+    if (!ioq->ready) return;
+    DEBUG_FN("%x %d", dev->vfiodev.pci, q + 1);
 
     // free all descriptors
-    unvme_desc_t* desc;
-    while ((desc = ioq->desclist) != NULL) {
-        LIST_DEL(ioq->desclist, desc);
-        free(desc);
-    }
-    while ((desc = ioq->descfree) != NULL) {
-        LIST_DEL(ioq->descfree, desc);
-        free(desc);
-    }
+    int i;
+    for (i = 0; i < ioq->descpools; i++) free(ioq->descpool[i]);
+    free(ioq->descpool);
 
+    if (ioq->efd >= 0) close(ioq->efd);
     if (ioq->cidmask) free(ioq->cidmask);
-    if (ioq->prplist) vfio_dma_free(ioq->prplist);
-    if (ioq->cqdma) vfio_dma_free(ioq->cqdma);
-    if (ioq->sqdma) vfio_dma_free(ioq->sqdma);
+    if (ioq->cidmap) free(ioq->cidmap);
+    if (ioq->cidtsc) free(ioq->cidtsc);
+    if (ioq->cidclass) free(ioq->cidclass);
     memset(ioq, 0, sizeof(*ioq));
 }
 
+/**
+ * Get an I/O queue, creating its queue pair on first use.
+ * @param   ns          namespace handle
+ * @param   qid         queue id
+ * @return  the I/O queue.
+ */
+static unvme_ioq_t* unvme_ioq_get(const unvme_ns_t* ns, int qid)
+{
+    unvme_device_t* dev = ((unvme_session_t*)ns->ses)->dev;
+    unvme_ioq_t* ioq = dev->ioqs + qid;
+    if (!__atomic_load_n(&ioq->ready, __ATOMIC_ACQUIRE)) {
+        // queue creation goes through the admin queue, so serialize it
+        unvme_lockw(&unvme_lock);
+        if (!ioq->ready) unvme_ioq_create(dev, qid);
+        unvme_unlockw(&unvme_lock);
+    }
+    return ioq;
+}
+
+/**
+ * Map the statistics file of a device in shared memory, so the counters
+ * can be read by other processes.  The file is left in place on close
+ * (like the log) and is replaced when the device is opened again.
+ * @param   dev         device context
+ */
+static void unvme_stats_create(unvme_device_t* dev)
+{
+    char path[64];
+    sprintf(path, "/dev/shm/unvme.%s.stats", dev->ns.device);
+    size_t size = sizeof(unvme_stats_shm_t) + dev->ns.qcount * sizeof(unvme_qstats_t);
+    void* map = MAP_FAILED;
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd >= 0) {
+        if (ftruncate(fd, size) == 0)
+            map = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+    }
+    if (map == MAP_FAILED) {
+        // keep the statistics private if the file cannot be mapped
+        ERROR("%s: %s", path, strerror(errno));
+        map = mmap(0, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED)
+            FATAL("mmap: %s", strerror(errno));
+    }
+
+    unvme_stats_shm_t* stats = map;
+    stats->size = size;
+    stats->qcount = dev->ns.qcount;
+    stats->qsize = dev->ns.qsize;
+    stats->tscsec = unvme_rdtsec;
+    strcpy(stats->device, dev->ns.device);
+    stats->magic = UNVME_STAT_MAGIC;
+    dev->stats = stats;
+}
+
+/**
+ * Unmap the statistics file of a device.
+ * @param   dev         device context
+ */
+static void unvme_stats_delete(unvme_device_t* dev)
+{
+    if (dev->stats) munmap(dev->stats, dev->stats->size);
+    dev->stats = NULL;
+}
+
 /**
  * Initialize a namespace instance.
  * @param   ns          namespace context
@@ -405,6 +918,8 @@ static void unvme_ns_init(unvme_ns_t* ns, int nsid)
     ns->bpshift = ns->pageshift - ns->blockshift;
     ns->nbpp = 1 << ns->bpshift;
     ns->pagecount = ns->blockcount >> ns->bpshift;
+    if (((u32)ns->maxppio << ns->bpshift) > 0xffff)
+        ns->maxppio = 0x8000 >> ns->bpshift;
     ns->maxbpio = ns->maxppio << ns->bpshift;
     vfio_dma_free(dma);
 
@@ -414,44 +929,118 @@ static void unvme_ns_init(unvme_ns_t* ns, int nsid)
 }
 
 /**
- * Clean up.
+ * Delete a device context.
+ * @param   dev         device context
  */
-static void unvme_cleanup(unvme_session_t* ses)
+static void unvme_device_delete(unvme_device_t* dev)
 {
-    unvme_device_t* dev = ses->dev;
-    if (--dev->refcount == 0) {
-        DEBUG_FN("%s", ses->ns.device);
-        int q;
-        for (q = 0; q < dev->ns.qcount; q++) unvme_ioq_delete(dev, q);
-        unvme_adminq_delete(dev);
-        nvme_delete(&dev->nvmedev);
-        vfio_delete(&dev->vfiodev);
-        free(dev->ioqs);
-        free(dev);
-    }
-    LIST_DEL(unvme_ses, ses);
-    free(ses);
-    if (!unvme_ses) log_close();
+    DEBUG_FN("%s", dev->ns.device);
+    int q;
+    vfio_msix_disable(&dev->vfiodev);
+    for (q = 0; q < dev->ns.qcount; q++) unvme_ioq_delete(dev, q);
+    if (dev->qdma) vfio_dma_free(dev->qdma);
+    unvme_stats_delete(dev);
+    unvme_adminq_delete(dev);
+    unvme_pool_delete(&dev->pool);
+    nvme_delete(&dev->nvmedev);
+    vfio_delete(&dev->vfiodev);
+    if (dev->iomem.map) free(dev->iomem.map);
+    free(dev->ioqs);
+    free(dev);
 }
 
-
 /**
- * Open and attach to a UNVMe driver.
- * @param   pci         PCI device id
- * @param   nsid        namespace id
- * @param   qcount      number of queues (0 for max number of queues support)
- * @param   qsize       size of each queue (0 default to 65)
- * @return  namespace pointer or NULL if error.
+ * Keep a device with no session initialized for a later open, releasing
+ * the I/O buffers left allocated by its sessions.  A device with pending
+ * I/O is not kept.
+ * @param   dev         device context
+ * @return  0 if kept else -1.
  */
-unvme_ns_t* unvme_do_open(int pci, int nsid, int qcount, int qsize)
+static int unvme_device_keep(unvme_device_t* dev)
 {
-    unvme_lockw(&unvme_lock);
+    int q;
+    for (q = 0; q < dev->ns.qcount; q++) {
+        if (dev->ioqs[q].cidcount) return -1;
+    }
+
+    unvme_iomem_t* iomem = &dev->iomem;
+    int i, n = 0;
+    for (i = 0; i < iomem->count; i++) {
+        if (iomem->map[i] == dev->pool.dma) iomem->map[n++] = iomem->map[i];
+        else vfio_dma_free(iomem->map[i]);
+    }
+    iomem->count = n;
+
+    // return the pool buffers the sessions left allocated
+    vfio_dma_t* arena = dev->pool.dma;
+    unvme_pool_delete(&dev->pool);
+    unvme_pool_create(&dev->pool, arena);
+
+    DEBUG_FN("%s", dev->ns.device);
+    dev->next = unvme_kept;
+    unvme_kept = dev;
+    return 0;
+}
+
+/**
+ * Take a kept alive device for an open, releasing it instead if it does not
+ * have the requested queues.
+ * @param   pci         PCI device id
+ * @param   qcount      number of queues (0 for any)
+ * @param   qsize       size of each queue (0 for default)
+ * @return  the device context or NULL if none.
+ */
+static unvme_device_t* unvme_device_take(int pci, int qcount, int qsize)
+{
+    unvme_device_t** pdev = &unvme_kept;
+    while (*pdev && (*pdev)->ns.pci != pci) pdev = &(*pdev)->next;
+    unvme_device_t* dev = *pdev;
+    if (!dev) return NULL;
+    *pdev = dev->next;
+    dev->next = NULL;
+
+    if (qsize <= 1) qsize = UNVME_QSIZE;
+    if ((qcount > 0 && qcount != dev->ns.qcount) || qsize != dev->ns.qsize) {
+        unvme_device_delete(dev);
+        return NULL;
+    }
+    DEBUG_FN("%s", dev->ns.device);
+    return dev;
+}
+
+/**
+ * Clean up.
+ */
+static void unvme_cleanup(unvme_session_t* ses)
+{
+    unvme_device_t* dev = ses->dev;
+    if (--dev->refcount == 0) {
+        if (!unvme_keepalive || unvme_device_keep(dev)) unvme_device_delete(dev);
+    }
+    LIST_DEL(unvme_ses, ses);
+    free(ses);
+    if (!unvme_ses) log_close();
+}
+
+
+/**
+ * Open and attach to a UNVMe driver.
+ * @param   pci         PCI device id
+ * @param   nsid        namespace id
+ * @param   qcount      number of queues (0 for max number of queues support)
+ * @param   qsize       size of each queue (0 default to 65)
+ * @return  namespace pointer or NULL if error.
+ */
+unvme_ns_t* unvme_do_open(int pci, int nsid, int qcount, int qsize)
+{
+    unvme_lockw(&unvme_lock);
     if (!unvme_ses) {
         if (log_open(unvme_log, "w")) {
             unvme_unlockw(&unvme_lock);
             exit(1);
         }
         unvme_rdtsec = rdtsc_second();
+        unvme_nsmul = (1000000000UL << 20) / unvme_rdtsec;
     }
 
     // check for existing opened device
@@ -475,6 +1064,8 @@ unvme_ns_t* unvme_do_open(int pci, int nsid, int qcount, int qsize)
     unvme_device_t* dev;
     if (xses) {
         dev = xses->dev;
+    } else if ((dev = unvme_device_take(pci, qcount, qsize)) != NULL) {
+        INFO_FN("%s is kept alive", dev->ns.device);
     } else {
         // setup controller namespace
         dev = zalloc(sizeof(unvme_device_t));
@@ -509,8 +1100,9 @@ unvme_ns_t* unvme_do_open(int pci, int nsid, int qcount, int qsize)
         memcpy(ns->fr, idc->fr, sizeof (ns->fr));
         for (i = sizeof (ns->fr) - 1; i > 0 && ns->fr[i] == ' '; i--) ns->fr[i] = 0;
 
-        // limit to 1 PRP list page (pagesize / sizeof u64)
-        ns->maxppio = ns->pagesize >> 3;
+        // limit to the chained PRP list pages of a command (pagesize / sizeof
+        // u64 entries each, less the chain entry) after the prp1 page
+        ns->maxppio = UNVME_PRPPAGES * ((ns->pagesize >> 3) - 1) + 2;
         if (idc->mdts) {
             int mp = 2 << (idc->mdts - 1);
             if (ns->maxppio > mp) ns->maxppio = mp;
@@ -529,9 +1121,30 @@ unvme_ns_t* unvme_do_open(int pci, int nsid, int qcount, int qsize)
         ns->qcount = qcount;
         ns->qsize = qsize;
 
-        // setup IO queues
-        dev->ioqs = zalloc(qcount * sizeof(unvme_ioq_t));
-        for (i = 0; i < qcount; i++) unvme_ioq_create(dev, i);
+        // weigh the queue priority classes when the device arbitrates by them
+        ns->wrr = dev->nvmedev.wrr;
+        if (ns->wrr) {
+            nvme_feature_arbitration_t arb = {
+                .ab = UNVME_WRR_BURST, .lpw = UNVME_WRR_LOW - 1,
+                .mpw = UNVME_WRR_MEDIUM - 1, .hpw = UNVME_WRR_HIGH - 1 };
+            if (nvme_acmd_set_features(&dev->nvmedev, 0,
+                        NVME_FEATURE_ARBITRATION, 0, 0, (u32*)&arb))
+                ERROR("nvme_acmd_set_features arbitration failed");
+        }
+
+        // setup IO queues, whose queue pairs are created on first use
+        unvme_stats_create(dev);
+        dev->ioqs = unvme_zalloc_aligned(qcount * sizeof(unvme_ioq_t));
+        for (i = 0; i < qcount; i++) {
+            dev->ioqs[i].stats = dev->stats->q + i;
+            dev->ioqs[i].nvmeq.qprio = NVME_SQ_PRIO_MEDIUM;
+        }
+        unvme_qdma_create(dev);
+
+        // map the buffer pool arena once (it is freed with the device)
+        if (unvme_pool_create(&dev->pool, vfio_dma_alloc_huge(&dev->vfiodev,
+                    UNVME_POOLSIZE, UNVME_HUGEPAGE_2MB)) == 0)
+            unvme_iomem_add(&dev->iomem, dev->pool.dma);
     }
 
     // allocate new session
@@ -565,7 +1178,24 @@ int unvme_do_close(const unvme_ns_t* ns)
 }
 
 /**
- * Allocate an I/O buffer.
+ * Set whether to keep the controllers of closed devices initialized.
+ * @param   enable      1 to keep closed devices, 0 to release them
+ */
+void unvme_do_set_keepalive(int enable)
+{
+    unvme_lockw(&unvme_lock);
+    unvme_keepalive = enable;
+    while (!enable && unvme_kept) {
+        unvme_device_t* dev = unvme_kept;
+        unvme_kept = dev->next;
+        unvme_device_delete(dev);
+    }
+    unvme_unlockw(&unvme_lock);
+}
+
+/**
+ * Allocate an I/O buffer.  Buffers up to the largest pool size class come
+ * from the preallocated pool, and others are mapped individually.
  * @param   ns          namespace handle
  * @param   size        buffer size
  * @return  the allocated buffer or NULL if failure.
@@ -573,18 +1203,30 @@ int unvme_do_close(const unvme_ns_t* ns)
 void* unvme_do_alloc(const unvme_ns_t* ns, u64 size)
 {
     DEBUG_FN("%s %#lx", ns->device, size);
+    unvme_session_t* ses = ns->ses;
+    void* buf = unvme_pool_alloc(&ses->dev->pool, size);
+    if (buf) return buf;
+    return unvme_do_alloc_huge(ns, size, ses->hugeshift);
+}
+
+/**
+ * Allocate an I/O buffer backed by hugepages if available.
+ * @param   ns          namespace handle
+ * @param   size        buffer size
+ * @param   hugeshift   hugepage size shift (0 for normal pages)
+ * @return  the allocated buffer or NULL if failure.
+ */
+void* unvme_do_alloc_huge(const unvme_ns_t* ns, u64 size, int hugeshift)
+{
+    DEBUG_FN("%s %#lx %d", ns->device, size, hugeshift);
     unvme_device_t* dev = ((unvme_session_t*)ns->ses)->dev;
     unvme_iomem_t* iomem = &dev->iomem;
     void* buf = NULL;
 
     unvme_lockw(&iomem->lock);
-    vfio_dma_t* dma = vfio_dma_alloc(&dev->vfiodev, size);
+    vfio_dma_t* dma = vfio_dma_alloc_huge(&dev->vfiodev, size, hugeshift);
     if (dma) {
-        if (iomem->count == iomem->size) {
-            iomem->size += 256;
-            iomem->map = realloc(iomem->map, iomem->size * sizeof(void*));
-        }
-        iomem->map[iomem->count++] = dma;
+        unvme_iomem_add(iomem, dma);
         buf = dma->buf;
     }
     unvme_unlockw(&iomem->lock);
@@ -592,28 +1234,45 @@ void* unvme_do_alloc(const unvme_ns_t* ns, u64 size)
 }
 
 /**
- * Map an I/O buffer.
+ * Set the hugepage size for a session's I/O buffers that do not fit
+ * in the buffer pool.
+ * @param   ns          namespace handle
+ * @param   hugeshift   hugepage size shift (0 for normal pages)
+ * @return  0 if ok else -1.
+ */
+int unvme_do_set_hugepage(const unvme_ns_t* ns, int hugeshift)
+{
+    if (hugeshift != 0 && hugeshift != UNVME_HUGEPAGE_2MB &&
+        hugeshift != UNVME_HUGEPAGE_1GB) {
+        ERROR("invalid hugepage shift %d", hugeshift);
+        return -1;
+    }
+    ((unvme_session_t*)ns->ses)->hugeshift = hugeshift;
+    return 0;
+}
+
+/**
+ * Map caller memory for I/O (released with unvme_do_free).
  * @param   ns          namespace handle
  * @param   size        buffer size
- * @return  the allocated buffer or NULL if failure.
+ * @param   pmb         page aligned memory
+ * @return  0 if ok else -1.
  */
-void unvme_do_map(const unvme_ns_t* ns, u64 size, void *pmb)
+int unvme_do_map(const unvme_ns_t* ns, u64 size, void *pmb)
 {
     DEBUG_FN("%s %#lx", ns->device, size);
     unvme_device_t* dev = ((unvme_session_t*)ns->ses)->dev;
     unvme_iomem_t* iomem = &dev->iomem;
 
+    if ((u64)pmb & (ns->pagesize - 1)) {
+        ERROR("%p is not page aligned", pmb);
+        return -1;
+    }
     unvme_lockw(&iomem->lock);
     vfio_dma_t* dma = vfio_dma_map(&dev->vfiodev, size, pmb);
-    if (dma) {
-        if (iomem->count == iomem->size) {
-            iomem->size += 256;
-            iomem->map = realloc(iomem->map, iomem->size * sizeof(void*));
-        }
-        iomem->map[iomem->count++] = dma;
-    }
+    if (dma) unvme_iomem_add(iomem, dma);
     unvme_unlockw(&iomem->lock);
-    return;
+    return dma ? 0 : -1;
 }
 
 /**
@@ -627,21 +1286,19 @@ int unvme_do_free(const unvme_ns_t* ns, void* buf)
     DEBUG_FN("%s %p", ns->device, buf);
     unvme_device_t* dev = ((unvme_session_t*)ns->ses)->dev;
     unvme_iomem_t* iomem = &dev->iomem;
+    if (unvme_pool_free(&dev->pool, buf) == 0) return 0;
 
     unvme_lockw(&iomem->lock);
-    int i;
-    for (i = 0; i < iomem->count; i++) {
-        if (buf == iomem->map[i]->buf) {
-            vfio_dma_free(iomem->map[i]);
-            iomem->count--;
-            if (i != iomem->count)
-                iomem->map[i] = iomem->map[iomem->count];
-            unvme_unlockw(&iomem->lock);
-            return 0;
-        }
+    int i = unvme_iomem_find(iomem, buf);
+    if (i < 0 || buf != iomem->map[i]->buf || iomem->map[i] == dev->pool.dma) {
+        unvme_unlockw(&iomem->lock);
+        return -1;
     }
+    vfio_dma_free(iomem->map[i]);
+    iomem->count--;
+    memmove(iomem->map + i, iomem->map + i + 1, (iomem->count - i) * sizeof(void*));
     unvme_unlockw(&iomem->lock);
-    return -1;
+    return 0;
 }
 
 /**
@@ -652,37 +1309,537 @@ int unvme_do_free(const unvme_ns_t* ns, void* buf)
  * @param   cqe_cs      CQE command specific DW0 returned
  * @return  0 if ok else error status.
  */
-int unvme_do_poll(unvme_desc_t* desc, int timeout, u32* cqe_cs)
+static int unvme_poll_desc(unvme_desc_t* desc, int timeout, u32* cqe_cs)
 {
     if (desc->sentinel != desc->buf)
         FATAL("bad IO descriptor");
-    PDEBUG("# POLL d={%d %d %#lx}", desc->id, desc->cidcount, *desc->cidmask);
+    PDEBUG("# POLL d={%d %d}", desc->id, desc->cidcount);
     int err = 0;
     while (desc->cidcount) {
         if ((err = unvme_complete_io(desc->ioq, timeout, cqe_cs)) != 0) break;
     }
+    unvme_ring_cq(desc->ioq);
     if (desc->id != 0 && desc->cidcount == 0) unvme_desc_put(desc);
     PDEBUG("# q%d +%d", desc->ioq->nvmeq.id, desc->ioq->desccount);
     return err;
 }
 
+/**
+ * Release a descriptor whose submission failed part way, once the commands
+ * already submitted for it have completed (whatever their status).
+ * The submission errno is preserved.
+ * @param   desc        IO descriptor
+ */
+static void unvme_desc_cancel(unvme_desc_t* desc)
+{
+    int err = errno;
+    while (desc->cidcount) {
+        if (unvme_complete_io(desc->ioq, UNVME_TIMEOUT, NULL) == -1)
+            FATAL("q%d timeout", desc->ioq->nvmeq.id);
+    }
+    unvme_ring_cq(desc->ioq);
+    unvme_desc_put(desc);
+    errno = err;
+}
+
+/**
+ * Poll for completion status of a previous IO submission.  On a shared
+ * queue, the queue lock is only held while checking for completions so
+ * other threads can submit and poll in the mean time.
+ * @param   desc        IO descriptor
+ * @param   timeout     in seconds
+ * @param   cqe_cs      CQE command specific DW0 returned
+ * @return  0 if ok else error status.
+ */
+int unvme_do_poll(unvme_desc_t* desc, int timeout, u32* cqe_cs)
+{
+    unvme_ioq_t* ioq = desc->ioq;
+    if (!ioq->shared) return unvme_poll_desc(desc, timeout, cqe_cs);
+
+    u64 endtsc = 0;
+    for (;;) {
+        unvme_lockw(&ioq->lock);
+        int err = unvme_poll_desc(desc, 0, cqe_cs);
+        unvme_unlockw(&ioq->lock);
+        if (err != -1 || timeout == 0) return err;
+        u64 tsc = rdtsc();
+        if (endtsc == 0) endtsc = tsc + timeout * unvme_rdtsec;
+        else if (tsc >= endtsc) return err;
+        sched_yield();
+    }
+}
+
+/**
+ * Set the completion mode of an idle queue.  Switching between polled and
+ * interrupt completion recreates the queue pair with or without its MSIX
+ * vector (the queue id), which is mapped to an event file descriptor.
+ * @param   ns          namespace handle
+ * @param   qid         queue id
+ * @param   mode        UNVME_QMODE_POLL, UNVME_QMODE_INTR, or UNVME_QMODE_HYBRID
+ *                      optionally with the UNVME_QMODE_NONBLOCK flag
+ * @param   spinus      microseconds to poll before sleeping in hybrid mode
+ * @return  0 if ok else -1.
+ */
+int unvme_do_set_qmode(const unvme_ns_t* ns, int qid, int mode, int spinus)
+{
+    DEBUG_FN("%s q%d mode=%d spin=%d", ns->device, qid + 1, mode, spinus);
+    unvme_device_t* dev = ((unvme_session_t*)ns->ses)->dev;
+    unvme_ioq_t* ioq = unvme_ioq_get(ns, qid);
+    int iv = ioq->nvmeq.id;
+    int nonblock = (mode & UNVME_QMODE_NONBLOCK) != 0;
+    mode &= ~UNVME_QMODE_NONBLOCK;
+    int ien = mode != UNVME_QMODE_POLL;
+
+    if (mode < UNVME_QMODE_POLL || mode > UNVME_QMODE_HYBRID) {
+        ERROR("invalid queue mode %d", mode);
+        return -1;
+    }
+    if (ioq->cidcount || ioq->shared) {
+        ERROR("q%d is busy", iv);
+        return -1;
+    }
+    ioq->spintsc = mode == UNVME_QMODE_HYBRID ?
+                   (u64)spinus * unvme_rdtsec / 1000000 : 0;
+    ioq->nonblock = nonblock;
+    if (ien == ioq->nvmeq.ien) return 0;
+
+    int nvec = dev->ns.qcount + 1;
+    if (nvec > dev->vfiodev.msixsize) nvec = dev->vfiodev.msixsize;
+    if (ien && iv >= nvec) {
+        ERROR("no MSIX vector for q%d", iv);
+        return -1;
+    }
+
+    unvme_lockw(&unvme_lock);
+    __s32 efd = -1;
+    if (ien) {
+        if ((efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+            ERROR("eventfd: %s", strerror(errno));
+            unvme_unlockw(&unvme_lock);
+            return -1;
+        }
+        if (!dev->vfiodev.msixnvec) {
+            // enable all the queue vectors at once, to be mapped on demand
+            __s32* efds = malloc(nvec * sizeof(__s32));
+            int i;
+            for (i = 0; i < nvec; i++) efds[i] = -1;
+            efds[iv] = efd;
+            vfio_msix_enable(&dev->vfiodev, 0, nvec, efds);
+            free(efds);
+        } else {
+            vfio_msix_enable(&dev->vfiodev, iv, 1, &efd);
+        }
+    } else {
+        vfio_msix_enable(&dev->vfiodev, iv, 1, &efd);
+        close(ioq->efd);
+    }
+    ioq->efd = efd;
+
+    // recreate the queue pair with the interrupt setting and cleared entries
+    if (nvme_delete_ioq(&ioq->nvmeq))
+        FATAL("nvme_delete_ioq %d failed", iv);
+    memset(ioq->cqdma.buf, 0, ioq->cqdma.size);
+    ioq->nvmeq.ien = ien;
+    ioq->nvmeq.iv = ien ? iv : 0;
+    if (!nvme_create_ioq(&dev->nvmedev, &ioq->nvmeq, iv, ioq->nvmeq.size,
+                         ioq->sqdma.buf, ioq->sqdma.addr,
+                         ioq->cqdma.buf, ioq->cqdma.addr))
+        FATAL("nvme_create_ioq %d failed", iv);
+    ioq->cid = 0;
+    unvme_unlockw(&unvme_lock);
+    return 0;
+}
+
+/**
+ * Get the number of free slots of an I/O queue, not counting completions
+ * that are posted but not yet processed.
+ * @param   ns          namespace handle
+ * @param   qid         queue id
+ * @return  number of commands that can be submitted without waiting.
+ */
+int unvme_do_qfree(const unvme_ns_t* ns, int qid)
+{
+    unvme_ioq_t* ioq = unvme_ioq_get(ns, qid);
+    return ns->maxiopq - ioq->cidcount;
+}
+
+/**
+ * Set the priority class and the write reserved slots of an I/O queue.
+ * @param   ns          namespace handle
+ * @param   qid         queue id
+ * @param   prio        UNVME_QPRIO_URGENT, HIGH, MEDIUM, or LOW
+ * @param   reserve     number of slots plain writes may not take
+ * @return  0 if ok else -1.
+ */
+int unvme_do_set_qprio(const unvme_ns_t* ns, int qid, int prio, int reserve)
+{
+    DEBUG_FN("%s q%d prio=%d reserve=%d", ns->device, qid + 1, prio, reserve);
+    unvme_device_t* dev = ((unvme_session_t*)ns->ses)->dev;
+    unvme_ioq_t* ioq = dev->ioqs + qid;
+    int id = ioq->nvmeq.id;
+
+    if (prio < UNVME_QPRIO_URGENT || prio > UNVME_QPRIO_LOW) {
+        ERROR("invalid queue priority %d", prio);
+        return -1;
+    }
+    if (reserve < 0 || reserve > ns->qsize - 2) {
+        ERROR("invalid queue reserve %d (max %d)", reserve, ns->qsize - 2);
+        return -1;
+    }
+
+    // a queue pair not created yet takes the priority when it is created
+    unvme_lockw(&unvme_lock);
+    int ready = ioq->ready;
+    if (!ready) {
+        ioq->nvmeq.qprio = prio;
+        ioq->reserve = reserve;
+    }
+    unvme_unlockw(&unvme_lock);
+    if (!ready) return 0;
+
+    if (prio == ioq->nvmeq.qprio) {
+        ioq->reserve = reserve;
+        return 0;
+    }
+    if (ioq->cidcount || ioq->shared) {
+        ERROR("q%d is busy", id);
+        return -1;
+    }
+    ioq->reserve = reserve;
+
+    // the priority is only kept for the host when the device ignores it
+    ioq->nvmeq.qprio = prio;
+    if (!dev->nvmedev.wrr) return 0;
+
+    // recreate the queue pair with the priority and cleared entries
+    unvme_lockw(&unvme_lock);
+    if (nvme_delete_ioq(&ioq->nvmeq))
+        FATAL("nvme_delete_ioq %d failed", id);
+    memset(ioq->cqdma.buf, 0, ioq->cqdma.size);
+    if (!nvme_create_ioq(&dev->nvmedev, &ioq->nvmeq, id, ioq->nvmeq.size,
+                         ioq->sqdma.buf, ioq->sqdma.addr,
+                         ioq->cqdma.buf, ioq->cqdma.addr))
+        FATAL("nvme_create_ioq %d failed", id);
+    ioq->cid = 0;
+    unvme_unlockw(&unvme_lock);
+    return 0;
+}
+
+/**
+ * Reap the completed I/O descriptors of a queue.  All the ready completion
+ * entries are processed before the completion doorbell is updated once.
+ * Reaped descriptors are released, so the returned iods only serve to
+ * identify the completed submissions.
+ * @param   ns          namespace handle
+ * @param   qid         queue id
+ * @param   cpls        returned array of completions
+ * @param   max         max number of completions to return
+ * @param   timeout     in seconds to wait for a first completion
+ * @return  number of completions returned.
+ */
+int unvme_do_reap(const unvme_ns_t* ns, int qid, unvme_cpl_t* cpls,
+                  int max, int timeout)
+{
+    unvme_ioq_t* ioq = unvme_ioq_get(ns, qid);
+    u64 endtsc = 0, sleeptsc = 0;
+    int locked;
+
+    for (;;) {
+        locked = unvme_ioq_lock(ioq);
+        while (ioq->cidcount && unvme_complete_io(ioq, 0, NULL) != -1);
+        if (ioq->donelist || ioq->cidcount == 0 || timeout == 0) break;
+        u64 tsc = rdtsc();
+        if (endtsc == 0) {
+            endtsc = tsc + timeout * unvme_rdtsec;
+            sleeptsc = tsc + ioq->spintsc;
+        } else if (tsc >= endtsc) {
+            break;
+        }
+        // let the other threads of a shared queue in while waiting
+        unvme_ioq_unlock(ioq, locked);
+        if (ioq->efd >= 0 && tsc >= sleeptsc) unvme_ioq_sleep(ioq, endtsc);
+        else sched_yield();
+    }
+    unvme_ring_cq(ioq);
+
+    int n = 0;
+    while (n < max && ioq->donelist) {
+        unvme_desc_t* desc = ioq->donelist;
+        unvme_cpl_t* cpl = cpls + n++;
+        cpl->iod = (unvme_iod_t)desc;
+        cpl->buf = desc->buf;
+        cpl->slba = desc->slba;
+        cpl->nlb = desc->nlb;
+        cpl->stat = desc->error;
+        cpl->cs = desc->cs;
+        unvme_desc_put(desc);
+    }
+    unvme_ioq_unlock(ioq, locked);
+    PDEBUG("# REAP q%d %d +%d", ioq->nvmeq.id, n, ioq->desccount);
+    return n;
+}
+
+/**
+ * Attach a completion callback to a pending I/O descriptor.
+ * @param   desc        IO descriptor
+ * @param   cb          callback (NULL to detach)
+ * @param   arg         callback argument
+ * @return  0 if ok else -1.
+ */
+int unvme_do_set_callback(unvme_desc_t* desc, unvme_cb_t cb, void* arg)
+{
+    if (!desc || desc->sentinel != desc->buf) {
+        ERROR("bad IO descriptor");
+        return -1;
+    }
+    int locked = unvme_ioq_lock(desc->ioq);
+    desc->cb = cb;
+    desc->cbarg = arg;
+    unvme_ioq_unlock(desc->ioq, locked);
+    return 0;
+}
+
+/**
+ * Process the completions of a queue without waiting and fire the callbacks
+ * of the completed descriptors that have one, which are released first.
+ * Callbacks run with the queue unlocked, so they may submit new I/O.
+ * Completed descriptors without a callback are left to poll or reap.
+ * @param   ns          namespace handle
+ * @param   qid         queue id
+ * @param   max         max number of callbacks to fire
+ * @return  number of callbacks fired.
+ */
+int unvme_do_progress(const unvme_ns_t* ns, int qid, int max)
+{
+    unvme_ioq_t* ioq = unvme_ioq_get(ns, qid);
+    unvme_cpl_t cpls[UNVME_CBBATCH];
+    unvme_cb_t cbs[UNVME_CBBATCH];
+    void* args[UNVME_CBBATCH];
+    int count = 0;
+
+    while (count < max) {
+        int locked = unvme_ioq_lock(ioq);
+        while (ioq->cidcount && unvme_complete_io(ioq, 0, NULL) != -1);
+        unvme_ring_cq(ioq);
+
+        // count the done list first as released descriptors leave it
+        int n = 0, left = 0;
+        unvme_desc_t* desc = ioq->donelist;
+        if (desc) {
+            do {
+                left++;
+                desc = desc->donenext;
+            } while (desc != ioq->donelist);
+        }
+        while (left-- && n < UNVME_CBBATCH && (count + n) < max) {
+            unvme_desc_t* next = desc->donenext;
+            if (desc->cb) {
+                unvme_cpl_t* cpl = cpls + n;
+                cpl->iod = (unvme_iod_t)desc;
+                cpl->buf = desc->buf;
+                cpl->slba = desc->slba;
+                cpl->nlb = desc->nlb;
+                cpl->stat = desc->error;
+                cpl->cs = desc->cs;
+                cbs[n] = desc->cb;
+                args[n++] = desc->cbarg;
+                unvme_desc_put(desc);
+            }
+            desc = next;
+        }
+        unvme_ioq_unlock(ioq, locked);
+
+        int i;
+        for (i = 0; i < n; i++) cbs[i](cpls + i, args[i]);
+        count += n;
+        if (n < UNVME_CBBATCH) break;
+    }
+    PDEBUG("# PROGRESS q%d %d +%d", ioq->nvmeq.id, count, ioq->desccount);
+    return count;
+}
+
+/**
+ * Add a latency histogram to another.
+ * @param   to          histogram to add to
+ * @param   from        histogram to add
+ */
+static void unvme_stats_add_hist(unvme_lat_hist_t* to, const unvme_lat_hist_t* from)
+{
+    int i;
+    for (i = 0; i < UNVME_STAT_BUCKETS; i++) to->bucket[i] += from->bucket[i];
+    to->count += from->count;
+    to->sumns += from->sumns;
+    if (from->maxns > to->maxns) to->maxns = from->maxns;
+}
+
+/**
+ * Get the statistics of a queue or the sum of all queues.
+ * @param   ns          namespace handle
+ * @param   qid         queue id (-1 for all queues)
+ * @param   stats       returned statistics
+ * @return  0 if ok else -1.
+ */
+int unvme_do_get_stats(const unvme_ns_t* ns, int qid, unvme_qstats_t* stats)
+{
+    unvme_device_t* dev = ((unvme_session_t*)ns->ses)->dev;
+    if (qid >= ns->qcount) {
+        ERROR("invalid qid %d", qid);
+        return -1;
+    }
+    if (qid >= 0) {
+        memcpy(stats, dev->ioqs[qid].stats, sizeof(*stats));
+        return 0;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    int q, i;
+    for (q = 0; q < ns->qcount; q++) {
+        const unvme_qstats_t* qs = dev->ioqs[q].stats;
+        for (i = 0; i < UNVME_STAT_CLASSES; i++) {
+            stats->submits[i] += qs->submits[i];
+            stats->errors[i] += qs->errors[i];
+            unvme_stats_add_hist(&stats->lat[i], &qs->lat[i]);
+        }
+        for (i = 0; i < UNVME_STAT_QDBUCKETS; i++) stats->qdepth[i] += qs->qdepth[i];
+        stats->sqdb += qs->sqdb;
+        stats->cqdb += qs->cqdb;
+        stats->sqfull += qs->sqfull;
+    }
+    return 0;
+}
+
+/**
+ * Clear the statistics of all the queues of a device.
+ * @param   ns          namespace handle
+ */
+void unvme_do_reset_stats(const unvme_ns_t* ns)
+{
+    unvme_device_t* dev = ((unvme_session_t*)ns->ses)->dev;
+    memset(dev->stats->q, 0, ns->qcount * sizeof(unvme_qstats_t));
+}
+
+/**
+ * Bind the calling thread to an I/O queue.  A thread gets the queue of its
+ * current CPU if that is free, else any free queue.  When all the queues
+ * are taken, a UNVME_QBIND_SHARED request joins the least shared queue,
+ * whose submissions and completions are then serialized by the queue lock.
+ * A queue bound exclusively is never shared.
+ * @param   ns          namespace handle
+ * @param   flags       UNVME_QBIND_AFFINITY and/or UNVME_QBIND_SHARED
+ * @return  queue id or -1 if none available.
+ */
+int unvme_do_qbind(const unvme_ns_t* ns, int flags)
+{
+    unvme_device_t* dev = ((unvme_session_t*)ns->ses)->dev;
+    if (unvme_tqid >= 0) {
+        if (unvme_tns == ns && dev->ioqs[unvme_tqid].bound) return unvme_tqid;
+        if (unvme_tns != ns) {
+            ERROR("thread is bound to another namespace");
+            return -1;
+        }
+    }
+
+    int cpu = sched_getcpu();
+    int qcount = ns->qcount;
+    int qid = -1;
+    int q;
+
+    unvme_lockw(&unvme_lock);
+    if (cpu >= 0 && !dev->ioqs[cpu % qcount].bound) {
+        qid = cpu % qcount;
+    } else {
+        for (q = 0; q < qcount; q++) {
+            if (!dev->ioqs[q].bound) {
+                qid = q;
+                break;
+            }
+        }
+    }
+    if (qid < 0 && (flags & UNVME_QBIND_SHARED)) {
+        for (q = 0; q < qcount; q++) {
+            unvme_ioq_t* ioq = dev->ioqs + q;
+            if (ioq->shared && (qid < 0 || ioq->bound < dev->ioqs[qid].bound))
+                qid = q;
+        }
+    }
+    if (qid < 0) {
+        unvme_unlockw(&unvme_lock);
+        ERROR("no queue available to bind");
+        return -1;
+    }
+
+    unvme_ioq_t* ioq = dev->ioqs + qid;
+    if (flags & UNVME_QBIND_SHARED) ioq->shared = 1;
+    ioq->bound++;
+    unvme_unlockw(&unvme_lock);
+
+    if ((flags & UNVME_QBIND_AFFINITY) && cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err) ERROR("pthread_setaffinity_np: %s", strerror(err));
+    }
+
+    unvme_tns = ns;
+    unvme_tqid = qid;
+    DEBUG_FN("%s cpu=%d q%d bound=%d shared=%d", ns->device, cpu, qid + 1,
+             ioq->bound, ioq->shared);
+    return qid;
+}
+
+/**
+ * Release the I/O queue binding of the calling thread.  The thread's
+ * pending I/O should be completed before unbinding.
+ * @param   ns          namespace handle
+ * @return  0 if ok else -1.
+ */
+int unvme_do_qunbind(const unvme_ns_t* ns)
+{
+    if (unvme_tns != ns || unvme_tqid < 0) {
+        ERROR("thread is not bound");
+        return -1;
+    }
+    unvme_ioq_t* ioq = ((unvme_session_t*)ns->ses)->dev->ioqs + unvme_tqid;
+
+    unvme_lockw(&unvme_lock);
+    if (ioq->bound && --ioq->bound == 0) ioq->shared = 0;
+    unvme_unlockw(&unvme_lock);
+
+    DEBUG_FN("%s q%d bound=%d", ns->device, unvme_tqid + 1, ioq->bound);
+    unvme_tns = NULL;
+    unvme_tqid = -1;
+    return 0;
+}
+
+/**
+ * Submit a flush command.
+ * @param   ns          namespace handle
+ * @param   qid         queue id
+ * @return  I/O descriptor or NULL if error.
+ */
 unvme_desc_t* unvme_aflush(const unvme_ns_t* ns, int qid)
 {
-    unvme_ioq_t* ioq = ((unvme_session_t*)ns->ses)->dev->ioqs + qid;
+    unvme_ioq_t* ioq = unvme_ioq_get(ns, qid);
+    int locked = unvme_ioq_lock(ioq);
+    if (unvme_ioq_room(ns, ioq, NVME_CMD_FLUSH, 0, 1)) {
+        unvme_ioq_unlock(ioq, locked);
+        return NULL;
+    }
     unvme_desc_t* desc = unvme_desc_get(ioq);
     desc->opc = NVME_CMD_FLUSH;
     desc->qid = qid;
 
-    int cid = unvme_submit_io(ns, desc, NULL, 0, 0, 0);
+    unvme_sg_t sg = { 0, 0 };
+    int cid = unvme_submit_io(ns, desc, NVME_CMD_FLUSH, &sg, 0, 0, 0, 0);
     if (cid < 0) {
-        if (unvme_do_poll(desc, UNVME_TIMEOUT, NULL) != 0) {
-            ERROR("q%d timeout", ioq->nvmeq.id);
-            abort();
-        }
-        unvme_desc_put(desc);
-        return NULL;
+        unvme_desc_cancel(desc);
+        desc = NULL;
+    } else {
+        unvme_desc_staged(desc);
+        unvme_ring_sq(ioq);
     }
-
+    unvme_ioq_unlock(ioq, locked);
     return desc;
 }
 
@@ -703,38 +1860,285 @@ unvme_desc_t* unvme_rw(const unvme_ns_t* ns, int qid, int opc,
     return unvme_rw_extended(ns, qid, opc, buf, slba, nlb, 0);
 }
 
+/**
+ * Submit a read/write command with the cdw12 reserved (translation) bits.
+ * @param   ns          namespace handle
+ * @param   qid         queue id
+ * @param   opc         op code
+ * @param   buf         data buffer
+ * @param   slba        starting lba
+ * @param   nlb         number of logical blocks
+ * @param   rsvd12      translation command flag
+ * @return  I/O descriptor or NULL if error.
+ */
 unvme_desc_t* unvme_rw_extended(const unvme_ns_t* ns, int qid, int opc,
                        void* buf, u64 slba, u32 nlb, int rsvd12)
 {
-    unvme_ioq_t* ioq = ((unvme_session_t*)ns->ses)->dev->ioqs + qid;
+    u64 addr;
+    if (unvme_dma_addr(ns, buf, (u64)nlb * ns->blocksize, &addr)) return NULL;
+    return unvme_rw_buf(ns, qid, opc, buf, addr, slba, nlb, rsvd12);
+}
+
+/**
+ * Submit the commands of a read/write descriptor, splitting it at the
+ * device transfer limit.  On failure, the pending commands are completed
+ * and the descriptor is released.
+ * @param   ns          namespace handle
+ * @param   desc        descriptor
+ * @param   opc         op code
+ * @param   sg          data buffer DMA segments
+ * @param   slba        starting lba
+ * @param   nlb         number of logical blocks
+ * @param   rsvd12      translation command flag
+ * @param   advance     1 to advance the lba of each command, 0 to repeat slba
+ * @return  0 if ok else -1.
+ */
+static int unvme_submit_chunks(const unvme_ns_t* ns, unvme_desc_t* desc,
+                               int opc, const unvme_sg_t* sg, u64 slba,
+                               u32 nlb, int rsvd12, int advance)
+{
+    u64 off = 0;
+    while (nlb) {
+        u32 n = unvme_chunk_nlb(ns, sg->addr + off, nlb);
+        int cid = unvme_submit_io(ns, desc, opc, sg, off, slba, n, rsvd12);
+        if (cid < 0) {
+            unvme_desc_cancel(desc);
+            return -1;
+        }
+
+        if (advance) slba += n;
+        nlb -= n;
+        off += (u64)n << ns->blockshift;
+        while (nlb && off >= sg->len) off -= (sg++)->len;
+    }
+    return 0;
+}
+
+/**
+ * Stage a read/write command on a buffer with a resolved DMA address,
+ * leaving the submission doorbell for the caller to ring.
+ * @param   ns          namespace handle
+ * @param   ioq         IO queue
+ * @param   opc         op code
+ * @param   buf         data buffer
+ * @param   addr        data buffer DMA address
+ * @param   slba        starting lba
+ * @param   nlb         number of logical blocks
+ * @param   rsvd12      translation command flag
+ * @return  I/O descriptor or NULL if error.
+ */
+static unvme_desc_t* unvme_rw_stage(const unvme_ns_t* ns, unvme_ioq_t* ioq,
+                    int opc, void* buf, u64 addr, u64 slba, u32 nlb, int rsvd12)
+{
+    unvme_sg_t sg = { addr, (u64)nlb << ns->blockshift };
+    if (ioq->nonblock &&
+        unvme_ioq_room(ns, ioq, opc, rsvd12, unvme_chunk_count(ns, &sg, nlb)))
+        return NULL;
+
     unvme_desc_t* desc = unvme_desc_get(ioq);
     desc->opc = opc;
     desc->buf = buf;
-    desc->qid = qid;
+    desc->qid = ioq->nvmeq.id - 1;
     desc->slba = slba;
     desc->nlb = nlb;
     desc->sentinel = buf;
 
     PDEBUG("# %s %#lx %#x @%d +%d", opc == NVME_CMD_READ ? "READ" : "WRITE",
            slba, nlb, desc->id, ioq->desccount);
-    while (nlb) {
-        int n = ns->maxbpio;
-        if (n > nlb) n = nlb;
-        int cid = unvme_submit_io(ns, desc, buf, slba, n, rsvd12);
-        if (cid < 0) {
-            if (unvme_do_poll(desc, UNVME_TIMEOUT, NULL) != 0) {
-                ERROR("q%d timeout", ioq->nvmeq.id);
-                abort();
-            }
-            unvme_desc_put(desc);
+    if (unvme_submit_chunks(ns, desc, opc, &sg, slba, nlb, rsvd12, 1))
+        return NULL;
+    unvme_desc_staged(desc);
+    return desc;
+}
+
+/**
+ * Submit a read/write command on a buffer with a resolved DMA address.
+ * @param   ns          namespace handle
+ * @param   qid         queue id
+ * @param   opc         op code
+ * @param   buf         data buffer
+ * @param   addr        data buffer DMA address
+ * @param   slba        starting lba
+ * @param   nlb         number of logical blocks
+ * @param   rsvd12      translation command flag
+ * @return  I/O descriptor or NULL if error.
+ */
+unvme_desc_t* unvme_rw_buf(const unvme_ns_t* ns, int qid, int opc,
+                           void* buf, u64 addr, u64 slba, u32 nlb, int rsvd12)
+{
+    unvme_ioq_t* ioq = unvme_ioq_get(ns, qid);
+    int locked = unvme_ioq_lock(ioq);
+    unvme_desc_t* desc = unvme_rw_stage(ns, ioq, opc, buf, addr, slba, nlb, rsvd12);
+    unvme_ring_sq(ioq);
+    unvme_ioq_unlock(ioq, locked);
+    return desc;
+}
+
+/**
+ * Submit a batch of read/write commands on a queue with a single
+ * submission doorbell write.  Submission stops at the first failed request.
+ * @param   ns          namespace handle
+ * @param   qid         queue id
+ * @param   reqs        array of I/O requests
+ * @param   count       number of requests
+ * @param   iods        returned array of I/O descriptors
+ * @return  number of requests submitted.
+ */
+int unvme_do_submit_batch(const unvme_ns_t* ns, int qid,
+                          const unvme_ioreq_t* reqs, int count, unvme_iod_t* iods)
+{
+    unvme_ioq_t* ioq = unvme_ioq_get(ns, qid);
+    int locked = unvme_ioq_lock(ioq);
+    int i;
+    for (i = 0; i < count; i++) {
+        const unvme_ioreq_t* req = reqs + i;
+        u64 addr;
+        if (unvme_dma_addr(ns, req->buf, (u64)req->nlb << ns->blockshift, &addr))
+            break;
+        iods[i] = (unvme_iod_t)unvme_rw_stage(ns, ioq,
+                        req->write ? NVME_CMD_WRITE : NVME_CMD_READ,
+                        req->buf, addr, req->slba, req->nlb, req->trans);
+        if (!iods[i]) break;
+    }
+    unvme_ring_sq(ioq);
+    unvme_ioq_unlock(ioq, locked);
+    return i;
+}
+
+/**
+ * Submit a read/write command on an I/O vector of allocated buffers.
+ * The data is described by PRPs, so only the first element may start
+ * (block aligned) within a page, only the last element may end within a
+ * page, and the total size must be a multiple of the block size.
+ * @param   ns          namespace handle
+ * @param   qid         queue id
+ * @param   opc         op code
+ * @param   iov         I/O vector
+ * @param   iovcnt      number of I/O vector elements
+ * @param   slba        starting lba
+ * @return  I/O descriptor or NULL if error.
+ */
+unvme_desc_t* unvme_rwv(const unvme_ns_t* ns, int qid, int opc,
+                        const unvme_iovec_t* iov, int iovcnt, u64 slba)
+{
+    if (iovcnt <= 0 || iovcnt > UNVME_MAXIOV) {
+        ERROR("invalid iovcnt %d", iovcnt);
+        return NULL;
+    }
+
+    unvme_sg_t sg[iovcnt];
+    u64 pagemask = ns->pagesize - 1;
+    u64 size = 0;
+    int i;
+    for (i = 0; i < iovcnt; i++) {
+        if (unvme_dma_addr(ns, iov[i].buf, iov[i].size, &sg[i].addr)) return NULL;
+        sg[i].len = iov[i].size;
+        size += iov[i].size;
+        if ((i == 0 && (sg[i].addr & (ns->blocksize - 1))) || (i > 0 && (sg[i].addr & pagemask)) ||
+            (i < (iovcnt - 1) && ((sg[i].addr + sg[i].len) & pagemask)) ||
+            sg[i].len == 0) {
+            ERROR("iov[%d] %p %#lx is not aligned", i, iov[i].buf, iov[i].size);
             return NULL;
         }
+    }
+    if (size & (ns->blocksize - 1)) {
+        ERROR("iov size %#lx is not a block multiple", size);
+        return NULL;
+    }
 
-        buf += n * ns->blocksize;
-        slba += n;
-        nlb -= n;
+    unvme_ioq_t* ioq = unvme_ioq_get(ns, qid);
+    u32 nlb = size >> ns->blockshift;
+    int locked = unvme_ioq_lock(ioq);
+    if (ioq->nonblock &&
+        unvme_ioq_room(ns, ioq, opc, 0, unvme_chunk_count(ns, sg, nlb))) {
+        unvme_ioq_unlock(ioq, locked);
+        return NULL;
     }
+    unvme_desc_t* desc = unvme_desc_get(ioq);
+    desc->opc = opc;
+    desc->buf = iov[0].buf;
+    desc->qid = qid;
+    desc->slba = slba;
+    desc->nlb = nlb;
+    desc->sentinel = iov[0].buf;
 
+    PDEBUG("# %sV %#lx %#x %d @%d +%d", opc == NVME_CMD_READ ? "READ" : "WRITE",
+           slba, nlb, iovcnt, desc->id, ioq->desccount);
+    if (unvme_submit_chunks(ns, desc, opc, sg, slba, nlb, 0, 1)) {
+        desc = NULL;
+    } else {
+        unvme_desc_staged(desc);
+        unvme_ring_sq(ioq);
+    }
+    unvme_ioq_unlock(ioq, locked);
     return desc;
 }
 
+/**
+ * Submit a translation (NDP) request as one descriptor: the configuration
+ * write from the start of the buffer followed by the result reads into
+ * the buffer.  The commands are staged in order on the same queue, which
+ * the device relies on to apply the configuration before the reads.
+ * @param   ns          namespace handle
+ * @param   qid         queue id
+ * @param   buf         data buffer (configuration and results)
+ * @param   slba        starting lba
+ * @param   nlb         number of result logical blocks
+ * @param   config_nlb  number of configuration logical blocks
+ * @return  I/O descriptor or NULL if error.
+ */
+unvme_desc_t* unvme_translate(const unvme_ns_t* ns, int qid,
+                              void* buf, u64 slba, u32 nlb, u32 config_nlb)
+{
+    u64 addr;
+    u64 size = (u64)(nlb > config_nlb ? nlb : config_nlb) << ns->blockshift;
+    if (unvme_dma_addr(ns, buf, size, &addr)) return NULL;
+
+    unvme_ioq_t* ioq = unvme_ioq_get(ns, qid);
+    unvme_sg_t sg = { addr, size };
+    int locked = unvme_ioq_lock(ioq);
+    if (ioq->nonblock && unvme_ioq_room(ns, ioq, NVME_CMD_READ, 1,
+                unvme_chunk_count(ns, &sg, config_nlb) +
+                unvme_chunk_count(ns, &sg, nlb))) {
+        unvme_ioq_unlock(ioq, locked);
+        return NULL;
+    }
+    unvme_desc_t* desc = unvme_desc_get(ioq);
+    desc->opc = NVME_CMD_READ;
+    desc->buf = buf;
+    desc->qid = qid;
+    desc->slba = slba;
+    desc->nlb = nlb;
+    desc->sentinel = buf;
+
+    PDEBUG("# TRANS %#lx %#x %#x @%d +%d", slba, nlb, config_nlb,
+           desc->id, ioq->desccount);
+
+    // configuration blocks are written to consecutive lbas while every
+    // result read is addressed to slba and returns the next result blocks
+    if (unvme_submit_chunks(ns, desc, NVME_CMD_WRITE, &sg, slba, config_nlb, 1, 1) ||
+        unvme_submit_chunks(ns, desc, NVME_CMD_READ, &sg, slba, nlb, 1, 0)) {
+        desc = NULL;
+    } else {
+        unvme_desc_staged(desc);
+        unvme_ring_sq(ioq);
+    }
+    unvme_ioq_unlock(ioq, locked);
+    return desc;
+}
+
+/**
+ * Get the DMA handle of a buffer range within an allocated I/O buffer.
+ * @param   ns          namespace handle
+ * @param   buf         buffer pointer
+ * @param   size        buffer range size
+ * @param   ubuf        returned buffer handle
+ * @return  0 if ok else -1.
+ */
+int unvme_do_getbuf(const unvme_ns_t* ns, void* buf, u64 size, unvme_buf_t* ubuf)
+{
+    if (unvme_dma_addr(ns, buf, size, &ubuf->addr)) return -1;
+    ubuf->buf = buf;
+    ubuf->size = size;
+    return 0;
+}
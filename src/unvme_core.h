@@ -43,51 +43,97 @@
 #include "unvme_vfio.h"
 #include "unvme_nvme.h"
 #include "unvme_lock.h"
+#include "unvme_pool.h"
 #include "unvme.h"
 
+#define UNVME_POOLSIZE  (32 << 20)  ///< DMA buffer pool arena size per device
+#define UNVME_CBBATCH   64          ///< callbacks collected per queue lock hold
+
 /// Page size
 typedef char unvme_page_t[4096];
 
 /// IO memory allocation tracking info
 typedef struct _unvme_iomem {
-    vfio_dma_t**            map;        ///< dynamic array of allocated memory
+    vfio_dma_t**            map;        ///< allocated memory sorted by address
     int                     size;       ///< array size
     int                     count;      ///< array count
     unvme_lock_t            lock;       ///< map access lock
 } unvme_iomem_t;
 
-/// IO full descriptor
+/// Slice of a DMA allocation
+typedef struct _unvme_dmaseg {
+    void*                   buf;        ///< memory pointer
+    u64                     addr;       ///< DMA address
+    u64                     size;       ///< size in bytes
+} unvme_dmaseg_t;
+
+/// IO data DMA segment
+typedef struct _unvme_sg {
+    u64                     addr;       ///< DMA address
+    u64                     len;        ///< length in bytes
+} unvme_sg_t;
+
+/// PRP list cursor of a command
+typedef struct _unvme_prp {
+    u64*                    list;       ///< next entry to write
+    u64                     next;       ///< DMA address of current list page
+    int                     slot;       ///< entry index in current list page
+    int                     epp;        ///< entries per list page
+} unvme_prp_t;
+
+/// IO full descriptor (two cache lines, starting with the unvme_iod_t fields)
 typedef struct _unvme_desc {
     void*                   buf;        ///< buffer
     u64                     slba;       ///< starting lba
     u32                     nlb;        ///< number of blocks
     u32                     qid;        ///< queue id
     u32                     opc;        ///< op code
-    u32                     id;         ///< descriptor id
+    u32                     id;         ///< descriptor id (0 if free)
     void*                   sentinel;   ///< sentinel check
     struct _unvme_ioq*      ioq;        ///< IO queue context owner
-    struct _unvme_desc*     prev;       ///< previous descriptor node
-    struct _unvme_desc*     next;       ///< next descriptor node
-    int                     error;      ///< error status
     int                     cidcount;   ///< number of pending cids
-    u64                     cidmask[];  ///< cid pending bit mask
-} unvme_desc_t;
+    int                     error;      ///< error status
+    struct _unvme_desc*     next;       ///< next descriptor node
+    struct _unvme_desc*     prev;       ///< previous descriptor node
+    struct _unvme_desc*     doneprev;   ///< previous completed descriptor
+    struct _unvme_desc*     donenext;   ///< next completed descriptor
+    unvme_cb_t              cb;         ///< completion callback
+    void*                   cbarg;      ///< completion callback argument
+    u32                     cs;         ///< last CQE command specific DW0
+    int                     staging;    ///< commands still being submitted
+} __attribute__((aligned(64))) unvme_desc_t;
 
-/// IO queue entry
+/// IO queue entry (hot path state first, queue setup state after)
 typedef struct _unvme_ioq {
     nvme_queue_t            nvmeq;      ///< NVMe associated queue
-    vfio_dma_t*             sqdma;      ///< submission queue mem
-    vfio_dma_t*             cqdma;      ///< completion queue mem
-    vfio_dma_t*             prplist;    ///< PRP list
+    int                     ready;      ///< queue pair is created
+    int                     shared;     ///< shared by bound threads
+    unvme_lock_t            lock;       ///< shared queue access lock
     u16                     cid;        ///< next cid to check and use
     int                     cidcount;   ///< number of pending cids
     int                     desccount;  ///< number of pending descriptors
     int                     masksize;   ///< bit mask size to allocate
+    int                     reserve;    ///< slots not available to writes
+    int                     nonblock;   ///< fail submissions on a full queue
     u64*                    cidmask;    ///< cid pending bit mask
+    unvme_desc_t**          cidmap;     ///< cid to pending descriptor map
+    u64*                    cidtsc;     ///< cid submission tsc
+    u8*                     cidclass;   ///< cid statistics class
     unvme_desc_t*           desclist;   ///< use descriptor list
-    unvme_desc_t*           descfree;   ///< free descriptor list
+    unvme_desc_t*           descfree;   ///< free descriptor stack
     unvme_desc_t*           descnext;   ///< next pending descriptor to process
-} unvme_ioq_t;
+    unvme_desc_t*           donelist;   ///< completed descriptors to reap
+    unvme_qstats_t*         stats;      ///< statistics (in the stats file)
+    unvme_dmaseg_t          prplist;    ///< PRP list
+    int                     efd;        ///< completion event fd (-1 if polled)
+    u64                     spintsc;    ///< tsc to poll before sleeping on efd
+
+    unvme_dmaseg_t          sqdma;      ///< submission queue mem
+    unvme_dmaseg_t          cqdma;      ///< completion queue mem
+    unvme_desc_t**          descpool;   ///< preallocated descriptor blocks
+    int                     descpools;  ///< number of descriptor blocks
+    int                     bound;      ///< number of threads bound
+} __attribute__((aligned(64))) unvme_ioq_t;
 
 /// Device context
 typedef struct _unvme_device {
@@ -96,9 +142,14 @@ typedef struct _unvme_device {
     vfio_dma_t*             asqdma;     ///< admin submission queue mem
     vfio_dma_t*             acqdma;     ///< admin completion queue mem
     unvme_iomem_t           iomem;      ///< IO memory tracker
+    unvme_pool_t            pool;       ///< DMA buffer pool
     unvme_ns_t              ns;         ///< controller namespace (id=0)
     int                     refcount;   ///< reference count
     unvme_ioq_t*            ioqs;       ///< pointer to IO queues
+    vfio_dma_t*             qdma;       ///< rings and PRP lists of all IO queues
+    u64                     qslice;     ///< bytes of qdma per IO queue
+    unvme_stats_shm_t*      stats;      ///< mapped statistics file
+    struct _unvme_device*   next;       ///< next kept alive device
 } unvme_device_t;
 
 /// Session context
@@ -107,17 +158,36 @@ typedef struct _unvme_session {
     struct _unvme_session*  next;       ///< next session node
     unvme_device_t*         dev;        ///< device context
     unvme_ns_t              ns;         ///< namespace
+    int                     hugeshift;  ///< hugepage shift for I/O buffers
 } unvme_session_t;
 
 unvme_ns_t* unvme_do_open(int pci, int nsid, int qcount, int qsize);
 int unvme_do_close(const unvme_ns_t* ns);
+void unvme_do_set_keepalive(int enable);
 void* unvme_do_alloc(const unvme_ns_t* ns, u64 size);
-void unvme_do_map(const unvme_ns_t* ns, u64 size, void* pmb);
+void* unvme_do_alloc_huge(const unvme_ns_t* ns, u64 size, int hugeshift);
+int unvme_do_set_hugepage(const unvme_ns_t* ns, int hugeshift);
+int unvme_do_map(const unvme_ns_t* ns, u64 size, void* pmb);
 int unvme_do_free(const unvme_ns_t* ses, void* buf);
 int unvme_do_poll(unvme_desc_t* desc, int sec, u32* cqe_cs);
+int unvme_do_set_qmode(const unvme_ns_t* ns, int qid, int mode, int spinus);
+int unvme_do_set_qprio(const unvme_ns_t* ns, int qid, int prio, int reserve);
+int unvme_do_qfree(const unvme_ns_t* ns, int qid);
+int unvme_do_reap(const unvme_ns_t* ns, int qid, unvme_cpl_t* cpls, int max, int timeout);
+int unvme_do_set_callback(unvme_desc_t* desc, unvme_cb_t cb, void* arg);
+int unvme_do_progress(const unvme_ns_t* ns, int qid, int max);
+int unvme_do_qbind(const unvme_ns_t* ns, int flags);
+int unvme_do_qunbind(const unvme_ns_t* ns);
+int unvme_do_get_stats(const unvme_ns_t* ns, int qid, unvme_qstats_t* stats);
+void unvme_do_reset_stats(const unvme_ns_t* ns);
 unvme_desc_t* unvme_aflush(const unvme_ns_t* ns, int qid);
 unvme_desc_t* unvme_rw(const unvme_ns_t* ns, int qid, int opc, void* buf, u64 slba, u32 nlb);
 unvme_desc_t* unvme_rw_extended(const unvme_ns_t* ns, int qid, int opc, void* buf, u64 slba, u32 nlb, int rsvd12);
+unvme_desc_t* unvme_rw_buf(const unvme_ns_t* ns, int qid, int opc, void* buf, u64 addr, u64 slba, u32 nlb, int rsvd12);
+unvme_desc_t* unvme_rwv(const unvme_ns_t* ns, int qid, int opc, const unvme_iovec_t* iov, int iovcnt, u64 slba);
+unvme_desc_t* unvme_translate(const unvme_ns_t* ns, int qid, void* buf, u64 slba, u32 nlb, u32 config_nlb);
+int unvme_do_submit_batch(const unvme_ns_t* ns, int qid, const unvme_ioreq_t* reqs, int count, unvme_iod_t* iods);
+int unvme_do_getbuf(const unvme_ns_t* ns, void* buf, u64 size, unvme_buf_t* ubuf);
 
 #endif  // _UNVME_CORE_H
 
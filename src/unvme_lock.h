@@ -34,6 +34,9 @@
  * @brief UNVMe fast read lock with occasional writes.
  */
 
+#ifndef _UNVME_LOCK_H
+#define _UNVME_LOCK_H
+
 #include <sched.h>
 
 /// Lock write bit
@@ -93,3 +96,4 @@ static inline void unvme_unlockw(unvme_lock_t* lock)
     __sync_fetch_and_and(lock, ~UNVME_LOCKWBIT);
 }
 
+#endif // _UNVME_LOCK_H
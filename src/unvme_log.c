@@ -32,24 +32,264 @@
 /**
  * @file
  * @brief Logging support routines.
+ *
+ * Once the log file is open, messages are formatted by the calling thread
+ * into its own lock-free ring of log records, and a background thread
+ * drains the rings to the log file.  Error messages are written to the log
+ * file and stderr by the calling thread at once (after draining the rings),
+ * as an exit often follows them.  Other messages never wait on logging:
+ * when a thread's ring is full the message is dropped and counted.  Repeated error messages from the same call site
+ * are rate limited per thread.  Messages of a thread stay in order, but
+ * messages of different threads are only ordered per drain pass.
  */
 
 #include <stdarg.h>
+#include <string.h>
+#include <time.h>
 #include <pthread.h>
 
 #include "unvme_log.h"
 
+#define LOG_RING_SIZE   256     ///< records per thread ring (power of 2)
+#define LOG_MSG_SIZE    248     ///< max message length per record
+#define LOG_DRAIN_MS    10      ///< background drain interval
+#define LOG_RATE_SEC    1       ///< error rate limit interval in seconds
+#define LOG_RATE_BURST  10      ///< errors logged per site per interval
+#define LOG_RATE_SITES  8       ///< error sites tracked per thread
+
+/// Log record
+typedef struct _log_rec {
+    int                     err;        ///< error (also print to stderr)
+    int                     len;        ///< message length
+    char                    msg[LOG_MSG_SIZE]; ///< formatted message
+} log_rec_t;
+
+/// Error rate limit site (identified by its format string)
+typedef struct _log_site {
+    const char*             fmt;        ///< message format
+    time_t                  start;      ///< current interval start
+    int                     count;      ///< messages in current interval
+} log_site_t;
+
+/// Per thread log ring (single producer, single consumer)
+typedef struct _log_ring {
+    struct _log_ring*       next;       ///< next ring node
+    unsigned                head;       ///< next record to write (by owner)
+    unsigned                tail;       ///< next record to drain (by drainer)
+    unsigned                dropped;    ///< messages dropped on a full ring
+    int                     done;       ///< owner thread has exited
+    log_site_t              site[LOG_RATE_SITES]; ///< error rate limit sites
+    log_rec_t               rec[LOG_RING_SIZE];   ///< records
+} log_ring_t;
+
 
 // Static global variables
 static FILE*                log_fp = NULL;  ///< log file pointer
 static int                  log_count = 0;  ///< log open count
 static pthread_mutex_t      log_lock = PTHREAD_MUTEX_INITIALIZER; ///< log lock
+static pthread_cond_t       log_cond = PTHREAD_COND_INITIALIZER;  ///< drain wakeup
+static pthread_t            log_thread;     ///< drain thread
+static pthread_key_t        log_key;        ///< thread exit key
+static pthread_once_t       log_once = PTHREAD_ONCE_INIT; ///< key init
+static int                  log_async = 0;  ///< drain thread is running
+static log_ring_t*          log_rings = NULL; ///< thread ring list
+static __thread log_ring_t* log_tring = NULL; ///< calling thread ring
 
 
+/**
+ * Drain all the thread rings to the log file (with log_lock held).
+ * Rings of exited threads are freed once empty.
+ */
+static void log_drain(void)
+{
+    log_ring_t** prev = &log_rings;
+    log_ring_t* ring;
+    int n = 0;
+
+    while ((ring = *prev) != NULL) {
+        unsigned tail = ring->tail;
+        unsigned head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        for (; tail != head; tail++, n++) {
+            log_rec_t* rec = ring->rec + (tail & (LOG_RING_SIZE - 1));
+            fwrite(rec->msg, 1, rec->len, log_fp);
+            if (rec->err) fwrite(rec->msg, 1, rec->len, stderr);
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        unsigned dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+        if (dropped) {
+            fprintf(log_fp, "log: %u messages dropped\n", dropped);
+            n++;
+        }
+
+        if (__atomic_load_n(&ring->done, __ATOMIC_ACQUIRE) &&
+            tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+            *prev = ring->next;
+            free(ring);
+        } else {
+            prev = &ring->next;
+        }
+    }
+    if (n) fflush(log_fp);
+}
+
+/**
+ * Drain thread.
+ */
+static void* log_drain_thread(void* arg)
+{
+    pthread_mutex_lock(&log_lock);
+    while (log_async) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += LOG_DRAIN_MS * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&log_cond, &log_lock, &ts);
+        log_drain();
+    }
+    pthread_mutex_unlock(&log_lock);
+    return NULL;
+}
+
+static void log_thread_exit(void* arg);
+
+/**
+ * Create the thread exit key.
+ */
+static void log_key_create(void)
+{
+    pthread_key_create(&log_key, log_thread_exit);
+}
+
+/**
+ * Get the calling thread ring, creating it on the first message.
+ * @return  ring or NULL if failure.
+ */
+static log_ring_t* log_ring_get(void)
+{
+    if (log_tring) return log_tring;
+    log_ring_t* ring = calloc(1, sizeof(log_ring_t));
+    if (!ring) return NULL;
+    pthread_once(&log_once, log_key_create);
+    pthread_setspecific(log_key, ring);
+
+    pthread_mutex_lock(&log_lock);
+    ring->next = log_rings;
+    log_rings = ring;
+    pthread_mutex_unlock(&log_lock);
+    log_tring = ring;
+    return ring;
+}
+
+/**
+ * Add a formatted message to a thread ring, or drop it if the ring is full.
+ * @param   ring        thread ring
+ * @param   err         error indication
+ * @param   fmt         formatted message
+ * @param   args        message arguments
+ */
+static void log_vpush(log_ring_t* ring, int err, const char* fmt, va_list args)
+{
+    unsigned head = ring->head;
+    if ((head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) >= LOG_RING_SIZE) {
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    log_rec_t* rec = ring->rec + (head & (LOG_RING_SIZE - 1));
+    int len = vsnprintf(rec->msg, LOG_MSG_SIZE, fmt, args);
+    if (len < 0) len = 0;
+    if (len >= LOG_MSG_SIZE) {
+        len = LOG_MSG_SIZE - 1;
+        rec->msg[len - 1] = '\n';
+    }
+    rec->len = len;
+    rec->err = err;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Add a formatted message to a thread ring.
+ * @param   ring        thread ring
+ * @param   err         error indication
+ * @param   fmt         formatted message
+ */
+static void log_push(log_ring_t* ring, int err, const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    log_vpush(ring, err, fmt, args);
+    va_end(args);
+}
+
+/**
+ * Report the messages suppressed at an error site and reset it.
+ * @param   ring        thread ring
+ * @param   site        error site
+ */
+static void log_rate_report(log_ring_t* ring, log_site_t* site)
+{
+    if (site->count > LOG_RATE_BURST) {
+        int len = strlen(site->fmt);
+        if (len && site->fmt[len - 1] == '\n') len--;
+        log_push(ring, 1, "ERROR: %d repeats of \"%.*s\" suppressed\n",
+                 site->count - LOG_RATE_BURST, len, site->fmt);
+    }
+    site->count = 0;
+}
+
+/**
+ * Check the error rate of a call site.  The sites whose interval has
+ * ended report their suppressed messages.
+ * @param   ring        thread ring
+ * @param   fmt         message format identifying the site
+ * @return  1 if the message is to be suppressed else 0.
+ */
+static int log_rate_limit(log_ring_t* ring, const char* fmt)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+    log_site_t* site = NULL;
+    log_site_t* old = ring->site;
+    int i;
+    for (i = 0; i < LOG_RATE_SITES; i++) {
+        log_site_t* s = ring->site + i;
+        if (s->count && (ts.tv_sec - s->start) >= LOG_RATE_SEC)
+            log_rate_report(ring, s);
+        if (s->fmt == fmt) site = s;
+        else if (s->start < old->start) old = s;
+    }
+    if (!site) {
+        site = old;
+        if (site->count) log_rate_report(ring, site);
+        site->fmt = fmt;
+    }
+    if (site->count == 0) site->start = ts.tv_sec;
+    return ++site->count > LOG_RATE_BURST;
+}
+
+/**
+ * Report the suppressed messages of an exiting thread and mark its ring
+ * to be freed by the drain.
+ */
+static void log_thread_exit(void* arg)
+{
+    log_ring_t* ring = arg;
+    int i;
+    for (i = 0; i < LOG_RATE_SITES; i++) {
+        if (ring->site[i].count) log_rate_report(ring, ring->site + i);
+    }
+    __atomic_store_n(&ring->done, 1, __ATOMIC_RELEASE);
+}
+
 /**
  * Open log file.  Only one log file is supported and thus only the first
  * call * will create the log file by its specified name.  Subsequent calls
- * will only be counted.
+ * will only be counted.  The first open also starts the drain thread.
  * @param   name        log filename
  * @param   mode        open mode
  * @return  0 indicating 
@@ -64,6 +304,11 @@ int log_open(const char* name, const char* mode)
             pthread_mutex_unlock(&log_lock);
             return -1;
         }
+        log_async = 1;
+        if (pthread_create(&log_thread, NULL, log_drain_thread, NULL)) {
+            perror("log_open");
+            log_async = 0;
+        }
     }
     log_count++;
     pthread_mutex_unlock(&log_lock);
@@ -78,6 +323,14 @@ void log_close()
     pthread_mutex_lock(&log_lock);
     if (log_count > 0) {
         if ((--log_count == 0) && log_fp && log_fp != stdout) {
+            if (log_async) {
+                log_async = 0;
+                pthread_cond_signal(&log_cond);
+                pthread_mutex_unlock(&log_lock);
+                pthread_join(log_thread, NULL);
+                pthread_mutex_lock(&log_lock);
+                log_drain();
+            }
             fclose(log_fp);
             log_fp = NULL;
         }
@@ -85,6 +338,16 @@ void log_close()
     pthread_mutex_unlock(&log_lock);
 }
 
+/**
+ * Write all the pending log records to the log file.
+ */
+void log_flush()
+{
+    pthread_mutex_lock(&log_lock);
+    if (log_fp) log_drain();
+    pthread_mutex_unlock(&log_lock);
+}
+
 /**
  * Write a formatted message to log file, if log file is opened.
  * If err flag is set then log also to stderr.
@@ -95,7 +358,22 @@ void log_msg(int err, const char* fmt, ...)
 {
     va_list args;
 
+    int async = __atomic_load_n(&log_async, __ATOMIC_ACQUIRE);
+    if (async) {
+        log_ring_t* ring = log_ring_get();
+        if (ring) {
+            if (err && log_rate_limit(ring, fmt)) return;
+            if (!err) {
+                va_start(args, fmt);
+                log_vpush(ring, err, fmt, args);
+                va_end(args);
+                return;
+            }
+        }
+    }
+
     pthread_mutex_lock(&log_lock);
+    if (async && log_fp) log_drain();
     if (log_fp) {
         va_start(args, fmt);
         if (err) {
@@ -63,6 +63,7 @@
 // Export function
 int log_open(const char* filename, const char* mode);
 void log_close();
+void log_flush();
 void log_msg(int err, const char* fmt, ...);
 
 
@@ -106,6 +107,7 @@ static inline void* zalloc(int size)
     void* mem = calloc(1, size);
     if (!mem) {
         ERROR("calloc");
+        log_flush();
         abort();
     }
     return mem;
@@ -125,8 +125,35 @@ static int nvme_ctlr_enable(nvme_device_t* dev, nvme_controller_config_t cc)
     return nvme_ctlr_wait_ready(dev, 1);
 }
 
+/**
+ * Write the submission queue tail doorbell if there are unsignaled entries.
+ * @param   q           queue
+ * @return  1 if the doorbell was written else 0.
+ */
+int nvme_ring_sq(nvme_queue_t* q)
+{
+    if (q->sq_ring == q->sq_tail) return 0;
+    q->sq_ring = q->sq_tail;
+    w32(q->dev, q->sq_doorbell, q->sq_tail);
+    return 1;
+}
+
+/**
+ * Write the completion queue head doorbell if there are unsignaled entries.
+ * @param   q           queue
+ * @return  1 if the doorbell was written else 0.
+ */
+int nvme_ring_cq(nvme_queue_t* q)
+{
+    if (q->cq_ring == q->cq_head) return 0;
+    q->cq_ring = q->cq_head;
+    w32(q->dev, q->cq_doorbell, q->cq_head);
+    return 1;
+}
+
 /**
  * Submit an entry at submission queue tail.
+ * In batch mode, the doorbell is left for nvme_ring_sq.
  * @param   q           queue
  * @return  0 if ok else -1.
  */
@@ -144,12 +171,13 @@ static int nvme_submit_cmd(nvme_queue_t* q)
     }
 #endif
     q->sq_tail = tail;
-    w32(q->dev, q->sq_doorbell, tail);
+    if (!q->batch) nvme_ring_sq(q);
     return 0;
 }
 
 /**
  * Check a completion queue and return the completed command id and status.
+ * In batch mode, the doorbell is left for nvme_ring_cq.
  * @param   q           queue
  * @param   stat        completion status returned
  * @param   cqe_cs      CQE command specific DW0 returned
@@ -167,7 +195,7 @@ int nvme_check_completion(nvme_queue_t* q, int* stat, u32* cqe_cs)
         q->cq_phase = !q->cq_phase;
     }
     if (cqe_cs) *cqe_cs = cqe->cs;
-    w32(q->dev, q->cq_doorbell, q->cq_head);
+    if (!q->batch) nvme_ring_cq(q);
 
 #if 0
     // Some SSD does not advance sq_head properly (e.g. Intel DC D3600)
@@ -367,10 +395,13 @@ int nvme_acmd_create_cq(nvme_queue_t* ioq, u64 prp)
     cmd->common.cid = cid;
     cmd->common.prp1 = prp;
     cmd->pc = 1;
+    cmd->ien = ioq->ien;
+    cmd->iv = ioq->iv;
     cmd->qid = ioq->id;
     cmd->qsize = ioq->size - 1;
 
-    DEBUG_FN("q=%d cid=%#x qs=%d", ioq->id, cid, ioq->size);
+    DEBUG_FN("q=%d cid=%#x qs=%d ien=%d iv=%d", ioq->id, cid, ioq->size,
+             ioq->ien, ioq->iv);
     int err = nvme_submit_cmd(adminq);
     if (!err) err = nvme_wait_completion(adminq, cid, 10);
     if (err) ERROR();
@@ -395,12 +426,12 @@ int nvme_acmd_create_sq(nvme_queue_t* ioq, u64 prp)
     cmd->common.cid = cid;
     cmd->common.prp1 = prp;
     cmd->pc = 1;
-    cmd->qprio = 2; // 0=urgent 1=high 2=medium 3=low
+    cmd->qprio = ioq->qprio;
     cmd->qid = ioq->id;
     cmd->cqid = ioq->id;
     cmd->qsize = ioq->size - 1;
 
-    DEBUG_FN("q=%d cid=%#x qs=%d", ioq->id, cid, ioq->size);
+    DEBUG_FN("q=%d cid=%#x qs=%d prio=%d", ioq->id, cid, ioq->size, ioq->qprio);
     int err = nvme_submit_cmd(adminq);
     if (!err) err = nvme_wait_completion(adminq, cid, 10);
     if (err) ERROR();
@@ -574,6 +605,8 @@ int nvme_cmd_write(nvme_queue_t* ioq, u16 cid, int nsid,
 
 /**
  * Create an IO submission-completion queue pair.
+ * A caller provided queue may set ien and iv to enable completion interrupts,
+ * and qprio for the queue's class under weighted round robin arbitration.
  * @param   dev         device context
  * @param   ioq         if NULL then allocate queue
  * @param   id          queue id
@@ -587,8 +620,12 @@ int nvme_cmd_write(nvme_queue_t* ioq, u16 cid, int nsid,
 nvme_queue_t* nvme_create_ioq(nvme_device_t* dev, nvme_queue_t* ioq,
             int id, int qsize, void* sqbuf, u64 sqpa, void* cqbuf, u64 cqpa)
 {
-    if (!ioq) ioq = zalloc(sizeof(*ioq));
-    else ioq->ext = 1;
+    if (!ioq) {
+        ioq = zalloc(sizeof(*ioq));
+        ioq->qprio = NVME_SQ_PRIO_MEDIUM;
+    } else {
+        ioq->ext = 1;
+    }
 
     ioq->dev = dev;
     ioq->id = id;
@@ -597,9 +634,12 @@ nvme_queue_t* nvme_create_ioq(nvme_device_t* dev, nvme_queue_t* ioq,
     ioq->cq = cqbuf;
     ioq->sq_doorbell = dev->reg->sq0tdbl + (2 * id * dev->dbstride);
     ioq->cq_doorbell = ioq->sq_doorbell + dev->dbstride;
+    ioq->sq_head = ioq->sq_tail = ioq->sq_ring = 0;
+    ioq->cq_head = ioq->cq_ring = 0;
+    ioq->cq_phase = 0;
 
     if (nvme_acmd_create_cq(ioq, cqpa) || nvme_acmd_create_sq(ioq, sqpa)) {
-        free(ioq);
+        if (!ioq->ext) free(ioq);
         return NULL;
     }
     return ioq;
@@ -652,7 +692,7 @@ nvme_queue_t* nvme_setup_adminq(nvme_device_t* dev, int qsize,
     nvme_controller_config_t cc;
     cc.val = 0;
     cc.shn = 0;
-    cc.ams = 0;
+    cc.ams = dev->wrr;                  // weighted round robin if supported
     cc.css = 0;
     cc.iosqes = 6;
     cc.iocqes = 4;
@@ -692,6 +732,7 @@ nvme_device_t* nvme_create(nvme_device_t* dev, int mapfd)
     dev->pageshift = 12 + dev->mpsmin;
     dev->maxqsize = cap.mqes + 1;
     dev->dbstride = 1 << cap.dstrd;     // in u32 size offset
+    dev->wrr = cap.ams & 1;             // weighted round robin with urgent
 
     nvme_rdtsec = rdtsc_second();
 
@@ -100,6 +100,14 @@ enum {
     NVME_FEATURE_ASYNC_EVENT = 0xB,     ///< async event config
 };
 
+/// NVMe submission queue priority (weighted round robin arbitration)
+enum {
+    NVME_SQ_PRIO_URGENT     = 0x0,      ///< urgent (strict priority)
+    NVME_SQ_PRIO_HIGH       = 0x1,      ///< high
+    NVME_SQ_PRIO_MEDIUM     = 0x2,      ///< medium
+    NVME_SQ_PRIO_LOW        = 0x3,      ///< low
+};
+
 /// Version
 typedef union _nvme_version {
     u32                 val;            ///< whole value
@@ -539,8 +547,14 @@ typedef struct _nvme_queue {
     int                     sq_head;    ///< submission queue head
     int                     sq_tail;    ///< submission queue tail
     int                     cq_head;    ///< completion queue head
+    int                     sq_ring;    ///< sq tail last written to doorbell
+    int                     cq_ring;    ///< cq head last written to doorbell
     u16                     cq_phase;   ///< completion queue phase bit
     u16                     ext;        ///< externally allocated flag
+    u16                     batch;      ///< defer doorbell writes to nvme_ring
+    u16                     ien;        ///< completion interrupt enabled
+    u16                     iv;         ///< completion interrupt vector
+    u16                     qprio;      ///< submission queue priority
 } nvme_queue_t;
 
 /// Device context
@@ -554,6 +568,7 @@ typedef struct _nvme_device {
     u16                     pageshift;  ///< minimum pagesize shift
     u16                     mpsmin;     ///< MPSMIN
     u16                     mpsmax;     ///< MPSMAX
+    u16                     wrr;        ///< weighted round robin arbitration
     u16                     ext;        ///< externally allocated flag
 } nvme_device_t;
 
@@ -586,6 +601,8 @@ int nvme_cmd_read(nvme_queue_t* ioq, u16 cid, int nsid, u64 slba, int nlb, u64 p
 int nvme_cmd_write(nvme_queue_t* ioq, u16 cid, int nsid, u64 slba, int nlb, u64 prp1, u64 prp2);
 
 int nvme_check_completion(nvme_queue_t* q, int* stat, u32* cqe_cs);
+int nvme_ring_sq(nvme_queue_t* q);
+int nvme_ring_cq(nvme_queue_t* q);
 int nvme_wait_completion(nvme_queue_t* q, int cid, int timeout);
 
 #endif  // _UNVME_NVME_H
@@ -0,0 +1,191 @@
+/**
+ * Copyright (c) 2015-2016, Micron Technology, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file
+ * @brief UNVMe DMA buffer pool.
+ *
+ * The pool carves power-of-2 sized buffers (4KB to 1MB) out of a single
+ * arena that is mapped for DMA once, so that buffer allocation does not
+ * require an mmap and IOMMU map call.  Freed buffers go to a per thread
+ * cache slot first and spill over to a shared free list.
+ */
+
+#include <string.h>
+
+#include "unvme_log.h"
+#include "unvme_pool.h"
+
+/// Thread cache slot of the calling thread
+static __thread int     unvme_pool_tslot = -1;
+/// Next thread cache slot to assign
+static int              unvme_pool_tnext = 0;
+
+
+/**
+ * Get the size class of an allocation size.
+ * @param   size        allocation size
+ * @return  size class or -1 if size exceeds the largest class.
+ */
+static inline int unvme_pool_class(u64 size)
+{
+    int c;
+    for (c = 0; c < UNVME_POOL_CLASSES; c++) {
+        if (size <= ((u64)1 << (UNVME_POOL_MINSHIFT + c))) return c;
+    }
+    return -1;
+}
+
+/**
+ * Get the thread cache of the calling thread.
+ * @param   pool        pool
+ * @return  the locked thread cache.
+ */
+static inline unvme_pool_cache_t* unvme_pool_tcache(unvme_pool_t* pool)
+{
+    if (unvme_pool_tslot < 0) {
+        unvme_pool_tslot = __sync_fetch_and_add(&unvme_pool_tnext, 1) %
+                           UNVME_POOL_TCACHES;
+    }
+    unvme_pool_cache_t* tc = &pool->tcache[unvme_pool_tslot];
+    unvme_lockw(&tc->lock);
+    return tc;
+}
+
+/**
+ * Create a buffer pool on a DMA arena.
+ * @param   pool        pool to initialize
+ * @param   dma         arena memory
+ * @return  0 if ok else -1.
+ */
+int unvme_pool_create(unvme_pool_t* pool, vfio_dma_t* dma)
+{
+    memset(pool, 0, sizeof(*pool));
+    if (!dma) return -1;
+    pool->dma = dma;
+    pool->next = dma->buf;
+    pool->end = dma->buf + dma->size;
+    pool->classmap = zalloc(dma->size >> UNVME_POOL_MINSHIFT);
+    DEBUG_FN("%p %#lx", dma->buf, dma->size);
+    return 0;
+}
+
+/**
+ * Delete a buffer pool (the arena memory is not freed).
+ * @param   pool        pool
+ */
+void unvme_pool_delete(unvme_pool_t* pool)
+{
+    if (pool->classmap) free(pool->classmap);
+    memset(pool, 0, sizeof(*pool));
+}
+
+/**
+ * Allocate a zeroed buffer from the pool.
+ * @param   pool        pool
+ * @param   size        allocation size
+ * @return  buffer or NULL if size is too large or the pool is exhausted.
+ */
+void* unvme_pool_alloc(unvme_pool_t* pool, u64 size)
+{
+    if (!pool->dma) return NULL;
+    int c = unvme_pool_class(size);
+    if (c < 0) return NULL;
+    u64 csize = (u64)1 << (UNVME_POOL_MINSHIFT + c);
+    void* buf = NULL;
+
+    unvme_pool_cache_t* tc = unvme_pool_tcache(pool);
+    if (tc->count[c]) {
+        buf = tc->list[c][--tc->count[c]];
+    } else {
+        // refill half of the thread cache from the shared list or arena
+        unvme_lockw(&pool->lock);
+        while (tc->count[c] < (UNVME_POOL_TCSIZE >> 1)) {
+            void* p = pool->freelist[c];
+            if (p) {
+                pool->freelist[c] = *(void**)p;
+            } else if ((pool->next + csize) <= pool->end) {
+                p = pool->next;
+                pool->next += csize;
+                pool->classmap[(p - pool->dma->buf) >> UNVME_POOL_MINSHIFT] = c + 1;
+            } else {
+                break;
+            }
+            tc->list[c][tc->count[c]++] = p;
+        }
+        unvme_unlockw(&pool->lock);
+        if (tc->count[c]) buf = tc->list[c][--tc->count[c]];
+    }
+    unvme_unlockw(&tc->lock);
+    if (!buf) return NULL;
+
+    // mark the buffer allocated and match the zeroed content of a newly
+    // mapped buffer
+    u64 page = (buf - pool->dma->buf) >> UNVME_POOL_MINSHIFT;
+    __sync_fetch_and_or(&pool->classmap[page], UNVME_POOL_INUSE);
+    memset(buf, 0, size);
+    return buf;
+}
+
+/**
+ * Free a buffer back to the pool.
+ * @param   pool        pool
+ * @param   buf         buffer
+ * @return  0 if ok or -1 if buffer is not an allocated pool buffer.
+ */
+int unvme_pool_free(unvme_pool_t* pool, void* buf)
+{
+    if (!pool->dma || buf < pool->dma->buf || buf >= pool->next) return -1;
+    u64 off = buf - pool->dma->buf;
+    if (off & ((1 << UNVME_POOL_MINSHIFT) - 1)) return -1;
+    u8* map = &pool->classmap[off >> UNVME_POOL_MINSHIFT];
+    if (!(*map & UNVME_POOL_INUSE)) return -1;
+
+    // clear the allocated mark, so a second free of the buffer fails
+    u8 m = __sync_fetch_and_and(map, (u8)~UNVME_POOL_INUSE);
+    if (!(m & UNVME_POOL_INUSE)) return -1;
+    int c = (m & ~UNVME_POOL_INUSE) - 1;
+
+    unvme_pool_cache_t* tc = unvme_pool_tcache(pool);
+    if (tc->count[c] == UNVME_POOL_TCSIZE) {
+        // spill half of the thread cache to the shared list
+        unvme_lockw(&pool->lock);
+        while (tc->count[c] > (UNVME_POOL_TCSIZE >> 1)) {
+            void* p = tc->list[c][--tc->count[c]];
+            *(void**)p = pool->freelist[c];
+            pool->freelist[c] = p;
+        }
+        unvme_unlockw(&pool->lock);
+    }
+    tc->list[c][tc->count[c]++] = buf;
+    unvme_unlockw(&tc->lock);
+    return 0;
+}
@@ -0,0 +1,74 @@
+/**
+ * Copyright (c) 2015-2016, Micron Technology, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file
+ * @brief UNVMe DMA buffer pool header file.
+ */
+
+#ifndef _UNVME_POOL_H
+#define _UNVME_POOL_H
+
+#include "unvme.h"
+#include "unvme_vfio.h"
+#include "unvme_lock.h"
+
+#define UNVME_POOL_MINSHIFT     12      ///< smallest size class shift (4KB)
+#define UNVME_POOL_CLASSES      9       ///< number of size classes (to 1MB)
+#define UNVME_POOL_TCACHES      64      ///< number of thread cache slots
+#define UNVME_POOL_TCSIZE       16      ///< thread cache entries per class
+#define UNVME_POOL_INUSE        0x80    ///< class map mark of an allocated buffer
+
+/// Per thread buffer cache
+typedef struct _unvme_pool_cache {
+    unvme_lock_t            lock;       ///< slot lock (for shared slots)
+    int                     count[UNVME_POOL_CLASSES]; ///< cached count
+    void*                   list[UNVME_POOL_CLASSES][UNVME_POOL_TCSIZE]; ///< cached buffers
+} __attribute__((aligned(64))) unvme_pool_cache_t;
+
+/// DMA buffer pool carved from one premapped arena
+typedef struct _unvme_pool {
+    vfio_dma_t*             dma;        ///< arena memory
+    void*                   next;       ///< next uncarved arena address
+    void*                   end;        ///< end of arena
+    u8*                     classmap;   ///< size class + 1 (and in use mark) per page
+    void*                   freelist[UNVME_POOL_CLASSES]; ///< shared free lists
+    unvme_lock_t            lock;       ///< shared free list lock
+    unvme_pool_cache_t      tcache[UNVME_POOL_TCACHES]; ///< thread caches
+} unvme_pool_t;
+
+// Export functions
+int unvme_pool_create(unvme_pool_t* pool, vfio_dma_t* dma);
+void unvme_pool_delete(unvme_pool_t* pool);
+void* unvme_pool_alloc(unvme_pool_t* pool, u64 size);
+int unvme_pool_free(unvme_pool_t* pool, void* buf);
+
+#endif // _UNVME_POOL_H
@@ -49,7 +49,7 @@
 #include "unvme_log.h"
 
 /// Print fatal error and exit
-#define FATAL(fmt, arg...)  do { ERROR(fmt, ##arg); abort(); } while (0)
+#define FATAL(fmt, arg...)  do { ERROR(fmt, ##arg); log_flush(); abort(); } while (0)
 
 /// Starting device DMA address
 #define VFIO_IOVA           0x800000000
@@ -57,6 +57,13 @@
 /// Adjust to 4K page aligned size
 #define VFIO_PASIZE(n)      (((n) + 0xfff) & ~0xfff)
 
+/// Adjust to aligned size of a given shift
+#define VFIO_ALIGN(n, s)    (((n) + (1UL << (s)) - 1) & ~((1UL << (s)) - 1))
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT      26      ///< mmap hugepage size encoding shift
+#endif
+
 /// IRQ index names
 const char* vfio_irq_names[] = { "INTX", "MSI", "MSIX", "ERR", "REQ" };
 
@@ -90,12 +97,16 @@ static void vfio_write(vfio_device_t* dev, void* buf, size_t len, off_t off)
 /**
  * Allocate VFIO memory.  The size will be rounded to page aligned size.
  * If pmb is set, it indicates memory has been premapped.
+ * If hugeshift is set, the memory is backed by hugepages of that size
+ * (e.g. 21 for 2MB) when available, and by 4K pages otherwise.
  * @param   dev         device context
  * @param   size        size
  * @param   pmb         premapped buffer
+ * @param   hugeshift   hugepage size shift (0 for normal pages)
  * @return  memory structure pointer or NULL if error.
  */
-static vfio_mem_t* vfio_mem_alloc(vfio_device_t* dev, size_t size, void* pmb)
+static vfio_mem_t* vfio_mem_alloc(vfio_device_t* dev, size_t size, void* pmb,
+                                  int hugeshift)
 {
     vfio_mem_t* mem = zalloc(sizeof(*mem));
     mem->size = size;
@@ -104,23 +115,48 @@ static vfio_mem_t* vfio_mem_alloc(vfio_device_t* dev, size_t size, void* pmb)
     if (pmb) {
         mem->dma.buf = pmb;
     } else {
-        mem->dma.buf = mmap(0, size, PROT_READ|PROT_WRITE,
-                            MAP_PRIVATE|MAP_ANONYMOUS|MAP_LOCKED, -1, 0);
+        mem->dma.buf = MAP_FAILED;
+        if (hugeshift) {
+            size_t hsize = VFIO_ALIGN(size, hugeshift);
+            mem->dma.buf = mmap(0, hsize, PROT_READ|PROT_WRITE,
+                                MAP_PRIVATE|MAP_ANONYMOUS|MAP_LOCKED|
+                                MAP_HUGETLB|(hugeshift << MAP_HUGE_SHIFT), -1, 0);
+            if (mem->dma.buf != MAP_FAILED) {
+                size = hsize;
+                mem->hugeshift = hugeshift;
+            } else {
+                DEBUG_FN("%x no %dMB hugepage for %#lx", dev->pci,
+                         1 << (hugeshift - 20), size);
+            }
+        }
+        if (mem->dma.buf == MAP_FAILED) {
+            mem->dma.buf = mmap(0, size, PROT_READ|PROT_WRITE,
+                                MAP_PRIVATE|MAP_ANONYMOUS|MAP_LOCKED, -1, 0);
+        }
         if (mem->dma.buf == MAP_FAILED)
             FATAL("mmap: %s", strerror(errno));
         mem->mmap = 1;
     }
 
+    // align IOVA to the hugepage size so the IOMMU can map large pages
     pthread_mutex_lock(&dev->lock);
     struct vfio_iommu_type1_dma_map map = {
         .argsz = sizeof(map),
         .flags = (VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE),
         .size = (__u64)size,
-        .iova = dev->iovanext,
+        .iova = mem->hugeshift ? VFIO_ALIGN(dev->iovanext, mem->hugeshift)
+                               : dev->iovanext,
         .vaddr = (__u64)mem->dma.buf,
     };
 
     if (ioctl(dev->contfd, VFIO_IOMMU_MAP_DMA, &map) < 0) {
+        // caller memory may fail to be pinned (e.g. memlock limit)
+        if (pmb) {
+            ERROR("VFIO_IOMMU_MAP_DMA %p %#lx: %s", pmb, size, strerror(errno));
+            pthread_mutex_unlock(&dev->lock);
+            free(mem);
+            return NULL;
+        }
         FATAL("VFIO_IOMMU_MAP_DMA: %s", strerror(errno));
     }
     mem->dma.size = size;
@@ -199,7 +235,7 @@ int vfio_mem_free(vfio_mem_t* mem)
  */
 vfio_dma_t* vfio_dma_map(vfio_device_t* dev, size_t size, void* pmb)
 {
-    vfio_mem_t* mem = vfio_mem_alloc(dev, size, pmb);
+    vfio_mem_t* mem = vfio_mem_alloc(dev, size, pmb, 0);
     return mem ? &mem->dma : NULL;
 }
 
@@ -221,7 +257,20 @@ int vfio_dma_unmap(vfio_dma_t* dma)
  */
 vfio_dma_t* vfio_dma_alloc(vfio_device_t* dev, size_t size)
 {
-    vfio_mem_t* mem = vfio_mem_alloc(dev, size, 0);
+    vfio_mem_t* mem = vfio_mem_alloc(dev, size, 0, 0);
+    return mem ? &mem->dma : NULL;
+}
+
+/**
+ * Allocate and return a DMA buffer backed by hugepages if available.
+ * @param   dev         device context
+ * @param   size        allocation size
+ * @param   hugeshift   hugepage size shift (21 for 2MB, 30 for 1GB)
+ * @return  0 if ok else -1.
+ */
+vfio_dma_t* vfio_dma_alloc_huge(vfio_device_t* dev, size_t size, int hugeshift)
+{
+    vfio_mem_t* mem = vfio_mem_alloc(dev, size, 0, hugeshift);
     return mem ? &mem->dma : NULL;
 }
 
@@ -237,6 +286,8 @@ int vfio_dma_free(vfio_dma_t* dma)
 
 /**
  * Enable MSIX and map interrupt vectors to VFIO events.
+ * Once enabled, the events of vectors within the enabled range may be
+ * remapped (an event file descriptor of -1 unmaps a vector).
  * @param   dev         device context
  * @param   start       first vector
  * @param   count       number of vectors to enable
@@ -250,8 +301,8 @@ void vfio_msix_enable(vfio_device_t* dev, int start, int count, __s32* efds)
         FATAL("no MSIX support");
     if ((start + count) > dev->msixsize)
         FATAL("MSIX request %d exceeds limit %d", count, dev->msixsize);
-    if (dev->msixnvec)
-        FATAL("MSIX is already enabled");
+    if (dev->msixnvec && (start + count) > dev->msixnvec)
+        FATAL("MSIX vector %d exceeds enabled %d", start + count - 1, dev->msixnvec);
 
     // if first time register all vectors else register specified vectors
     int len = sizeof(struct vfio_irq_set) + (count * sizeof(__s32));
@@ -267,7 +318,7 @@ void vfio_msix_enable(vfio_device_t* dev, int start, int count, __s32* efds)
     if (ioctl(dev->fd, VFIO_DEVICE_SET_IRQS, irqs))
         FATAL("VFIO_DEVICE_SET_IRQS %d %d: %s", start, count, strerror(errno));
 
-    dev->msixnvec += count;
+    if (!dev->msixnvec) dev->msixnvec = start + count;
     free(irqs);
 }
 
@@ -53,6 +53,7 @@ typedef struct _vfio_dma {
 typedef struct _vfio_mem {
     struct _vfio_device*    dev;        ///< device owner
     int                     mmap;       ///< mmap indication flag
+    int                     hugeshift;  ///< hugepage size shift (0 if none)
     vfio_dma_t              dma;        ///< dma mapped memory
     size_t                  size;       ///< size
     struct _vfio_mem*       prev;       ///< previous entry
@@ -83,6 +84,7 @@ int vfio_mem_free(vfio_mem_t* mem);
 vfio_dma_t* vfio_dma_map(vfio_device_t* dev, size_t size, void* pmb);
 int vfio_dma_unmap(vfio_dma_t* dma);
 vfio_dma_t* vfio_dma_alloc(vfio_device_t* dev, size_t size);
+vfio_dma_t* vfio_dma_alloc_huge(vfio_device_t* dev, size_t size, int hugeshift);
 int vfio_dma_free(vfio_dma_t* dma);
 
 #endif // _UNVME_VFIO_H
@@ -98,6 +98,8 @@ int main(int argc, char** argv)
     u64 slba, size, w, *p;
     unvme_iod_t* iod = malloc(iocount * sizeof(unvme_iod_t));
     void** buf = malloc(iocount * sizeof(void*));
+    unvme_ioreq_t* reqs = malloc(iocount * sizeof(unvme_ioreq_t));
+    unvme_cpl_t* cpls = malloc(iocount * sizeof(unvme_cpl_t));
 
     time_t tstart = time(0);
     for (q = 0; q < ns->qcount; q++) {
@@ -171,6 +173,74 @@ int main(int argc, char** argv)
             slba += nlb;
         }
 
+        printf("Test submit_batch.aread\n");
+        srandom(t);
+        slba = 0;
+        for (i = 0; i < iocount; i++) {
+            nlb = random() % maxnlb + 1;
+            bzero(buf[i], nlb * ns->blocksize);
+            reqs[i].buf = buf[i];
+            reqs[i].slba = slba;
+            reqs[i].nlb = nlb;
+            reqs[i].write = 0;
+            reqs[i].trans = 0;
+            slba += nlb;
+        }
+        if (unvme_submit_batch(ns, q, reqs, iocount, iod) != iocount)
+            errx(1, "submit_batch failed");
+
+        printf("Test reap\n");
+        int reaped = 0;
+        while (reaped < iocount) {
+            int n = unvme_reap(ns, q, cpls, iocount, UNVME_TIMEOUT);
+            if (n == 0) errx(1, "reap timeout (%d of %d)", reaped, iocount);
+            for (i = 0; i < n; i++) {
+                VERBOSE("  reap.%-2d %p %#lx\n", reaped + i, cpls[i].buf, cpls[i].slba);
+                if (cpls[i].stat) errx(1, "reap status %#x", cpls[i].stat);
+            }
+            reaped += n;
+        }
+
+        printf("Test verify.reap\n");
+        srandom(t);
+        slba = 0;
+        for (i = 0; i < iocount; i++) {
+            nlb = random() % maxnlb + 1;
+            size = nlb * ns->blocksize / sizeof(u64);
+            p = buf[i];
+            for (w = 0; w < size; w++) {
+                if (p[w] != ((w << 32) + i))
+                    errx(1, "mismatch lba=%#lx word=%#lx", slba, w);
+            }
+            slba += nlb;
+        }
+
+        printf("Test readv\n");
+        int vcnt = (slba << ns->blockshift) >> ns->pageshift;
+        if (vcnt > UNVME_MAXIOV) vcnt = UNVME_MAXIOV;
+        if (vcnt > 0) {
+            void* ref = unvme_alloc(ns, (u64)vcnt << ns->pageshift);
+            unvme_iovec_t* iov = malloc(vcnt * sizeof(unvme_iovec_t));
+            if (!ref || unvme_read(ns, q, ref, 0, vcnt * ns->nbpp))
+                errx(1, "read.ref failed");
+            // allocate the pages in reverse so the vector is not contiguous
+            for (i = vcnt - 1; i >= 0; i--) {
+                iov[i].size = ns->pagesize;
+                if (!(iov[i].buf = unvme_alloc(ns, ns->pagesize)))
+                    errx(1, "alloc.iov.%d failed", i);
+                bzero(iov[i].buf, ns->pagesize);
+            }
+            if (unvme_readv(ns, q, iov, vcnt, 0))
+                errx(1, "readv failed");
+            for (i = 0; i < vcnt; i++) {
+                if (memcmp(iov[i].buf, ref + ((u64)i << ns->pageshift), ns->pagesize))
+                    errx(1, "readv mismatch page=%d", i);
+                unvme_free(ns, iov[i].buf);
+            }
+            unvme_free(ns, ref);
+            free(iov);
+        }
+
         printf("Test free\n");
         for (i = 0; i < iocount; i++) {
             VERBOSE("  free.%-2d\n", i);
@@ -179,6 +249,8 @@ int main(int argc, char** argv)
         }
     }
 
+    free(cpls);
+    free(reqs);
     free(buf);
     free(iod);
     unvme_close(ns);
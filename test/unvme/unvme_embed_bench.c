@@ -0,0 +1,565 @@
+/**
+ * @file
+ * @brief UNVMe embedding lookup benchmark.
+ *
+ * Replays Zipf skewed (or trace file) SLS index streams over several tables
+ * from several threads, one queue per thread, through each lookup mode of
+ * unvme_embed_test (DRAM, file, UNVMe page reads and NDP), and reports QPS,
+ * latency percentiles, flash bytes read and CPU time per looked up row.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <math.h>
+#include <err.h>
+#include <sys/resource.h>
+
+#include "unvme.h"
+#include "rdtsc.h"
+#include "unvme_embed_pool.h"
+
+/// macro to print an io related error message
+#define IOERROR(s, lba) errx(1, "ERROR: " s " lba=%#lx", (u64)(lba))
+
+/// SLS translation config (as laid out by unvme_embed_lib.c)
+typedef struct {
+  u32 attribute_size;
+  u32 embedding_length;
+  u32 result_embeddings;
+  u32 input_embeddings;
+  u32 table_id;
+
+  u32 embedding_id_list[];
+} embed_config_t;
+
+/// lookup modes
+enum { MODE_DRAM, MODE_FILE, MODE_IO, MODE_NDP, MODE_COUNT };
+static const char* mode_names[MODE_COUNT] = { "dram", "file", "io", "ndp" };
+
+/// per thread benchmark state
+typedef struct {
+  int q;                        ///< thread queue
+  int mode;                     ///< lookup mode
+  u64 rng;                      ///< random number state
+  u64* lat;                     ///< request latencies in tsc
+  u64 rows;                     ///< rows looked up
+  u64 pages;                    ///< flash pages read (touched for NDP)
+} bench_thread_t;
+
+// Global variables
+static const unvme_ns_t* ns;    ///< unvme namespace pointer
+static int nthreads = 1;        ///< number of threads (and queues)
+static int ntables = 2;         ///< number of tables
+static int vector_length = 64;  ///< elements per row
+static long table_length = 700000; ///< rows per table
+static int batchsize = 16;      ///< results per request
+static int embedperresult = 80; ///< rows pooled per result
+static long nrequests = 10000;  ///< requests per thread and mode
+static double zipf_alpha = 1.0; ///< Zipf exponent (0 for uniform)
+static u64 slba = 5000;         ///< first table block address
+static u64 table_nlb;           ///< device blocks per table
+static float* dram;             ///< host copy of the tables
+static int filefd = -1;         ///< table file (file mode)
+static double* zipf_cdf;        ///< Zipf rank distribution
+static u64 zipf_mult;           ///< rank to row scattering multiplier
+static int* trace;              ///< trace entries (table, nrows, rows...)
+static long* trace_req;         ///< trace request offsets
+static long trace_count;        ///< number of trace requests
+static int maxrows;             ///< most rows of a request
+
+/**
+ * Return the next random number (xorshift64*).
+ */
+static inline u64 bench_rand(bench_thread_t* th)
+{
+  th->rng ^= th->rng >> 12;
+  th->rng ^= th->rng << 25;
+  th->rng ^= th->rng >> 27;
+  return th->rng * 0x2545F4914F6CDD1DUL;
+}
+
+/**
+ * Set up the Zipf rank distribution.  Ranks are scattered over the rows by
+ * a multiplier coprime to the table length, so the hot rows do not share
+ * pages.
+ */
+static void zipf_init()
+{
+  long i;
+  double sum = 0;
+  zipf_cdf = malloc(table_length * sizeof(double));
+  for (i = 0; i < table_length; i++) {
+    sum += 1.0 / pow(i + 1, zipf_alpha);
+    zipf_cdf[i] = sum;
+  }
+  for (i = 0; i < table_length; i++) zipf_cdf[i] /= sum;
+
+  zipf_mult = 2654435761UL % table_length;
+  if (!zipf_mult) zipf_mult = 1;
+  for (;; zipf_mult++) {
+    u64 a = zipf_mult, b = table_length;
+    while (b) {
+      u64 t = a % b;
+      a = b;
+      b = t;
+    }
+    if (a == 1) break;
+  }
+}
+
+/**
+ * Draw a Zipf (or uniform) distributed row.
+ */
+static long zipf_row(bench_thread_t* th)
+{
+  double u = (bench_rand(th) >> 11) * (1.0 / (1UL << 53));
+  if (!zipf_cdf) return (long)(u * table_length);
+  long lo = 0, hi = table_length - 1;
+  while (lo < hi) {
+    long mid = (lo + hi) >> 1;
+    if (zipf_cdf[mid] < u) lo = mid + 1;
+    else hi = mid;
+  }
+  return (long)(((u64)lo * zipf_mult) % table_length);
+}
+
+/**
+ * Load a trace file of one request per line: a table id followed by the
+ * rows to look up, which are pooled into the results round robin.
+ */
+static void trace_load(const char* path)
+{
+  FILE* fp = fopen(path, "r");
+  if (!fp) err(1, "%s", path);
+  long cap = 1 << 16, len = 0, rcap = 1 << 10;
+  char* line = NULL;
+  size_t lsize = 0;
+  trace = malloc(cap * sizeof(int));
+  trace_req = malloc(rcap * sizeof(long));
+  while (getline(&line, &lsize, fp) > 0) {
+    char* p = line;
+    char* end;
+    long v = strtol(p, &end, 0);
+    if (end == p) continue;
+    if (v < 0 || v >= ntables) errx(1, "trace table %ld out of range", v);
+    if (trace_count == rcap) trace_req = realloc(trace_req, (rcap *= 2) * sizeof(long));
+    trace_req[trace_count++] = len;
+    long head = len;
+    if (len + 2 > cap) trace = realloc(trace, (cap *= 2) * sizeof(int));
+    trace[len++] = v;
+    trace[len++] = 0;
+    for (p = end; ; p = end) {
+      v = strtol(p, &end, 0);
+      if (end == p) break;
+      if (v < 0 || v >= table_length) errx(1, "trace row %ld out of range", v);
+      if (len == cap) trace = realloc(trace, (cap *= 2) * sizeof(int));
+      trace[len++] = v;
+      trace[head+1]++;
+    }
+    if (trace[head+1] > maxrows) maxrows = trace[head+1];
+  }
+  free(line);
+  fclose(fp);
+  if (!trace_count) errx(1, "%s has no requests", path);
+}
+
+/**
+ * Generate the next request of a thread into (result, row) pairs.
+ * @return  number of pairs.
+ */
+static int bench_request(bench_thread_t* th, long reqno, int* table, int* ind)
+{
+  int i, n;
+  if (trace) {
+    const int* r = trace + trace_req[(reqno * nthreads + th->q) % trace_count];
+    *table = r[0];
+    n = r[1];
+    for (i = 0; i < n; i++) {
+      ind[2*i] = i % batchsize;
+      ind[2*i+1] = r[2+i];
+    }
+  } else {
+    *table = bench_rand(th) % ntables;
+    n = batchsize * embedperresult;
+    for (i = 0; i < n; i++) {
+      ind[2*i] = i / embedperresult;
+      ind[2*i+1] = zipf_row(th);
+    }
+  }
+  return n;
+}
+
+/**
+ * Compare u64 values for sorting.
+ */
+static int u64_compare(const void* a, const void* b)
+{
+  u64 x = *(const u64*)a, y = *(const u64*)b;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Sort and deduplicate the pages of a request's rows.
+ * @return  number of pages.
+ */
+static int request_pages(const int* ind, int n, u64* pages)
+{
+  u64 rowbytes = 4UL * vector_length;
+  int i, npages = 0;
+  for (i = 0; i < n; i++) pages[i] = (rowbytes * ind[2*i+1]) / 4096;
+  qsort(pages, n, sizeof(u64), u64_compare);
+  for (i = 0; i < n; i++) {
+    if (npages == 0 || pages[i] != pages[npages-1]) pages[npages++] = pages[i];
+  }
+  return npages;
+}
+
+/**
+ * Find the index of a page in a sorted unique page list.
+ */
+static int page_find(const u64* pages, int npages, u64 page)
+{
+  int lo = 0, hi = npages - 1;
+  while (lo < hi) {
+    int mid = (lo + hi) >> 1;
+    if (pages[mid] < page) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+/**
+ * Run the requests of one thread in its mode.
+ */
+static void* bench_thread(void* arg)
+{
+  bench_thread_t* th = arg;
+  int rowbytes = 4 * vector_length;
+  int resbytes = rowbytes * batchsize;
+  int cfgbytes = 4*2*maxrows + sizeof(embed_config_t);
+  int bufsize = ((resbytes > cfgbytes ? resbytes : cfgbytes) + 4095) & ~4095;
+  int qdepth = ns->qsize - 1;
+  int* ind = malloc(2 * maxrows * sizeof(int));
+  u64* pages = malloc(maxrows * sizeof(u64));
+  unvme_iod_t* iods = malloc(maxrows * sizeof(unvme_iod_t));
+  float* results = malloc(resbytes);
+  float* row = malloc(rowbytes);
+  void* buf = unvme_alloc(ns, bufsize);
+  void* pagebuf = th->mode == MODE_IO ? unvme_alloc(ns, (u64)maxrows * 4096) : NULL;
+  long r;
+  int i, table;
+
+  for (r = 0; r < nrequests; r++) {
+    int n = bench_request(th, r, &table, ind);
+    float* base = dram + (u64)table * table_length * vector_length;
+    u64 lba = slba + table * table_nlb;
+    int npages = 0;
+
+    u64 tsc = rdtsc();
+    memset(results, 0, resbytes);
+    switch (th->mode) {
+    case MODE_DRAM:
+      for (i = 0; i < n; i++)
+        embed_pool_sum(results + ind[2*i] * vector_length,
+                       base + (u64)ind[2*i+1] * vector_length, vector_length);
+      break;
+
+    case MODE_FILE:
+      for (i = 0; i < n; i++) {
+        off_t off = ((u64)table * table_length + ind[2*i+1]) * rowbytes;
+        if (pread(filefd, row, rowbytes, off) != rowbytes) err(1, "pread");
+        embed_pool_sum(results + ind[2*i] * vector_length, row, vector_length);
+      }
+      npages = n;
+      break;
+
+    case MODE_IO:
+      npages = request_pages(ind, n, pages);
+      for (i = 0; i < npages; i++) {
+        if (i >= qdepth && unvme_apoll(iods[i - qdepth], UNVME_TIMEOUT))
+          IOERROR("apoll", lba);
+        u64 plba = lba + pages[i] * ns->nbpp;
+        iods[i] = unvme_aread(ns, th->q, pagebuf + (u64)i * 4096, plba, ns->nbpp);
+        if (!iods[i]) IOERROR("aread", plba);
+      }
+      for (i = npages > qdepth ? npages - qdepth : 0; i < npages; i++) {
+        if (unvme_apoll(iods[i], UNVME_TIMEOUT)) IOERROR("apoll", lba);
+      }
+      for (i = 0; i < n; i++) {
+        u64 off = (u64)rowbytes * ind[2*i+1];
+        int p = page_find(pages, npages, off / 4096);
+        embed_pool_sum(results + ind[2*i] * vector_length,
+                       pagebuf + (u64)p * 4096 + off % 4096, vector_length);
+      }
+      break;
+
+    case MODE_NDP: {
+      embed_config_t* config = buf;
+      config->attribute_size = 4;
+      config->embedding_length = vector_length;
+      config->result_embeddings = batchsize;
+      config->input_embeddings = n;
+      config->table_id = table;
+      memcpy(config->embedding_id_list, ind, 2 * n * sizeof(int));
+      int cfgnlb = (4*2*n + sizeof(embed_config_t) + ns->blocksize - 1) / ns->blocksize;
+      int nlb = (resbytes + ns->blocksize - 1) / ns->blocksize;
+      if (unvme_translate_region(ns, th->q, buf, lba + th->q, nlb, cfgnlb))
+        IOERROR("translate", lba);
+      memcpy(results, buf, resbytes);
+      break;
+    }
+    }
+    th->lat[r] = rdtsc_elapse(tsc);
+
+    // count the pages the device read for the request
+    if (th->mode == MODE_NDP) npages = request_pages(ind, n, pages);
+    th->rows += n;
+    th->pages += npages;
+  }
+
+  if (pagebuf) unvme_free(ns, pagebuf);
+  unvme_free(ns, buf);
+  free(row);
+  free(results);
+  free(iods);
+  free(pages);
+  free(ind);
+  return 0;
+}
+
+/**
+ * Return the CPU time used by the process in microseconds.
+ */
+static double cpu_usecs()
+{
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e6 +
+         ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+/**
+ * Run one lookup mode on all the threads and print its results.
+ */
+static void run_mode(int mode)
+{
+  bench_thread_t* ths = calloc(nthreads, sizeof(bench_thread_t));
+  pthread_t* tids = calloc(nthreads, sizeof(pthread_t));
+  u64 nlat = (u64)nthreads * nrequests;
+  u64* lat = malloc(nlat * sizeof(u64));
+  int q;
+
+  for (q = 0; q < nthreads; q++) {
+    ths[q].q = q;
+    ths[q].mode = mode;
+    ths[q].rng = 0x9E3779B97F4A7C15UL * (q + 1);
+    ths[q].lat = lat + (u64)q * nrequests;
+  }
+
+  double cpu = cpu_usecs();
+  u64 tsc = rdtsc();
+  for (q = 0; q < nthreads; q++) {
+    if (pthread_create(&tids[q], 0, bench_thread, &ths[q]))
+      errx(1, "pthread_create");
+  }
+  for (q = 0; q < nthreads; q++) pthread_join(tids[q], 0);
+  double secs = (double)rdtsc_elapse(tsc) / rdtsc_second();
+  cpu = cpu_usecs() - cpu;
+
+  u64 rows = 0, pages = 0;
+  for (q = 0; q < nthreads; q++) {
+    rows += ths[q].rows;
+    pages += ths[q].pages;
+  }
+  qsort(lat, nlat, sizeof(u64), u64_compare);
+  double usec = 1e6 / rdtsc_second();
+  double p50 = lat[(u64)(nlat * 0.5)] * usec;
+  double p99 = lat[(u64)(nlat * 0.99)] * usec;
+  double p999 = lat[(u64)(nlat * 0.999)] * usec;
+  double kbpr = mode == MODE_FILE ? (double)rows * 4 * vector_length / 1024 / nlat
+                                  : (double)pages * 4 / nlat;
+
+  printf("%-5s %10.0f %12.0f %10.1f %10.1f %10.1f %12.1f %12.3f\n",
+         mode_names[mode], nlat / secs, rows / secs, p50, p99, p999,
+         kbpr, cpu / rows);
+
+  free(lat);
+  free(tids);
+  free(ths);
+}
+
+/**
+ * Fill the tables with random values and write them to the device (and to
+ * the table file for file mode).
+ */
+static void load_tables(const char* filepath)
+{
+  u64 rowbytes = 4UL * vector_length;
+  u64 tbytes = rowbytes * table_length;
+  u64 chunk = (u64)ns->maxbpio << ns->blockshift;
+  void* buf = unvme_alloc(ns, chunk);
+  u64 i;
+  int t;
+
+  table_nlb = ((tbytes + ns->pagesize - 1) / ns->pagesize) * ns->nbpp;
+  if (slba + ntables * table_nlb > ns->blockcount) errx(1, "tables too large");
+  dram = malloc(tbytes * ntables);
+  if (!dram) errx(1, "no memory for %d tables", ntables);
+  srandom(1);
+  for (i = 0; i < (u64)table_length * vector_length * ntables; i++)
+    dram[i] = (float)random() / RAND_MAX - 0.5f;
+
+  for (t = 0; t < ntables; t++) {
+    const char* src = (const char*)dram + t * tbytes;
+    u64 lba = slba + t * table_nlb;
+    u64 off;
+    for (off = 0; off < tbytes; off += chunk) {
+      u64 len = tbytes - off < chunk ? tbytes - off : chunk;
+      u32 nlb = (len + ns->blocksize - 1) >> ns->blockshift;
+      memset(buf + len, 0, ((u64)nlb << ns->blockshift) - len);
+      memcpy(buf, src + off, len);
+      if (unvme_write(ns, 0, buf, lba + (off >> ns->blockshift), nlb))
+        IOERROR("write", lba);
+    }
+  }
+  unvme_flush(ns, 0);
+  unvme_free(ns, buf);
+
+  if (filepath) {
+    filefd = open(filepath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (filefd < 0) err(1, "%s", filepath);
+    if (write(filefd, dram, tbytes * ntables) != (ssize_t)(tbytes * ntables))
+      err(1, "write %s", filepath);
+    fsync(filefd);
+  }
+}
+
+/**
+ * Main program.
+ */
+int main(int argc, char* argv[])
+{
+    const char* usage = "Usage: %s [OPTION]... PCINAME\n\
+           -m MODES    comma separated dram,file,io,ndp (default dram,io,ndp)\n\
+           -t THREADS  number of threads/queues (default 1)\n\
+           -n TABLES   number of tables (default 2)\n\
+           -l ROWS     rows per table (default 700000)\n\
+           -v LENGTH   embedding vector length (default 64)\n\
+           -b BATCH    results per request (default 16)\n\
+           -e EMBEDS   rows pooled per result (default 80)\n\
+           -r COUNT    requests per thread and mode (default 10000)\n\
+           -z ALPHA    Zipf exponent, 0 for uniform (default 1.0)\n\
+           -T FILE     replay a trace file of \"table row row...\" lines\n\
+           -F FILE     table file for file mode (e.g. on the SSD filesystem)\n\
+           PCINAME     PCI device name (as 01:00.0[/1] format)";
+
+    char* prog = strrchr(argv[0], '/');
+    prog = prog ? prog + 1 : argv[0];
+
+    const char* modes = "dram,io,ndp";
+    const char* tracepath = NULL;
+    const char* filepath = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "m:t:n:l:v:b:e:r:z:T:F:")) != -1) {
+        switch (opt) {
+        case 'm':
+            modes = optarg;
+            break;
+        case 't':
+            nthreads = strtol(optarg, 0, 0);
+            break;
+        case 'n':
+            ntables = strtol(optarg, 0, 0);
+            break;
+        case 'l':
+            table_length = strtol(optarg, 0, 0);
+            break;
+        case 'v':
+            vector_length = strtol(optarg, 0, 0);
+            break;
+        case 'b':
+            batchsize = strtol(optarg, 0, 0);
+            break;
+        case 'e':
+            embedperresult = strtol(optarg, 0, 0);
+            break;
+        case 'r':
+            nrequests = strtol(optarg, 0, 0);
+            break;
+        case 'z':
+            zipf_alpha = strtod(optarg, 0);
+            break;
+        case 'T':
+            tracepath = optarg;
+            break;
+        case 'F':
+            filepath = optarg;
+            break;
+        default:
+            warnx(usage, prog);
+            exit(1);
+        }
+    }
+    if ((optind + 1) != argc) {
+        warnx(usage, prog);
+        exit(1);
+    }
+    char* pciname = argv[optind];
+
+    int run[MODE_COUNT] = { 0 };
+    char* list = strdup(modes);
+    char* m;
+    for (m = strtok(list, ","); m; m = strtok(NULL, ",")) {
+        int i;
+        for (i = 0; i < MODE_COUNT && strcmp(m, mode_names[i]); i++);
+        if (i == MODE_COUNT) errx(1, "unknown mode %s", m);
+        run[i] = 1;
+    }
+    free(list);
+    if (run[MODE_FILE] && !filepath) errx(1, "file mode needs -F FILE");
+    if (ntables <= 0 || table_length <= 0 || vector_length <= 0 ||
+        batchsize <= 0 || embedperresult <= 0 || nrequests <= 0)
+        errx(1, "invalid workload");
+    if (4096 % (4 * vector_length))
+        errx(1, "rows of vector length %d straddle pages", vector_length);
+
+    printf("EMBEDDING BENCHMARK BEGIN\n");
+    time_t tstart = time(0);
+    if (!(ns = unvme_open(pciname))) exit(1);
+    if (nthreads <= 0 || nthreads > ns->qcount) errx(1, "thread limit %d", ns->qcount);
+
+    if (tracepath) trace_load(tracepath);
+    else {
+        maxrows = batchsize * embedperresult;
+        if (zipf_alpha > 0) zipf_init();
+    }
+
+    printf("%s threads=%d tables=%d rows=%ld vlen=%d batch=%d embeds=%d "
+           "requests=%ld %s\n", ns->device, nthreads, ntables, table_length,
+           vector_length, batchsize, embedperresult, nrequests,
+           tracepath ? tracepath : zipf_alpha > 0 ? "zipf" : "uniform");
+    if (!tracepath && zipf_alpha > 0) printf("zipf alpha=%.2f\n", zipf_alpha);
+
+    load_tables(filepath);
+
+    printf("%-5s %10s %12s %10s %10s %10s %12s %12s\n", "mode", "qps",
+           "rows/s", "p50(us)", "p99(us)", "p99.9(us)", "flashKB/req",
+           "cpu-us/row");
+    int i;
+    for (i = 0; i < MODE_COUNT; i++) {
+        if (run[i]) run_mode(i);
+    }
+
+    if (filefd >= 0) close(filefd);
+    free(dram);
+    unvme_close(ns);
+
+    printf("EMBEDDING BENCHMARK COMPLETE (%ld secs)\n", time(0) - tstart);
+    return 0;
+}
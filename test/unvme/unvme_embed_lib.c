@@ -20,251 +20,2035 @@
 #include "unvme.h"
 #include "unvme_log.h"
 #include "rdtsc.h"
+#include "unvme_embed_pool.h"
 
 /// Print fatal error and exit
-#define FATAL(fmt, arg...)  do { ERROR(fmt, ##arg); abort(); } while (0)
+#define FATAL(fmt, arg...)  do { ERROR(fmt, ##arg); log_flush(); abort(); } while (0)
 
 /// macro to print an io related error message
-#define IOERROR(s, p)   errx(1, "ERROR: " s " lba=%#lx", (p)->lba)
+#define IOERROR(s, lba) errx(1, "ERROR: " s " lba=%#lx", (u64)(lba))
 
-/// page structure
 typedef struct {
-    void*           buf;        ///< IO buffer
-    u64             lba;        ///< lba
-    unvme_iod_t     iod;        ///< returned IO descriptor
-    u64             tsc;        ///< tsc time
-} bw_page_t;
+  u32 attribute_size;
+  u32 embedding_length;
+  u32 result_embeddings;
+  u32 input_embeddings;
+  u32 table_id;
+
+  u32 embedding_id_list[];
+} embed_config_t;
+
+/// hot embedding cache statistics
+typedef struct {
+  u64 hits;                     ///< cached row lookups
+  u64 misses;                   ///< row lookups sent to the device
+  u64 bytes_saved;              ///< flash page bytes not read due to hits
+  u64 pages;                    ///< pages currently cached
+} embed_cache_stats_t;
+
+#define CACHE_PAGESIZE  4096    ///< cached table page size
+#define CACHE_NOKEY     (~0UL)  ///< unused cache entry key
+
+/// hot embedding cache entry
+typedef struct {
+  u64 key;                      ///< table id and page key
+  int next;                     ///< next entry in hash chain (-1 for none)
+  int ref;                      ///< CLOCK reference bit
+} cache_entry_t;
+
+/// hot embedding page cache with CLOCK replacement within a page budget
+typedef struct {
+  pthread_mutex_t lock;         ///< cache access lock
+  cache_entry_t* entries;       ///< page entries
+  int* buckets;                 ///< hash chain heads
+  char* data;                   ///< page data
+  int npages;                   ///< page budget (0 if disabled)
+  int nbuckets;                 ///< hash buckets (power of 2)
+  int hand;                     ///< CLOCK hand
+  embed_cache_stats_t stats;    ///< statistics
+} embed_cache_t;
+
+/// table load job of one worker queue
+typedef struct {
+  const unvme_ns_t* ns;         ///< device to write
+  const char* src;              ///< table memory to write
+  u64 size;                     ///< bytes to write (whole blocks)
+  u64 lba;                      ///< starting block address
+  int q;                        ///< worker queue
+  int nq;                       ///< number of worker queues
+  int stream;                   ///< copy through staging buffers
+  const struct embed_table* pack; ///< table to pack rows of (NULL to copy)
+} load_job_t;
+
+#define EMBED_TABLE_NOPAD   1   ///< keep rows back to back (see create_table)
+
+#define CATALOG_MAGIC   0x324c544143424d45UL    ///< table catalog signature
+#define CATALOG_LBA     4096    ///< block address of the table catalog
+#define CATALOG_TABLES  63      ///< table catalog capacity
+
+#define EMBED_MAXDEVS   8       ///< max devices to shard tables across
+#define EMBED_TABLE_GATES 64    ///< table lookup and update gate slots
+
+/// on-device embedding table catalog entry (of one shard of the table)
+typedef struct embed_table {
+  u32 table_id;                 ///< table id
+  u32 dtype;                    ///< element type (EMBED_DTYPE_*)
+  u32 vector_length;            ///< elements per row
+  u32 flags;                    ///< layout flags (EMBED_TABLE_*)
+  u64 table_length;             ///< number of rows (of the shard)
+  u64 slba;                     ///< extent starting block address
+  u64 nlb;                      ///< extent number of blocks
+  u32 rpp;                      ///< rows per row group
+  u32 span;                     ///< bytes per row group
+  u32 shard;                    ///< shard index
+  u32 nshards;                  ///< number of row range shards of the table
+  u64 row0;                     ///< first table row of the shard
+} embed_table_t;
+
+/// on-device embedding table catalog (one page at CATALOG_LBA)
+typedef struct {
+  u64 magic;                    ///< CATALOG_MAGIC
+  u32 count;                    ///< number of tables
+  u32 rsvd;                     ///< reserved
+  embed_table_t tables[CATALOG_TABLES]; ///< tables (unordered)
+} embed_catalog_t;
+
+/// device holding table shards
+typedef struct {
+  const unvme_ns_t* ns;         ///< namespace
+  embed_catalog_t* catalog;     ///< table catalog (DMA buffer)
+  void* page;                   ///< row page buffer (DMA buffer)
+} embed_dev_t;
+
+/// table resolved for a lookup: its shards and their devices
+typedef struct {
+  int nshards;                  ///< number of shards
+  int dev[EMBED_MAXDEVS];       ///< device index of each shard
+  embed_table_t shard[EMBED_MAXDEVS]; ///< catalog entry of each shard
+} embed_view_t;
+
+// Global variables
+static const unvme_ns_t* ns;           ///< first device (result buffers)
+static int qcount = 8;                 ///< queue count
+static char* pciname = "01:00.0";      ///< PCIe identifier for OpenSSD
+static int slba = 5000;                ///< first block address for tables
+static u64 shard_min = 64 << 20;       ///< table bytes split across devices
+static embed_dev_t devs[EMBED_MAXDEVS]; ///< devices holding tables
+static int ndevs;                      ///< number of devices
+static u64 load_chunk = 256 << 20;     ///< tensor bytes mapped at a time to load
+static int load_nbufs = 4;             ///< commands in flight per queue to load
+static int lookup_reserve = 4;         ///< queue slots kept from table writes
+static int pooling = EMBED_POOLING_SUM; ///< pooling mode of the lookups
+static volatile u64 load_done;         ///< bytes written by the current load
+static u64 load_total;                 ///< bytes of the current load
+static double load_gbps;               ///< throughput of the last load
+
+static float* rowDecode;               ///< decoded row of read_embedding
+static int rowDecodeLen;               ///< decoded row buffer length
+static embed_cache_t cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static pthread_mutex_t catalog_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/// lookups in flight and row updates of the tables hashed to a gate slot
+typedef struct {
+  pthread_mutex_t lock;         ///< gate lock
+  pthread_cond_t cond;          ///< signaled when a count drops
+  int lookups;                  ///< lookups in flight
+  int waiting;                  ///< updates waiting for the lookups
+  int updating;                 ///< an update is writing
+} table_gate_t;
+
+static table_gate_t table_gates[EMBED_TABLE_GATES] =
+    { [0 ... EMBED_TABLE_GATES - 1] = { PTHREAD_MUTEX_INITIALIZER,
+                                        PTHREAD_COND_INITIALIZER, 0, 0, 0 } };
+
+static void sls_stream_finish_own();
+
+/**
+ * Start a lookup of several tables, taking the gate of each (once, in gate
+ * order, so a lookup never holds a gate while waiting on a lower one) and
+ * waiting for the updates waiting or being written on them.  A thread
+ * about to wait first finishes the streamed lookups only it can end.  The
+ * lookup may be ended by another thread.
+ * @param   gates       ntables entries to return the gates taken
+ * @return  the number of gates taken.
+ */
+static int table_lookups_begin(const int* table_ids, int ntables, int* gates)
+{
+  int i, j, n = 0, finished = 0;
+  for (i = 0; i < ntables; i++) {
+    int gi = (u32)table_ids[i] % EMBED_TABLE_GATES;
+    for (j = n; j > 0 && gates[j-1] > gi; j--) gates[j] = gates[j-1];
+    if (j > 0 && gates[j-1] == gi) {
+      memmove(gates + j, gates + j + 1, (n - j) * sizeof(int));
+      continue;
+    }
+    gates[j] = gi;
+    n++;
+  }
+  for (i = 0; i < n; i++) {
+    table_gate_t* g = &table_gates[gates[i]];
+    pthread_mutex_lock(&g->lock);
+    while (g->updating || g->waiting) {
+      if (!finished) {
+        pthread_mutex_unlock(&g->lock);
+        sls_stream_finish_own();
+        finished = 1;
+        pthread_mutex_lock(&g->lock);
+        continue;
+      }
+      pthread_cond_wait(&g->cond, &g->lock);
+    }
+    g->lookups++;
+    pthread_mutex_unlock(&g->lock);
+  }
+  return n;
+}
+
+/**
+ * End a lookup of several tables (see table_lookups_begin).
+ */
+static void table_lookups_end(const int* gates, int n)
+{
+  int i;
+  for (i = 0; i < n; i++) {
+    table_gate_t* g = &table_gates[gates[i]];
+    pthread_mutex_lock(&g->lock);
+    if (--g->lookups == 0) pthread_cond_broadcast(&g->cond);
+    pthread_mutex_unlock(&g->lock);
+  }
+}
+
+/**
+ * Start a lookup of a table (see table_lookups_begin).
+ */
+static void table_lookup_begin(int table_id)
+{
+  int gate;
+  table_lookups_begin(&table_id, 1, &gate);
+}
+
+/**
+ * End a lookup of a table.
+ */
+static void table_lookup_end(int table_id)
+{
+  int gate = (u32)table_id % EMBED_TABLE_GATES;
+  table_lookups_end(&gate, 1);
+}
+
+/**
+ * Start an update of a table, holding back new lookups while it waits for
+ * the lookups in flight and until the update ends.
+ */
+static void table_update_begin(int table_id)
+{
+  table_gate_t* g = &table_gates[(u32)table_id % EMBED_TABLE_GATES];
+  pthread_mutex_lock(&g->lock);
+  g->waiting++;
+  while (g->updating || g->lookups) pthread_cond_wait(&g->cond, &g->lock);
+  g->waiting--;
+  g->updating = 1;
+  pthread_mutex_unlock(&g->lock);
+}
+
+/**
+ * End an update of a table.
+ */
+static void table_update_end(int table_id)
+{
+  table_gate_t* g = &table_gates[(u32)table_id % EMBED_TABLE_GATES];
+  pthread_mutex_lock(&g->lock);
+  g->updating = 0;
+  pthread_cond_broadcast(&g->cond);
+  pthread_mutex_unlock(&g->lock);
+}
+
+/**
+ * Return the bytes of a table row.
+ */
+static inline u64 table_rowbytes(const embed_table_t* t)
+{
+  return embed_dtype_rowbytes(t->dtype, t->vector_length);
+}
+
+/**
+ * Return the byte offset of a row in its table extent.  Rows are laid out
+ * in groups of rpp rows, each group starting span bytes after the last.
+ */
+static inline u64 table_row_offset(const embed_table_t* t, u64 row)
+{
+  return (row / t->rpp) * t->span + (row % t->rpp) * table_rowbytes(t);
+}
+
+/**
+ * Return the number of pages spanned by the row at a byte offset, which is
+ * more than one for rows larger than a page and for unpadded rows that
+ * straddle a page boundary.
+ */
+static inline int table_row_pages(const embed_table_t* t, u64 off)
+{
+  return (off % 4096 + table_rowbytes(t) + 4095) / 4096;
+}
+
+/**
+ * Return the bytes of a table extent that hold rows.
+ */
+static inline u64 table_bytes(const embed_table_t* t)
+{
+  return ((t->table_length + t->rpp - 1) / t->rpp) * t->span;
+}
+
+/**
+ * Return 1 if a table's rows are padded out to page boundaries.
+ */
+static inline int table_padded(const embed_table_t* t)
+{
+  return t->span != t->rpp * table_rowbytes(t);
+}
+
+/**
+ * Return the shard of a table holding a row.  All the shards but the last
+ * hold the same number of rows.
+ */
+static inline int table_shard(const embed_view_t* v, u64 row)
+{
+  return v->nshards == 1 ? 0 : row / v->shard[0].table_length;
+}
+
+/**
+ * Make the cache key of a table shard page.
+ */
+static inline u64 cache_key(const embed_table_t* t, u64 page)
+{
+  return ((u64)t->table_id << 40) | ((u64)t->shard << 36) | page;
+}
+
+/**
+ * Hash a cache key to its bucket.
+ */
+static inline int cache_bucket(u64 key)
+{
+  return (int)((key * 0x9E3779B97F4A7C15UL) >> 32) & (cache.nbuckets - 1);
+}
+
+/**
+ * Look up a cached table page (caller holds the cache lock).
+ * @return  page data or NULL if not cached.
+ */
+static char* cache_lookup(const embed_table_t* t, u64 page)
+{
+  if (!cache.npages) return NULL;
+  u64 key = cache_key(t, page);
+  int i = cache.buckets[cache_bucket(key)];
+  while (i >= 0) {
+    cache_entry_t* e = cache.entries + i;
+    if (e->key == key) {
+      e->ref = 1;
+      return cache.data + (u64)i * CACHE_PAGESIZE;
+    }
+    i = e->next;
+  }
+  return NULL;
+}
+
+/**
+ * Unlink a cache entry from its hash chain (caller holds the cache lock).
+ */
+static void cache_unlink(int i)
+{
+  cache_entry_t* e = cache.entries + i;
+  int* p = cache.buckets + cache_bucket(e->key);
+  while (*p != i) p = &cache.entries[*p].next;
+  *p = e->next;
+  e->key = CACHE_NOKEY;
+  e->ref = 0;
+  cache.stats.pages--;
+}
+
+/**
+ * Insert a table page into the cache, evicting by CLOCK if full
+ * (caller holds the cache lock).
+ */
+static void cache_insert(const embed_table_t* t, u64 page, const void* buf)
+{
+  if (!cache.npages || cache_lookup(t, page)) return;
+  while (cache.entries[cache.hand].ref) {
+    cache.entries[cache.hand].ref = 0;
+    if (++cache.hand == cache.npages) cache.hand = 0;
+  }
+  int i = cache.hand;
+  if (++cache.hand == cache.npages) cache.hand = 0;
+
+  cache_entry_t* e = cache.entries + i;
+  if (e->key != CACHE_NOKEY) cache_unlink(i);
+  e->key = cache_key(t, page);
+  e->ref = 1;
+  int b = cache_bucket(e->key);
+  e->next = cache.buckets[b];
+  cache.buckets[b] = i;
+  cache.stats.pages++;
+  memcpy(cache.data + (u64)i * CACHE_PAGESIZE, buf, CACHE_PAGESIZE);
+}
+
+/**
+ * Drop the cached pages of a table (caller holds the cache lock).
+ */
+static void cache_invalidate(int table_id)
+{
+  int i;
+  for (i = 0; i < cache.npages; i++) {
+    u64 key = cache.entries[i].key;
+    if (key != CACHE_NOKEY && (int)(key >> 40) == table_id) cache_unlink(i);
+  }
+}
+
+/**
+ * Split an SLS index list of a shard (with shard rows) into the rows cached
+ * on the host, which are summed into hostsum, and the rows to look up on the
+ * device.  missInd may be flatInd.
+ * @return  number of (result, embedding) pairs left in missInd.
+ */
+static int cache_split(const embed_table_t* t, const int* flatInd,
+    int input_embeddings, float* hostsum, int* missInd)
+{
+  int vector_length = t->vector_length;
+  u64 rowbytes = table_rowbytes(t);
+  char* rowbuf = NULL;
+  int i, k, nmiss = 0;
+
+  pthread_mutex_lock(&cache.lock);
+  for (i = 0; i < 2*input_embeddings; i += 2) {
+    int row = flatInd[i+1];
+    u64 off = table_row_offset(t, row);
+    int np = table_row_pages(t, off);
+    char* page = cache_lookup(t, off / CACHE_PAGESIZE);
+    const char* src = page ? page + off % CACHE_PAGESIZE : NULL;
+    if (page && np > 1) {
+      // a row spanning pages is a hit only if all its pages are cached,
+      // and is gathered from them
+      if (!rowbuf) rowbuf = malloc(rowbytes);
+      u64 pos = off % CACHE_PAGESIZE, done = 0;
+      for (k = 0; page && k < np; k++) {
+        if (k) page = cache_lookup(t, off / CACHE_PAGESIZE + k);
+        if (!page) break;
+        u64 n = CACHE_PAGESIZE - pos < rowbytes - done ?
+                CACHE_PAGESIZE - pos : rowbytes - done;
+        memcpy(rowbuf + done, page + pos, n);
+        done += n;
+        pos = 0;
+      }
+      src = page ? rowbuf : NULL;
+    }
+    if (src) {
+      embed_pool_row(hostsum + flatInd[i] * vector_length,
+                     src, t->dtype, vector_length);
+      cache.stats.hits++;
+      cache.stats.bytes_saved += (u64)np * CACHE_PAGESIZE;
+    } else {
+      missInd[2*nmiss] = flatInd[i];
+      missInd[2*nmiss+1] = row;
+      nmiss++;
+      cache.stats.misses++;
+    }
+  }
+  pthread_mutex_unlock(&cache.lock);
+  free(rowbuf);
+  return nmiss;
+}
+
+/**
+ * Read a table shard page through the cache, caching it on a miss.
+ * @param   dev         device of the shard
+ * @param   buf         DMA buffer of the device
+ * @param   count       1 to count the lookup in the statistics
+ */
+static void cache_read_page(const embed_dev_t* dev, int qid,
+    const embed_table_t* t, u64 page, void* buf, int count)
+{
+  pthread_mutex_lock(&cache.lock);
+  char* cached = cache_lookup(t, page);
+  if (cached) {
+    memcpy(buf, cached, CACHE_PAGESIZE);
+    if (count) {
+      cache.stats.hits++;
+      cache.stats.bytes_saved += CACHE_PAGESIZE;
+    }
+    pthread_mutex_unlock(&cache.lock);
+    return;
+  }
+  if (count) cache.stats.misses++;
+  pthread_mutex_unlock(&cache.lock);
+
+  unvme_read(dev->ns, qid, buf, t->slba + page * ns->nbpp, ns->nbpp);
+  pthread_mutex_lock(&cache.lock);
+  cache_insert(t, page, buf);
+  pthread_mutex_unlock(&cache.lock);
+}
+
+/**
+ * Read all the pages of the table shard row at a byte offset through the
+ * cache into consecutive pages of buf.
+ * @param   buf         DMA buffer of the device of table_row_pages pages
+ * @return  the row in buf.
+ */
+static void* cache_read_row(const embed_dev_t* dev, int qid,
+    const embed_table_t* t, u64 off, void* buf, int count)
+{
+  int k, np = table_row_pages(t, off);
+  for (k = 0; k < np; k++)
+    cache_read_page(dev, qid, t, off / 4096 + k, buf + (u64)k * 4096, count);
+  return buf + off % 4096;
+}
+
+/**
+ * Set up the row layout of a table.  Unless EMBED_TABLE_NOPAD is given,
+ * rows are padded so that none straddles a page: as many rows as fit are
+ * packed into each page, and rows larger than a page start on a page.
+ */
+static void table_layout(embed_table_t* t)
+{
+  u64 rowbytes = table_rowbytes(t);
+  if ((t->flags & EMBED_TABLE_NOPAD) || (CACHE_PAGESIZE % rowbytes) == 0) {
+    t->rpp = 1;
+    t->span = rowbytes;
+  } else if (rowbytes < CACHE_PAGESIZE) {
+    t->rpp = CACHE_PAGESIZE / rowbytes;
+    t->span = CACHE_PAGESIZE;
+  } else {
+    t->rpp = 1;
+    t->span = (rowbytes + CACHE_PAGESIZE - 1) & ~(u64)(CACHE_PAGESIZE - 1);
+  }
+}
+
+/**
+ * Pack the bytes [off, off+len) of a table extent from the table rows in
+ * host memory, zero filling the row padding.
+ */
+static void table_pack(const embed_table_t* t, char* dst, const char* rows,
+    u64 off, u64 len)
+{
+  u64 rowbytes = table_rowbytes(t);
+  while (len) {
+    u64 g = off / t->span;
+    u64 o = off % t->span;
+    u64 n = t->span - o < len ? t->span - o : len;
+    u64 nrows = t->table_length - g * t->rpp;
+    if (nrows > t->rpp) nrows = t->rpp;
+    u64 valid = nrows * rowbytes;
+    u64 c = o >= valid ? 0 : (valid - o < n ? valid - o : n);
+    memcpy(dst, rows + g * t->rpp * rowbytes + o, c);
+    memset(dst + c, 0, n - c);
+    dst += n;
+    off += n;
+    len -= n;
+  }
+}
+
+/**
+ * Read the table catalog from a device, starting an empty one if the
+ * device has none.
+ */
+static void catalog_open(embed_dev_t* dev)
+{
+  const unvme_ns_t* dns = dev->ns;
+  embed_catalog_t* catalog = unvme_alloc(dns, dns->pagesize);
+  if (unvme_read(dns, 0, catalog, CATALOG_LBA, dns->nbpp) ||
+      catalog->magic != CATALOG_MAGIC || catalog->count > CATALOG_TABLES) {
+    memset(catalog, 0, dns->pagesize);
+    catalog->magic = CATALOG_MAGIC;
+  }
+  dev->catalog = catalog;
+}
+
+/**
+ * Write the table catalog of a device (caller holds the catalog lock).
+ * @return  0 if ok else -1.
+ */
+static int catalog_write(const embed_dev_t* dev)
+{
+  if (unvme_write(dev->ns, 0, dev->catalog, CATALOG_LBA, dev->ns->nbpp)) return -1;
+  return unvme_flush(dev->ns, 0) ? -1 : 0;
+}
+
+/**
+ * Find the shard of a table in the catalog of a device (caller holds the
+ * catalog lock).
+ * @return  catalog entry or NULL if not found.
+ */
+static embed_table_t* catalog_find(const embed_dev_t* dev, int table_id)
+{
+  embed_catalog_t* catalog = dev->catalog;
+  int i;
+  for (i = 0; i < (int)catalog->count; i++) {
+    if (catalog->tables[i].table_id == (u32)table_id) return &catalog->tables[i];
+  }
+  return NULL;
+}
+
+/**
+ * Find the lowest free page aligned extent of nlb blocks on a device,
+ * ignoring the extent of table self (caller holds the catalog lock).
+ * @return  starting block address or 0 if there is no room.
+ */
+static u64 catalog_alloc(const embed_dev_t* dev, u64 nlb, const embed_table_t* self)
+{
+  const embed_catalog_t* catalog = dev->catalog;
+  u64 lba = (slba + ns->nbpp - 1) & ~(u64)(ns->nbpp - 1);
+  int i;
+  for (i = 0; i < (int)catalog->count; i++) {
+    const embed_table_t* t = &catalog->tables[i];
+    if (t != self && lba < t->slba + t->nlb && t->slba < lba + nlb) {
+      // move past the overlapping extent and recheck all of them
+      lba = t->slba + t->nlb;
+      i = -1;
+    }
+  }
+  return lba + nlb <= dev->ns->blockcount ? lba : 0;
+}
+
+/**
+ * Return the device a table shard is placed on.  Tables of one shard are
+ * spread over the devices by table id.
+ */
+static inline int table_home(int table_id, int shard, int nshards)
+{
+  return nshards == 1 ? table_id % ndevs : shard;
+}
+
+/**
+ * Create (or re-create) a table in the catalogs and persist them.  A table
+ * of at least shard_min bytes is split into contiguous row ranges, one per
+ * device, that start on page boundaries of the source table, and a smaller
+ * one is placed whole on one device.  A new shard
+ * gets the lowest free extent that fits it.  A re-created shard keeps its
+ * extent if it still fits, shrinking it to size, else it moves.
+ * The rows are not written (see unvme_write_table).
+ * @param   dtype       element type (EMBED_DTYPE_*)
+ * @param   flags       EMBED_TABLE_NOPAD to keep rows back to back, which
+ *                      NDP lookups need for rows that do not divide a page
+ * @return  0 if ok else -1.
+ */
+int unvme_create_table(int table_id, int vector_length, long table_length,
+    int dtype, int flags)
+{
+  if (vector_length <= 0 || table_length <= 0) return -1;
+  if (dtype < 0 || dtype >= EMBED_DTYPE_COUNT) return -1;
+  embed_table_t nt = {
+    .table_id = table_id,
+    .dtype = dtype,
+    .vector_length = vector_length,
+    .flags = flags,
+    .table_length = table_length,
+    .nshards = 1,
+  };
+  table_layout(&nt);
+  if (ndevs > 1 && table_bytes(&nt) >= shard_min) nt.nshards = ndevs;
+  u64 per = (table_length + nt.nshards - 1) / nt.nshards;
+  if (nt.nshards > 1) {
+    // split on whole pages of the source rows, so each shard of a page
+    // aligned table starts aligned and is written in place
+    u64 a = table_rowbytes(&nt), b = ns->pagesize;
+    while (b) { u64 r = a % b; a = b; b = r; }
+    u64 unit = ns->pagesize / a;
+    per = (per + unit - 1) / unit * unit;
+  }
+  nt.nshards = (table_length + per - 1) / per;
+
+  embed_table_t shards[EMBED_MAXDEVS];
+  int i, s;
+  pthread_mutex_lock(&catalog_lock);
+  for (s = 0; s < (int)nt.nshards; s++) {
+    embed_table_t* st = &shards[s];
+    *st = nt;
+    st->shard = s;
+    st->row0 = s * per;
+    st->table_length = table_length - st->row0 < per ? table_length - st->row0 : per;
+    st->nlb = ((table_bytes(st) + ns->pagesize - 1) / ns->pagesize) * ns->nbpp;
+
+    const embed_dev_t* dev = devs + table_home(table_id, s, nt.nshards);
+    embed_table_t* t = catalog_find(dev, table_id);
+    if (!t && dev->catalog->count == CATALOG_TABLES) {
+      pthread_mutex_unlock(&catalog_lock);
+      ERROR("catalog of %s full", dev->ns->device);
+      return -1;
+    }
+    st->slba = (t && t->nlb >= st->nlb) ? t->slba : catalog_alloc(dev, st->nlb, t);
+    if (!st->slba) {
+      pthread_mutex_unlock(&catalog_lock);
+      ERROR("no room for table %d on %s (%lu blocks)", table_id,
+            dev->ns->device, st->nlb);
+      return -1;
+    }
+  }
+
+  // update every catalog, dropping the shards of a previous layout
+  int err = 0;
+  for (i = 0; i < ndevs; i++) {
+    embed_dev_t* dev = devs + i;
+    embed_table_t* t = catalog_find(dev, table_id);
+    for (s = 0; s < (int)nt.nshards; s++) {
+      if (table_home(table_id, s, nt.nshards) == i) break;
+    }
+    if (s == (int)nt.nshards && !t) continue;
+    if (s == (int)nt.nshards) {
+      *t = dev->catalog->tables[--dev->catalog->count];
+    } else {
+      if (!t) t = &dev->catalog->tables[dev->catalog->count++];
+      *t = shards[s];
+    }
+    if (catalog_write(dev)) err = -1;
+  }
+  pthread_mutex_unlock(&catalog_lock);
+
+  pthread_mutex_lock(&cache.lock);
+  cache_invalidate(table_id);
+  pthread_mutex_unlock(&cache.lock);
+  return err;
+}
+
+/**
+ * Remove a table from the catalogs, freeing its extents.
+ * @return  0 if ok else -1.
+ */
+int unvme_drop_table(int table_id)
+{
+  int i, found = 0, err = 0;
+  pthread_mutex_lock(&catalog_lock);
+  for (i = 0; i < ndevs; i++) {
+    embed_dev_t* dev = devs + i;
+    embed_table_t* t = catalog_find(dev, table_id);
+    if (!t) continue;
+    *t = dev->catalog->tables[--dev->catalog->count];
+    if (catalog_write(dev)) err = -1;
+    found = 1;
+  }
+  pthread_mutex_unlock(&catalog_lock);
+  if (!found) return -1;
+
+  pthread_mutex_lock(&cache.lock);
+  cache_invalidate(table_id);
+  pthread_mutex_unlock(&cache.lock);
+  return err;
+}
+
+/**
+ * Resolve the shards of a table from the catalogs.
+ * @return  0 if ok else -1 if the table (or one of its shards) is missing.
+ */
+static int table_view(int table_id, embed_view_t* v)
+{
+  int i;
+  v->nshards = 0;
+  v->shard[0].nshards = 0;
+  pthread_mutex_lock(&catalog_lock);
+  for (i = 0; i < ndevs; i++) {
+    embed_table_t* t = catalog_find(devs + i, table_id);
+    if (t && t->shard < EMBED_MAXDEVS) {
+      v->shard[t->shard] = *t;
+      v->dev[t->shard] = i;
+      v->nshards++;
+    }
+  }
+  pthread_mutex_unlock(&catalog_lock);
+  return v->nshards && v->nshards == (int)v->shard[0].nshards ? 0 : -1;
+}
+
+/**
+ * Get the catalog entry of a table: that of its first shard, but with the
+ * number of rows of the whole table.
+ * @return  0 if ok else -1 if the table is not in the catalogs.
+ */
+int unvme_table_info(int table_id, embed_table_t* info)
+{
+  embed_view_t v;
+  if (table_view(table_id, &v)) return -1;
+  *info = v.shard[0];
+  info->table_length = v.shard[v.nshards - 1].row0 +
+                       v.shard[v.nshards - 1].table_length;
+  return 0;
+}
+
+/**
+ * Resolve a table for a lookup, exiting if it is not in the catalogs or
+ * has a different row length.
+ */
+static void table_get(int table_id, int vector_length, embed_view_t* v)
+{
+  if (table_view(table_id, v)) errx(1, "table %d not in catalog", table_id);
+  if (v->shard[0].vector_length != (u32)vector_length)
+    errx(1, "table %d vector length is %u", table_id, v->shard[0].vector_length);
+}
+
+/**
+ * Resolve a table for an NDP lookup, which reads rows back to back.
+ */
+static void table_get_ndp(int table_id, int vector_length, embed_view_t* v)
+{
+  table_get(table_id, vector_length, v);
+  const embed_table_t* t = &v->shard[0];
+  if (table_padded(t)) errx(1, "table %d rows are padded for NDP", table_id);
+  if (t->dtype != EMBED_DTYPE_FP32 && t->dtype != EMBED_DTYPE_FP16)
+    errx(1, "table %d type %u is not supported by NDP", table_id, t->dtype);
+}
+
+/**
+ * Set up the hot embedding cache with a memory budget in bytes,
+ * dropping any cached pages.  A budget of 0 disables the cache.
+ * @return  0 if ok else -1.
+ */
+int unvme_embed_cache_init(u64 budget)
+{
+  pthread_mutex_lock(&cache.lock);
+  free(cache.entries);
+  free(cache.buckets);
+  free(cache.data);
+  cache.entries = NULL;
+  cache.buckets = NULL;
+  cache.data = NULL;
+  cache.npages = cache.nbuckets = cache.hand = 0;
+  memset(&cache.stats, 0, sizeof(cache.stats));
+
+  int npages = budget / CACHE_PAGESIZE;
+  if (npages > 0) {
+    int nbuckets = 1;
+    while (nbuckets < npages) nbuckets <<= 1;
+    cache.entries = malloc(npages * sizeof(cache_entry_t));
+    cache.buckets = malloc(nbuckets * sizeof(int));
+    cache.data = malloc((u64)npages * CACHE_PAGESIZE);
+    if (!cache.entries || !cache.buckets || !cache.data) {
+      free(cache.entries);
+      free(cache.buckets);
+      free(cache.data);
+      cache.entries = NULL;
+      cache.buckets = NULL;
+      cache.data = NULL;
+      pthread_mutex_unlock(&cache.lock);
+      return -1;
+    }
+    int i;
+    for (i = 0; i < npages; i++) {
+      cache.entries[i].key = CACHE_NOKEY;
+      cache.entries[i].next = -1;
+      cache.entries[i].ref = 0;
+    }
+    for (i = 0; i < nbuckets; i++) cache.buckets[i] = -1;
+    cache.npages = npages;
+    cache.nbuckets = nbuckets;
+  }
+  pthread_mutex_unlock(&cache.lock);
+  return 0;
+}
+
+/**
+ * Load the pages of known hot rows of a table into the cache.
+ */
+void unvme_embed_cache_load(int* rows, int nrows, int vector_length,
+    int table_id, int qid)
+{
+  embed_view_t v;
+  table_get(table_id, vector_length, &v);
+  void* pages[EMBED_MAXDEVS] = { NULL };
+  int maxpages = (table_rowbytes(&v.shard[0]) + 4095) / 4096 + 1;
+  int i;
+  for (i = 0; i < nrows; i++) {
+    int s = table_shard(&v, rows[i]);
+    const embed_table_t* t = &v.shard[s];
+    const embed_dev_t* dev = devs + v.dev[s];
+    if (!pages[s]) pages[s] = unvme_alloc(dev->ns, (u64)maxpages * 4096);
+    cache_read_row(dev, qid, t, table_row_offset(t, rows[i] - t->row0),
+                   pages[s], 0);
+  }
+  for (i = 0; i < v.nshards; i++) {
+    if (pages[i]) unvme_free(devs[v.dev[i]].ns, pages[i]);
+  }
+}
+
+/**
+ * Get the hot embedding cache statistics.
+ */
+void unvme_embed_cache_stats(embed_cache_stats_t* stats)
+{
+  pthread_mutex_lock(&cache.lock);
+  *stats = cache.stats;
+  pthread_mutex_unlock(&cache.lock);
+}
+
+/**
+ * Get the hot embedding cache hit rate.
+ */
+double unvme_embed_cache_hit_rate()
+{
+  pthread_mutex_lock(&cache.lock);
+  u64 total = cache.stats.hits + cache.stats.misses;
+  double rate = total ? (double)cache.stats.hits / total : 0.0;
+  pthread_mutex_unlock(&cache.lock);
+  return rate;
+}
+
+/**
+ * Open the devices to hold the tables, as a comma separated list of PCI
+ * names (e.g. "01:00.0,02:00.0").  Lookups fan out to the devices of a
+ * table's shards with the same qid, so the devices must have the same
+ * block size and queues.
+ * @return  0 if ok else -1.
+ */
+int open_unvme_devices(const char* names)
+{
+  char* list = strdup(names);
+  char* save = NULL;
+  char* name;
+  int q;
+
+  for (name = strtok_r(list, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+    if (ndevs == EMBED_MAXDEVS) {
+      ERROR("more than %d devices", EMBED_MAXDEVS);
+      break;
+    }
+    const unvme_ns_t* dns = unvme_open(name);
+    if (!dns) break;
+    if (ndevs && (dns->blocksize != ns->blocksize || dns->qcount != ns->qcount ||
+                  dns->qsize != ns->qsize)) {
+      ERROR("%s block size or queues differ from %s", dns->device, ns->device);
+      unvme_close(dns);
+      break;
+    }
+    embed_dev_t* dev = devs + ndevs++;
+    dev->ns = dns;
+    if (!ns) ns = dns;
+    // back large table buffers with hugepages (when reserved)
+    unvme_set_hugepage(dns, UNVME_HUGEPAGE_2MB);
+    dev->page = unvme_alloc(dns, 4096);
+    // keep table refresh writes from filling the queues shared with lookups
+    for (q = 0; q < dns->qcount; q++)
+      unvme_set_qprio(dns, q, UNVME_QPRIO_MEDIUM, lookup_reserve);
+    catalog_open(dev);
+  }
+  free(list);
+  return name ? -1 : 0;
+}
+
+void open_unvme()
+{
+  if (open_unvme_devices(pciname)) exit(1);
+}
+
+void close_unvme()
+{
+  while (ndevs) {
+    embed_dev_t* dev = devs + --ndevs;
+    unvme_free(dev->ns, dev->catalog);
+    unvme_free(dev->ns, dev->page);
+    unvme_close(dev->ns);
+  }
+  ns = NULL;
+}
+
+/**
+ * Bind the calling (e.g. Python worker) thread to its own queue and return
+ * the qid to pass to the lookup calls.  See unvme_qbind for the flags.
+ */
+int bind_unvme_queue(int flags)
+{
+  return unvme_qbind(ns, flags);
+}
+
+void unbind_unvme_queue()
+{
+  unvme_qunbind(ns);
+}
+
+/**
+ * Set the priority class of a lookup queue on every device (e.g.
+ * UNVME_QPRIO_HIGH for online inference next to offline table loads), see
+ * unvme_set_qprio.  The queue must have no pending I/O.
+ */
+int set_unvme_queue_prio(int qid, int prio)
+{
+  int i, err = 0;
+  for (i = 0; i < ndevs; i++) {
+    if (unvme_set_qprio(devs[i].ns, qid, prio, lookup_reserve)) err = -1;
+  }
+  return err;
+}
+
+void flush_unvme()
+{
+  int i;
+  for (i = 0; i < ndevs; i++) unvme_flush(devs[i].ns, 0);
+}
+
+/**
+ * Write the last partial block of a table through a zero padded buffer.
+ */
+static void table_write_tail(const unvme_ns_t* dns, const char* src,
+    u64 size, u64 lba, int q)
+{
+  void* buf = unvme_alloc(dns, dns->blocksize);
+  memcpy(buf, src, size);
+  memset(buf + size, 0, dns->blocksize - size);
+  if (unvme_write(dns, q, buf, lba, 1)) IOERROR("write", lba);
+  unvme_free(dns, buf);
+}
+
+/**
+ * Table loader worker: write every nq-th maxbpio sized unit of a job through
+ * its own queue with load_nbufs commands in flight.  In streaming mode each
+ * unit is first copied (or packed, for padded rows) into one of the worker's
+ * staging buffers.
+ */
+static void* table_load_worker(void* arg)
+{
+  load_job_t* job = arg;
+  const unvme_ns_t* ns = job->ns;
+  u64 unit = (u64)ns->maxbpio << ns->blockshift;
+  void* bufs[load_nbufs];
+  unvme_iod_t iods[load_nbufs];
+  u64 lens[load_nbufs];
+  u64 off;
+  int i, b = 0;
+
+  for (i = 0; i < load_nbufs; i++) {
+    bufs[i] = job->stream ? unvme_alloc(ns, unit) : NULL;
+    iods[i] = NULL;
+  }
+
+  for (off = job->q * unit; off < job->size; off += job->nq * unit) {
+    if (iods[b]) {
+      if (unvme_apoll(iods[b], UNVME_TIMEOUT)) IOERROR("apoll", job->lba);
+      __sync_fetch_and_add(&load_done, lens[b]);
+    }
+    u64 len = job->size - off < unit ? job->size - off : unit;
+    u64 lba = job->lba + (off >> ns->blockshift);
+    const void* p = job->src + off;
+    if (job->pack) {
+      table_pack(job->pack, bufs[b], job->src, off, len);
+      p = bufs[b];
+    } else if (job->stream) {
+      p = memcpy(bufs[b], p, len);
+    }
+    if (!(iods[b] = unvme_awrite(ns, job->q, p, lba, len >> ns->blockshift)))
+        IOERROR("awrite", lba);
+    lens[b] = len;
+    if (++b == load_nbufs) b = 0;
+  }
+
+  for (i = 0; i < load_nbufs; i++) {
+    if (iods[i]) {
+      if (unvme_apoll(iods[i], UNVME_TIMEOUT)) IOERROR("apoll", job->lba);
+      __sync_fetch_and_add(&load_done, lens[i]);
+    }
+    if (bufs[i]) unvme_free(ns, bufs[i]);
+  }
+  return 0;
+}
+
+/**
+ * Write whole blocks of table memory striped across all the queues, one
+ * worker thread per queue.
+ */
+static void table_load(const unvme_ns_t* dns, const char* src, u64 size,
+    u64 lba, int stream, const embed_table_t* pack)
+{
+  int nq = dns->qcount;
+  pthread_t workers[nq];
+  load_job_t jobs[nq];
+  int q;
+
+  for (q = 0; q < nq; q++) {
+    jobs[q] = (load_job_t){ dns, src, size, lba, q, nq, stream, pack };
+    if (pthread_create(&workers[q], 0, table_load_worker, &jobs[q]))
+        FATAL("pthread_create");
+  }
+  for (q = 0; q < nq; q++) pthread_join(workers[q], 0);
+}
+
+/**
+ * Write table memory in place: each load_chunk of it is mapped for DMA,
+ * written across all the queues, and unmapped.  Returns the number of bytes
+ * written, which stops short if the memory is not block aligned (as the
+ * device DMA requires) or cannot be mapped (e.g. over the memlock limit).
+ */
+static u64 table_write_mapped(const unvme_ns_t* dns, const char* table,
+    u64 size, u64 lba)
+{
+  u64 pagemask = dns->pagesize - 1;
+  u64 off = 0;
+
+  // chunks end on a block boundary, so the partial last block is left out
+  u64 whole = size & ~(u64)(dns->blocksize - 1);
+  while (off < whole) {
+    u64 len = whole - off < load_chunk ? whole - off : load_chunk;
+    const char* p = table + off;
+    if ((u64)p & (dns->blocksize - 1)) break;
+    char* pages = (char*)((u64)p & ~pagemask);
+    u64 mapsize = (((u64)p + len + pagemask) & ~pagemask) - (u64)pages;
+    if (unvme_map(dns, mapsize, pages)) break;
+
+    table_load(dns, p, len, lba, 0, NULL);
+    unvme_free(dns, pages);
+
+    off += len;
+    lba += len >> dns->blockshift;
+  }
+  return off;
+}
+
+/**
+ * Encode float table rows into a reduced precision type for loading with
+ * unvme_write_table_dtype.  Int8 rows are quantized over each row's range
+ * and keep its scale and bias after the row.
+ * @param   dst         buffer of table_length * embed_dtype_rowbytes bytes
+ * @return  0 if ok else -1.
+ */
+int unvme_encode_table(const float* src, void* dst, int vector_length,
+    long table_length, int dtype)
+{
+  size_t rowbytes = embed_dtype_rowbytes(dtype, vector_length);
+  long r;
+  int i;
+
+  if (dtype < 0 || dtype >= EMBED_DTYPE_COUNT) return -1;
+  for (r = 0; r < table_length; r++) {
+    const float* x = src + (u64)r * vector_length;
+    void* row = (char*)dst + r * rowbytes;
+    if (dtype == EMBED_DTYPE_FP32) {
+      memcpy(row, x, rowbytes);
+    } else if (dtype == EMBED_DTYPE_INT8) {
+      float min = x[0], max = x[0];
+      for (i = 1; i < vector_length; i++) {
+        if (x[i] < min) min = x[i];
+        if (x[i] > max) max = x[i];
+      }
+      float scale = max > min ? (max - min) / 255.0f : 1.0f;
+      u8* q = row;
+      for (i = 0; i < vector_length; i++) q[i] = (u8)((x[i] - min) / scale + 0.5f);
+      memcpy(q + vector_length, &scale, sizeof(float));
+      memcpy(q + vector_length + sizeof(float), &min, sizeof(float));
+    } else {
+      u16* h = row;
+      for (i = 0; i < vector_length; i++)
+        h[i] = dtype == EMBED_DTYPE_FP16 ? embed_float_to_fp16(x[i])
+                                         : embed_float_to_bf16(x[i]);
+    }
+  }
+  return 0;
+}
+
+/// table load of one shard
+typedef struct {
+  const unvme_ns_t* ns;         ///< device of the shard
+  const char* src;              ///< table rows of the shard
+  const embed_table_t* t;       ///< shard catalog entry
+} shard_job_t;
+
+/**
+ * Write the rows of one table shard to its device.
+ */
+static void* table_write_shard(void* arg)
+{
+  shard_job_t* job = arg;
+  const unvme_ns_t* dns = job->ns;
+  const embed_table_t* t = job->t;
+  const char* src = job->src;
+  u64 size = table_rowbytes(t) * t->table_length;
+  u64 lba = t->slba;
+
+  if (table_padded(t)) {
+    table_load(dns, src, table_bytes(t), lba, 1, t);
+  } else {
+    u64 off = table_write_mapped(dns, src, size, lba);
+    u64 whole = size & ~(u64)(dns->blocksize - 1);
+    if (off < whole)
+      table_load(dns, src + off, whole - off, lba + (off >> dns->blockshift), 1, NULL);
+    if (whole < size)
+      table_write_tail(dns, src + whole, size - whole,
+                       lba + (whole >> dns->blockshift), 0);
+  }
+  return 0;
+}
+
+/**
+ * Write an embedding table to the device, creating (or re-creating) its
+ * catalog entry if its dimensions or type are new.  The rows are given in
+ * the table's type (see unvme_encode_table).  The table is striped across all
+ * the queues with maxbpio sized commands.  Unpadded rows are written in
+ * place when the table memory is block aligned and can be mapped, else
+ * streamed through per queue staging buffers, so there is no full size copy
+ * either way; padded rows are always packed into the staging buffers.  The shards of a table
+ * split across devices are written in parallel.  A load uses every queue,
+ * so it must not run concurrently with lookups.  Returns the achieved GB/s.
+ */
+double unvme_write_table_dtype(const void* table, int vector_length,
+        int table_length, int table_id, int dtype)
+{
+  embed_table_t t = { .flags = 0 };
+  if (unvme_table_info(table_id, &t) ||
+      t.vector_length != (u32)vector_length ||
+      t.table_length != (u64)table_length || t.dtype != (u32)dtype) {
+    if (unvme_create_table(table_id, vector_length, table_length, dtype, t.flags))
+      errx(1, "create table %d", table_id);
+  }
 
-typedef struct {
-  u32 attribute_size;
-  u32 embedding_length;
-  u32 result_embeddings;
-  u32 input_embeddings;
-  u32 table_id;
+  embed_view_t v;
+  table_get(table_id, vector_length, &v);
+  pthread_t workers[EMBED_MAXDEVS];
+  shard_job_t jobs[EMBED_MAXDEVS];
+  u64 tsc = rdtsc();
+  int i;
 
-  u32 embedding_id_list[];
-} embed_config_t;
+  load_done = 0;
+  load_total = 0;
+  for (i = 0; i < v.nshards; i++) {
+    const embed_table_t* st = &v.shard[i];
+    load_total += table_padded(st) ? table_bytes(st)
+                                   : table_rowbytes(st) * st->table_length;
+  }
+  for (i = 0; i < v.nshards; i++) {
+    jobs[i] = (shard_job_t){ devs[v.dev[i]].ns,
+        (const char*)table + v.shard[i].row0 * table_rowbytes(&v.shard[i]),
+        &v.shard[i] };
+    if (v.nshards == 1) table_write_shard(&jobs[i]);
+    else if (pthread_create(&workers[i], 0, table_write_shard, &jobs[i]))
+        FATAL("pthread_create");
+  }
+  if (v.nshards > 1) {
+    for (i = 0; i < v.nshards; i++) pthread_join(workers[i], 0);
+  }
+  load_done = load_total;
 
-// Global variables
-static const unvme_ns_t* ns;           ///< unvme namespace pointer
-static int qcount = 8;                 ///< queue count
-static int qsize = 256;                ///< queue size
-static u64 timeout = 0;                ///< tsc elapsed timeout
-static char* pciname = "01:00.0";      ///< PCIe identifier for OpenSSD
-static int slba = 5000;                ///< Block address to store embedding table
-// Lets put tables 10GB apart -- stride is in logical blocks (4KB)
-static int table_stride = 2500000;
+  pthread_mutex_lock(&cache.lock);
+  cache_invalidate(table_id);
+  pthread_mutex_unlock(&cache.lock);
 
-static void* fromPageAlloc;
+  double secs = (double)rdtsc_elapse(tsc) / rdtsc_second();
+  load_gbps = load_total / secs / 1e9;
+  INFO_FN("table %d: %lu bytes in %.3f secs (%.2f GB/s)",
+          table_id, load_total, secs, load_gbps);
+  return load_gbps;
+}
 
 /**
- * Submit an io and record the submission latency time.
+ * Write a float embedding table to the device (see unvme_write_table_dtype).
  */
-static void io_submit(int q, int rw, bw_page_t* p)
+double unvme_write_table(float* table, int vector_length,
+        int table_length, int table_id)
 {
-    p->tsc = rdtsc();
-    if (rw) {
-        p->iod = unvme_awrite(ns, q, p->buf, p->lba, ns->nbpp);
-        if (!p->iod) IOERROR("awrite", p);
-    } else {
-        p->iod = unvme_aread(ns, q, p->buf, p->lba, ns->nbpp);
-        if (!p->iod) IOERROR("aread", p);
-    }
+  return unvme_write_table_dtype(table, vector_length, table_length,
+                                 table_id, EMBED_DTYPE_FP32);
+}
+
+/**
+ * Return the fraction of the current (or last) table load written so far,
+ * which may be polled from another thread.
+ */
+double unvme_load_progress()
+{
+  return load_total ? (double)load_done / load_total : 1.0;
 }
 
 /**
- * Reads/writes a region of data.
+ * Return the throughput in GB/s of the last table load.
  */
-static void rw_region(void *buf, u64 slba, u64 nlb,
-                      int rw, int q)
+double unvme_load_gbps()
 {
-  timeout = 30 * rdtsc_second();
+  return load_gbps;
+}
 
-  u64 lba = slba;
-  int qdepth = qsize - 1;
+/**
+ * Round a byte count up to logical blocks.
+ */
+static int sls_nlb(int bytes)
+{
+  return (bytes + ns->blocksize - 1) / ns->blocksize;
+}
 
-  bw_page_t* pages = calloc(qdepth, sizeof(bw_page_t));
-  void* buf_p = buf;
-  bw_page_t* p = pages;
+/**
+ * Lay out an SLS translation config at the start of a buffer.  The device
+ * pools and returns elements of attribute_size bytes (4 for fp32 and 2 for
+ * fp16 tables).
+ * @return  number of config logical blocks.
+ */
+static int sls_config(void* buf, const int* flatInd, const embed_table_t* t,
+    int batchsize, int input_embeddings)
+{
+  embed_config_t *config = (embed_config_t*)buf;
+  config->attribute_size = t->dtype == EMBED_DTYPE_FP16 ? 2 : 4;
+  config->embedding_length = t->vector_length;
+  config->result_embeddings = batchsize;
+  config->input_embeddings = input_embeddings;
+  config->table_id = t->table_id;
   int i;
-  for (i = 0; i < qdepth; i++) {
-    p->buf = buf_p;
-    p->lba = lba;
-    buf_p += ns->pagesize;
-    lba += ns->nbpp;
-    p++;
-  }
-
-  for (i = 0; i < qdepth; i++) io_submit(q, rw, pages + i);
-
-  i = 0;
-  int pending = qdepth;
-  do {
-    p = pages + i;
-    if (p->iod) {
-      if (unvme_apoll(p->iod, 0) == 0) {
-        if (lba < slba + nlb) {
-          p->buf = buf_p;
-          p->lba = lba;
-          buf_p += ns->pagesize;
-          lba += ns->nbpp;
-          io_submit(q, rw, p);
-        } else {
-          p->iod = 0;
-          pending--;
-        }
-      } else if ((rdtsc_elapse(p->tsc)) > timeout) {
-        IOERROR("apoll timeout", p);
-      }
-    }
-    if (++i == qdepth) i = 0;
-  } while (pending > 0);
+  for(i = 0; i < 2*input_embeddings; i++)
+    config->embedding_id_list[i] = flatInd[i];
+  return sls_nlb(4*2*input_embeddings + 20);
+}
 
-  free(pages);
+/**
+ * Return the bytes of the NDP results of a table.
+ */
+static int sls_resbytes(const embed_table_t* t, int batchsize)
+{
+  return (t->dtype == EMBED_DTYPE_FP16 ? 2 : 4) * t->vector_length * batchsize;
 }
 
-void open_unvme()
+/**
+ * Widen the n NDP result elements of a table to float in place.
+ */
+static void sls_widen(const embed_table_t* t, void* buf, int n)
 {
-  if (!(ns = unvme_open(pciname))) exit(1);
-  fromPageAlloc = unvme_alloc(ns, 4096);
+  const u16* h = buf;
+  float* f = buf;
+  int i;
+  if (t->dtype == EMBED_DTYPE_FP16) {
+    for (i = n - 1; i >= 0; i--) f[i] = embed_fp16_to_float(h[i]);
+  }
 }
 
-void close_unvme()
+/// NDP translation request of one table shard
+typedef struct {
+  const unvme_ns_t* ns;         ///< device of the shard
+  const embed_table_t* t;       ///< shard catalog entry
+  float* out;                   ///< results of the table to accumulate into
+  void* buf;                    ///< config and result buffer (DMA buffer)
+  unvme_iod_t iod;              ///< translation in flight
+} sls_req_t;
+
+/// SLS batch of several tables whose translations are in flight
+typedef struct {
+  embed_view_t* views;          ///< tables of the batch
+  int ntables;                  ///< number of tables
+  sls_req_t* reqs;              ///< translation requests
+  int nreq;                     ///< number of requests
+  u64 nres;                     ///< result elements per table
+  int* gates;                   ///< table gates taken
+  int ngates;                   ///< number of gates taken
+  float* out;                   ///< results of the batch
+  int vector_length;            ///< result row length
+  int* counts;                  ///< rows of each result row (mean pooling)
+} sls_batch_t;
+
+/**
+ * Count the rows pooled into each of nres result rows from n index pairs.
+ * @param   count       nres zeroed counts to add to
+ */
+static void pool_counts(int* count, const int* ind, int n, int nres)
 {
-  unvme_free(ns, fromPageAlloc);
-  unvme_close(ns);
+  int i;
+  for (i = 0; i < n; i++) {
+    if ((u32)ind[2*i] < (u32)nres) count[ind[2*i]]++;
+  }
 }
 
-void flush_unvme()
+/**
+ * Finish the mean pooling of nres summed result rows, given their counts.
+ */
+static void pool_means(float* out, const int* count, int nres, int vector_length)
 {
-  unvme_flush(ns, 0);
+  int i;
+  for (i = 0; i < nres; i++)
+    embed_pool_mean(out + (u64)i * vector_length, count[i], vector_length);
 }
 
-void unvme_write_table(float* table, int vector_length,
-        int table_length, int table_id)
+/**
+ * Submit the SLS of several tables, to accumulate [batchsize][vector_length]
+ * results per table into out.  The index pairs of each table are split by
+ * shard, the rows cached on the host are summed here, and one translation
+ * request per shard of each table is submitted to the shard's device, spread
+ * over queues qid to qid+nq-1, with all of them in flight together.  The
+ * results are complete after sls_finish, and the tables are not updated
+ * in between.
+ */
+static void sls_submit(sls_batch_t* b, const int* flatInd, int vector_length,
+    int batchsize, int ntables, const int* table_ids,
+    const int* input_embeddings, int qid, int nq, float* out)
 {
-  void* buf = unvme_alloc(ns, 4 * vector_length * table_length);
+  u64 nres = (u64)vector_length * batchsize;
+  embed_view_t* views = malloc(ntables * sizeof(embed_view_t));
+  sls_req_t* reqs = malloc((u64)ntables * EMBED_MAXDEVS * sizeof(sls_req_t));
+  int maxinput = 0;
+  int nreq = 0;
+  int t, s, i;
+
+  for (t = 0; t < ntables; t++) {
+    if (input_embeddings[t] > maxinput) maxinput = input_embeddings[t];
+  }
+  int* shardInd = malloc((2 * maxinput + 1) * sizeof(int));
+  memset(out, 0, ntables * nres * sizeof(float));
+  int* gates = malloc(ntables * sizeof(int));
+  int ngates = table_lookups_begin(table_ids, ntables, gates);
+  // the counts of mean pooling are taken now, as flatInd may be reused
+  int* counts = NULL;
+  if (pooling == EMBED_POOLING_MEAN) {
+    const int* ind = flatInd;
+    counts = calloc((u64)ntables * batchsize, sizeof(int));
+    for (t = 0; t < ntables; t++) {
+      pool_counts(counts + (u64)t * batchsize, ind, input_embeddings[t], batchsize);
+      ind += 2 * input_embeddings[t];
+    }
+  }
+
+  for (t = 0; t < ntables; t++) {
+    embed_view_t* v = &views[t];
+    const int* ind = flatInd;
+    flatInd += 2 * input_embeddings[t];
+    table_get_ndp(table_ids[t], vector_length, v);
+
+    for (s = 0; s < v->nshards; s++) {
+      const embed_table_t* st = &v->shard[s];
+      int n = 0;
+      for (i = 0; i < 2*input_embeddings[t]; i += 2) {
+        if (table_shard(v, ind[i+1]) != s) continue;
+        shardInd[2*n] = ind[i];
+        shardInd[2*n+1] = ind[i+1] - st->row0;
+        n++;
+      }
+      // rows cached on the host are summed here and left out of the request
+      if (cache.npages) n = cache_split(st, shardInd, n, out + t * nres, shardInd);
+      if (n == 0) continue;
+
+      sls_req_t* r = &reqs[nreq];
+      int q = qid + nreq++ % nq;
+      // the buffer holds the config, then the results widened to float
+      u64 resbytes = 4 * nres;
+      u64 cfgbytes = 4*2*n + 20;
+      r->ns = devs[v->dev[s]].ns;
+      r->t = st;
+      r->out = out + t * nres;
+      r->buf = unvme_alloc(r->ns, resbytes > cfgbytes ? resbytes : cfgbytes);
+      int config_nlb = sls_config(r->buf, shardInd, st, batchsize, n);
+      r->iod = unvme_atranslate_region(r->ns, q, r->buf, st->slba + q,
+                                       sls_nlb(sls_resbytes(st, batchsize)),
+                                       config_nlb);
+      if (!r->iod) errx(1, "atranslate_region");
+    }
+  }
+
+  free(shardInd);
+  *b = (sls_batch_t){ views, ntables, reqs, nreq, nres, gates, ngates,
+                      out, vector_length, counts };
+}
 
-  float* bufp = (float*)buf;
-  float* tablep = table;
+/**
+ * Wait for the translations of an SLS batch and sum them into its results.
+ */
+static void sls_finish(sls_batch_t* b)
+{
   int i;
-  for (i = 0; i < vector_length * table_length; i++)
-  {
-    *bufp = *tablep;
-    bufp++;
-    tablep++;
+  for (i = 0; i < b->nreq; i++) {
+    sls_req_t* r = &b->reqs[i];
+    if (unvme_apoll(r->iod, UNVME_TIMEOUT)) errx(1, "translate");
+    sls_widen(r->t, r->buf, b->nres);
+    embed_pool_sum(r->out, r->buf, b->nres);
+    unvme_free(r->ns, r->buf);
   }
+  if (b->counts) {
+    int batchsize = b->nres / b->vector_length;
+    for (i = 0; i < b->ntables; i++)
+      pool_means(b->out + i * b->nres, b->counts + (u64)i * batchsize,
+                 batchsize, b->vector_length);
+  }
+  table_lookups_end(b->gates, b->ngates);
+  free(b->counts);
+  free(b->gates);
+  free(b->reqs);
+  free(b->views);
+  b->nreq = 0;
+  b->reqs = NULL;
+  b->views = NULL;
+  b->gates = NULL;
+  b->counts = NULL;
+}
+
+/**
+ * Run the SLS of several tables into out (see sls_submit).
+ */
+static void sls_run(const int* flatInd, int vector_length, int batchsize,
+    int ntables, const int* table_ids, const int* input_embeddings,
+    int qid, int nq, float* out)
+{
+  sls_batch_t b;
+  sls_submit(&b, flatInd, vector_length, batchsize, ntables, table_ids,
+             input_embeddings, qid, nq, out);
+  sls_finish(&b);
+}
+
+/**
+ * Set the pooling mode of the SLS lookups (the single table, fused, streamed
+ * and baseline variants): EMBED_POOLING_SUM (the default) or
+ * EMBED_POOLING_MEAN, which divides each result row by the number of rows
+ * pooled into it.  A streamed batch keeps the mode it was submitted with.
+ * @return  0 if ok else -1.
+ */
+int unvme_sls_set_pooling(int mode)
+{
+  if (mode != EMBED_POOLING_SUM && mode != EMBED_POOLING_MEAN) return -1;
+  pooling = mode;
+  return 0;
+}
 
-  rw_region(buf, slba + (table_id * table_stride),
-          (4 * vector_length * table_length) / ns->blocksize, 1, 0);
+/**
+ * Free a result tensor returned by unvme_sparse_length_sum (and the multi
+ * and baseline variants).
+ */
+void unvme_free_result(float* result)
+{
+  free(result);
 }
 
+/**
+ * SLS of one table on the device.  The [batchsize][vector_length] results
+ * are followed by the elapsed time in seconds, to be freed with
+ * unvme_free_result.
+ */
 float* unvme_sparse_length_sum(
     int* flatInd, int vector_length, int batchsize, int embed_per_result,
     int table_id, int qid, int input_embeddings)
 {
-  int buffersize = (4*vector_length*batchsize > (4*2*input_embeddings + 20)) ?
-    4*vector_length*batchsize:(4*2*input_embeddings + 20);
-  void* result_ptr;
-  result_ptr = unvme_alloc(ns, buffersize);
-  embed_config_t *config = (embed_config_t*)result_ptr;
-  config->attribute_size = 4;
-  config->embedding_length = vector_length;
-  config->result_embeddings = batchsize;
-  config->input_embeddings = input_embeddings;
-  config->table_id = table_id;
-  int i;
-  for(i = 0; i < 2*input_embeddings; i++)
-    config->embedding_id_list[i] = flatInd[i];
-  int nlb = (4 * vector_length * batchsize) / ns->blocksize;
-  if ((4 * vector_length * batchsize) % ns->blocksize) nlb++;
-  int config_nlb = (4*2*input_embeddings + 20) / ns->blocksize;
-  if ((4*2*input_embeddings + 20) % ns->blocksize) config_nlb++;
+  // the results are summed on the host, so they need no DMA buffer
+  float* result_ptr = malloc((4*vector_length*batchsize) + sizeof(float));
 
   u64 tstart = rdtsc();
-  int err = unvme_translate_region(ns, qid,
-      result_ptr,
-      slba + (table_id * table_stride) + qid,
-      nlb,
-      config_nlb);
-  if (err) errx(1, "translate");
+  sls_run(flatInd, vector_length, batchsize, 1, &table_id, &input_embeddings,
+          qid, 1, result_ptr);
   u64 telapse = rdtsc_elapse(tstart);
 
-  float* time_ptr = ((float*)result_ptr) + (vector_length*batchsize);
+  float* time_ptr = result_ptr + (vector_length*batchsize);
   *time_ptr = ((float)telapse / (float)rdtsc_second());
 
-  return (float*)result_ptr;
+  return result_ptr;
 }
 
-float* unvme_read_embedding(int embedidx, int vector_length, int table_id, int qid)
+/**
+ * Fused SLS over several tables in one call.  One translation request per
+ * table shard is submitted, spread over queues qid to qid+nq-1, and all are
+ * in flight together.  flatInd holds the index pairs of each table back to
+ * back (2*input_embeddings[t] entries for table t).  The results are
+ * returned as one contiguous [ntables][batchsize][vector_length] tensor
+ * followed by the elapsed time in seconds, to be freed with
+ * unvme_free_result.
+ */
+float* unvme_sparse_length_sum_multi(
+    int* flatInd, int vector_length, int batchsize, int ntables,
+    int* table_ids, int* input_embeddings, int qid, int nq)
 {
-  int attribute_size = 4;
-  void* fromPage = fromPageAlloc;
-  void* embedding = fromPage +
-      ((embedidx % (4096 / (attribute_size * vector_length))) * (attribute_size * vector_length));
+  int resbytes = 4 * vector_length * batchsize;
+  if (nq <= 0) nq = 1;
+  float* result_ptr = malloc((u64)resbytes * ntables + sizeof(float));
 
   u64 tstart = rdtsc();
-  unvme_read(ns, qid, fromPage,
-      slba + (table_id * table_stride) + ((attribute_size * vector_length * embedidx) / 4096),
-      1);
+  sls_run(flatInd, vector_length, batchsize, ntables, table_ids,
+          input_embeddings, qid, nq, result_ptr);
   u64 telapse = rdtsc_elapse(tstart);
-
-  float* time_ptr = ((float*)embedding) + (vector_length);
+  float* time_ptr = (float*)((char*)result_ptr + (u64)ntables * resbytes);
   *time_ptr = ((float)telapse / (float)rdtsc_second());
 
-  return (float*)embedding;
+  return result_ptr;
+}
+
+/// streamed SLS result slot states
+enum { SLOT_FREE, SLOT_INFLIGHT, SLOT_DONE, SLOT_ACQUIRED };
+
+/// streamed SLS result slot
+typedef struct {
+  int state;                    ///< SLOT_* state
+  sls_batch_t batch;            ///< translations in flight
+  u64 nout;                     ///< result floats (before the time)
+  u64 tsc;                      ///< submission tsc
+} sls_slot_t;
+
+/// ring of streamed SLS result slots
+static struct {
+  float* mem;                   ///< slot result tensors
+  int own;                      ///< mem is allocated by the ring
+  int nslots;                   ///< number of slots
+  u64 slotfloats;               ///< floats per slot (results and time)
+  int next;                     ///< next slot to submit to
+  sls_slot_t* slots;            ///< slots
+  pthread_t owner;              ///< thread that opened the stream
+} sls_ring;
+
+/**
+ * Finish the translations of the slots in flight when called by the thread
+ * of the stream, so its row updates and held back lookups do not wait on
+ * lookups only it can end.  The slots are acquired as usual.
+ */
+static void sls_stream_finish_own()
+{
+  int i;
+  if (!sls_ring.slots || !pthread_equal(sls_ring.owner, pthread_self())) return;
+  for (i = 0; i < sls_ring.nslots; i++) {
+    sls_slot_t* sl = &sls_ring.slots[i];
+    if (sl->state != SLOT_INFLIGHT) continue;
+    sls_finish(&sl->batch);
+    sls_ring.mem[i * sls_ring.slotfloats + sl->nout] =
+        (float)rdtsc_elapse(sl->tsc) / (float)rdtsc_second();
+    sl->state = SLOT_DONE;
+  }
+}
+
+/**
+ * Set up a ring of result slots for streamed fused SLS.  Each slot holds
+ * the [ntables][batchsize][vector_length] results of one batch followed by
+ * its elapsed time, and the results land in place, so the caller may hand
+ * them out zero-copy while later batches are in flight.
+ * @param   mem         nslots * slot_floats floats of caller memory, or
+ *                      NULL to allocate them
+ * @param   nslots      number of slots
+ * @param   slot_floats floats per slot (at least the largest batch result
+ *                      tensor plus 1)
+ * @return  0 if ok else -1.
+ */
+int unvme_sls_stream_open(float* mem, int nslots, long slot_floats)
+{
+  if (sls_ring.slots || nslots <= 0 || slot_floats <= 1) return -1;
+  sls_ring.own = mem == NULL;
+  sls_ring.mem = mem ? mem : malloc((u64)nslots * slot_floats * sizeof(float));
+  sls_ring.nslots = nslots;
+  sls_ring.slotfloats = slot_floats;
+  sls_ring.next = 0;
+  sls_ring.slots = calloc(nslots, sizeof(sls_slot_t));
+  sls_ring.owner = pthread_self();
+  return 0;
+}
+
+/**
+ * Submit a fused SLS batch (see unvme_sparse_length_sum_multi) to the next
+ * result slot of the stream, without waiting for it.  The translations of
+ * a batch go out while the results of earlier slots are still being used.
+ * @return  the slot, or -1 if the next slot is not released yet or the
+ *          results do not fit a slot.
+ */
+int unvme_sls_stream_submit(int* flatInd, int vector_length, int batchsize,
+    int ntables, int* table_ids, int* input_embeddings, int qid, int nq)
+{
+  int slot = sls_ring.next;
+  if (!sls_ring.slots) return -1;
+  sls_slot_t* sl = &sls_ring.slots[slot];
+  if (sl->state != SLOT_FREE ||
+      (u64)ntables * vector_length * batchsize + 1 > sls_ring.slotfloats)
+    return -1;
+  if (nq <= 0) nq = 1;
+
+  sl->nout = (u64)ntables * vector_length * batchsize;
+  sl->tsc = rdtsc();
+  sls_submit(&sl->batch, flatInd, vector_length, batchsize, ntables,
+             table_ids, input_embeddings, qid, nq,
+             sls_ring.mem + slot * sls_ring.slotfloats);
+  sl->state = SLOT_INFLIGHT;
+  sls_ring.next = (slot + 1) % sls_ring.nslots;
+  return slot;
+}
+
+/**
+ * Acquire the results of a submitted slot, waiting for its translations.
+ * The results stay valid until the slot is released.
+ * @return  the slot results followed by the elapsed time in seconds, or
+ *          NULL if the slot was not submitted.
+ */
+float* unvme_sls_stream_acquire(int slot)
+{
+  if (!sls_ring.slots || slot < 0 || slot >= sls_ring.nslots) return NULL;
+  sls_slot_t* sl = &sls_ring.slots[slot];
+  float* res = sls_ring.mem + slot * sls_ring.slotfloats;
+  if (sl->state == SLOT_ACQUIRED) return res;
+  if (sl->state == SLOT_FREE) return NULL;
+
+  if (sl->state == SLOT_INFLIGHT) {
+    sls_finish(&sl->batch);
+    res[sl->nout] = (float)rdtsc_elapse(sl->tsc) / (float)rdtsc_second();
+  }
+  sl->state = SLOT_ACQUIRED;
+  return res;
+}
+
+/**
+ * Release an acquired slot for reuse by a later submission.
+ * @return  0 if ok else -1.
+ */
+int unvme_sls_stream_release(int slot)
+{
+  if (!sls_ring.slots || slot < 0 || slot >= sls_ring.nslots ||
+      sls_ring.slots[slot].state != SLOT_ACQUIRED)
+    return -1;
+  sls_ring.slots[slot].state = SLOT_FREE;
+  return 0;
+}
+
+/**
+ * Tear down the result stream, waiting for the slots still in flight.
+ */
+void unvme_sls_stream_close()
+{
+  int i;
+  if (!sls_ring.slots) return;
+  for (i = 0; i < sls_ring.nslots; i++) {
+    if (sls_ring.slots[i].state == SLOT_INFLIGHT)
+      sls_finish(&sls_ring.slots[i].batch);
+  }
+  if (sls_ring.own) free(sls_ring.mem);
+  free(sls_ring.slots);
+  memset(&sls_ring, 0, sizeof(sls_ring));
+}
+
+/**
+ * Read one embedding row, returned as floats followed by the elapsed time in
+ * an internal buffer that is valid until the next call (not to be freed).
+ */
+float* unvme_read_embedding(int embedidx, int vector_length, int table_id, int qid)
+{
+  embed_view_t v;
+  table_get(table_id, vector_length, &v);
+  int s = table_shard(&v, embedidx);
+  const embed_table_t* t = &v.shard[s];
+  const embed_dev_t* dev = devs + v.dev[s];
+  u64 off = table_row_offset(t, embedidx - t->row0);
+  int np = table_row_pages(t, off);
+  void* fromPage = np == 1 ? dev->page : unvme_alloc(dev->ns, (u64)np * 4096);
+
+  u64 tstart = rdtsc();
+  table_lookup_begin(table_id);
+  void* embedding = cache_read_row(dev, qid, t, off, fromPage, 1);
+  table_lookup_end(table_id);
+  // decode the row into a float row with room for the time, which would
+  // not fit after a row at the end of the page
+  if (rowDecodeLen < vector_length + 1) {
+    rowDecodeLen = vector_length + 1;
+    rowDecode = realloc(rowDecode, rowDecodeLen * sizeof(float));
+  }
+  memset(rowDecode, 0, vector_length * sizeof(float));
+  embed_pool_row(rowDecode, embedding, t->dtype, vector_length);
+  u64 telapse = rdtsc_elapse(tstart);
+  if (fromPage != dev->page) unvme_free(dev->ns, fromPage);
+
+  rowDecode[vector_length] = ((float)telapse / (float)rdtsc_second());
+  return rowDecode;
 }
 
 /* Unvme I/O SSD based implementation of lookup. */
-static void embedding_lookup_io(unsigned int qid,
-        unsigned int slba, void *results,  embed_config_t *config)
-{
-  struct attribute
-  {
-    char bytes[config->attribute_size];
-  } *toBase, *toEmbed, *toAtr, *fromAtr, *fromEmbed, *fromPage;
-  unsigned int resultidx, embedlistidx, embedidx, atridx;
-  fromPage = unvme_alloc(ns, 4096);
-
-  toBase = results;
-  toEmbed = toBase;
-  toAtr = toBase;
-
-  for (embedlistidx = 0;
-       embedlistidx < 2*config->input_embeddings;
-       embedlistidx+=2)
-  {
-    resultidx = config->embedding_id_list[embedlistidx];
-    toEmbed = toBase + resultidx*config->embedding_length;
-    toAtr = toEmbed;
-
-    embedidx = config->embedding_id_list[embedlistidx+1];
-    unvme_read(ns, qid, fromPage,
-        slba + ((config->attribute_size * config->embedding_length * embedidx) / 4096),
-        1);
-    fromEmbed = fromPage +
-        ((embedidx % (4096 / (config->attribute_size * config->embedding_length))) * config->embedding_length);
-    fromAtr = fromEmbed;
-    for (atridx = 0;
-         atridx < config->embedding_length;
-         atridx++)
-    {
-      // Assume floats for now
-      *((float*)toAtr) += *((float*)fromAtr);
-      toAtr++;
-      fromAtr++;
+/**
+ * Compare page numbers for sorting.
+ */
+static int page_compare(const void* a, const void* b)
+{
+  u64 x = *(const u64*)a, y = *(const u64*)b;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Find the index of a page in a sorted unique page list.
+ */
+static int page_find(const u64* pages, int npages, u64 page)
+{
+  int lo = 0, hi = npages - 1;
+  while (lo < hi) {
+    int mid = (lo + hi) >> 1;
+    if (pages[mid] < page) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+/**
+ * Return the sort key of a page of a table shard.
+ */
+static inline u64 page_key(int shard, u64 page)
+{
+  return (u64)shard << 48 | page;
+}
+
+/// pages of a table to read or write, with a buffer per shard
+typedef struct {
+  const embed_view_t* v;        ///< table
+  const u64* pages;             ///< sorted unique page keys
+  int npages;                   ///< number of pages
+  int first[EMBED_MAXDEVS + 1]; ///< first page of each shard
+  void* bufs[EMBED_MAXDEVS];    ///< page-ordered buffer of each shard
+} page_set_t;
+
+/**
+ * Set up the page-ordered buffers of a sorted unique page key list, which
+ * keeps the pages grouped by shard, on the devices of the shards.
+ */
+static void page_set_open(page_set_t* ps, const embed_view_t* v,
+    const u64* pages, int npages)
+{
+  int s, i;
+  ps->v = v;
+  ps->pages = pages;
+  ps->npages = npages;
+  for (s = 0, i = 0; s < v->nshards; s++) {
+    ps->first[s] = i;
+    while (i < npages && (int)(pages[i] >> 48) == s) i++;
+    ps->bufs[s] = i > ps->first[s] ?
+        unvme_alloc(devs[v->dev[s]].ns, (u64)(i - ps->first[s]) * 4096) : NULL;
+  }
+  ps->first[v->nshards] = npages;
+}
+
+/**
+ * Return the buffer of page i of a page set.
+ */
+static inline void* page_set_buf(const page_set_t* ps, int i)
+{
+  int s = ps->pages[i] >> 48;
+  return ps->bufs[s] + (u64)(i - ps->first[s]) * 4096;
+}
+
+/**
+ * Read or write the pages of a page set in runs of contiguous pages (up to
+ * maxbpio) at full queue depth across the queues qid to qid+nq-1 of every
+ * device.  Only the descriptors submitted here are polled, so the queues may
+ * carry other I/O (of the stream or other threads) at the same time.
+ */
+static void page_set_io(const page_set_t* ps, int qid, int nq, int write)
+{
+  const embed_view_t* v = ps->v;
+  const u64* pages = ps->pages;
+  int qdepth = ns->qsize - 1;
+  int* inflight = calloc(v->nshards * nq, sizeof(int));
+  unvme_iod_t* iods = malloc(v->nshards * nq * qdepth * sizeof(unvme_iod_t));
+  u64 tlimit = UNVME_TIMEOUT * rdtsc_second();
+  u64 tsc = rdtsc();
+  int next[EMBED_MAXDEVS];
+  int pending = 0, left = ps->npages;
+  int s, j;
+  for (s = 0; s < v->nshards; s++) next[s] = ps->first[s];
+  while (left || pending) {
+    for (s = 0; s < v->nshards; s++) {
+      const unvme_ns_t* dns = devs[v->dev[s]].ns;
+      int maxpages = dns->maxbpio / dns->nbpp;
+      int end = ps->first[s+1];
+      int k;
+      for (k = 0; k < nq; k++) {
+        int q = qid + k;
+        int* qinflight = &inflight[s * nq + k];
+        unvme_iod_t* qiods = iods + (s * nq + k) * qdepth;
+        while (next[s] < end && *qinflight < qdepth) {
+          int cnt = 1;
+          while (next[s] + cnt < end && cnt < maxpages &&
+                 pages[next[s] + cnt] == pages[next[s]] + cnt) cnt++;
+          u64 page = pages[next[s]] & ((1UL << 48) - 1);
+          u64 lba = v->shard[s].slba + page * ns->nbpp;
+          void* buf = page_set_buf(ps, next[s]);
+          unvme_iod_t iod = write ? unvme_awrite(dns, q, buf, lba, cnt * ns->nbpp)
+                                  : unvme_aread(dns, q, buf, lba, cnt * ns->nbpp);
+          if (!iod) {
+            if (write) IOERROR("awrite", lba);
+            IOERROR("aread", lba);
+          }
+          qiods[(*qinflight)++] = iod;
+          pending++;
+          next[s] += cnt;
+          left -= cnt;
+        }
+        for (j = 0; j < *qinflight; ) {
+          unvme_iod_t iod = qiods[j];
+          u64 lba = iod->slba;
+          int err = unvme_apoll(iod, 0);
+          if (err == -1) {
+            j++;
+            continue;
+          }
+          if (err) IOERROR("I/O status", lba);
+          qiods[j] = qiods[--(*qinflight)];
+          pending--;
+          tsc = rdtsc();
+        }
+      }
     }
+    if (pending && rdtsc_elapse(tsc) > tlimit) IOERROR("poll timeout", v->shard[0].slba);
   }
-  unvme_free(ns, fromPage);
+  free(iods);
+  free(inflight);
 }
 
-float* unvme_sparse_length_sum_baseline(
+/**
+ * Free the buffers of a page set.
+ */
+static void page_set_close(page_set_t* ps)
+{
+  int s;
+  for (s = 0; s < ps->v->nshards; s++) {
+    if (ps->bufs[s]) unvme_free(devs[ps->v->dev[s]].ns, ps->bufs[s]);
+  }
+}
+
+static void embedding_lookup_io(unsigned int qid, int nq,
+        void *results,  embed_config_t *config)
+{
+  embed_view_t v;
+  table_lookup_begin(config->table_id);
+  table_get(config->table_id, config->embedding_length, &v);
+  int n = config->input_embeddings;
+  int i, s;
+
+  // split the rows by shard (in shard order), sum the cached ones and keep
+  // the rest to read from the devices
+  int* ind = (int*)config->embedding_id_list;
+  int* missInd = malloc((2 * n + 1) * sizeof(int));
+  int nmiss[EMBED_MAXDEVS + 1] = { 0 };
+  for (s = 0; s < v.nshards; s++) {
+    const embed_table_t* st = &v.shard[s];
+    int* shardInd = missInd + 2 * nmiss[s];
+    int m = 0;
+    for (i = 0; i < 2*n; i += 2) {
+      if (table_shard(&v, ind[i+1]) != s) continue;
+      shardInd[2*m] = ind[i];
+      shardInd[2*m+1] = ind[i+1] - st->row0;
+      m++;
+    }
+    if (cache.npages) m = cache_split(st, shardInd, m, results, shardInd);
+    nmiss[s+1] = nmiss[s] + m;
+  }
+  n = nmiss[v.nshards];
+
+  // sort and deduplicate the pages to read (all the pages a row spans),
+  // which keeps them grouped by shard and the pages of a row consecutive
+  u64* pages = malloc((n * ((table_rowbytes(&v.shard[0]) + 4095) / 4096 + 1) + 1)
+                      * sizeof(u64));
+  int npages = 0, k;
+  for (s = 0; s < v.nshards; s++) {
+    for (i = nmiss[s]; i < nmiss[s+1]; i++) {
+      u64 off = table_row_offset(&v.shard[s], missInd[2*i+1]);
+      for (k = 0; k < table_row_pages(&v.shard[s], off); k++)
+        pages[npages++] = page_key(s, off / 4096 + k);
+    }
+  }
+  n = npages;
+  qsort(pages, n, sizeof(u64), page_compare);
+  npages = 0;
+  for (i = 0; i < n; i++) {
+    if (npages == 0 || pages[i] != pages[npages-1]) pages[npages++] = pages[i];
+  }
+
+  // read the pages of each shard into a page-ordered buffer on its device
+  page_set_t ps;
+  page_set_open(&ps, &v, pages, npages);
+  page_set_io(&ps, qid, nq, 0);
+
+  // keep the fetched pages and scatter-accumulate the rows into results
+  if (cache.npages) {
+    pthread_mutex_lock(&cache.lock);
+    for (i = 0; i < npages; i++) {
+      s = pages[i] >> 48;
+      cache_insert(&v.shard[s], pages[i] & ((1UL << 48) - 1), page_set_buf(&ps, i));
+    }
+    pthread_mutex_unlock(&cache.lock);
+  }
+  for (s = 0; s < v.nshards; s++) {
+    const embed_table_t* st = &v.shard[s];
+    for (i = nmiss[s]; i < nmiss[s+1]; i++) {
+      u64 off = table_row_offset(st, missInd[2*i+1]);
+      int p = page_find(pages, npages, page_key(s, off / 4096));
+      embed_pool_row((float*)results + missInd[2*i] * config->embedding_length,
+                     page_set_buf(&ps, p) + off % 4096, st->dtype,
+                     config->embedding_length);
+    }
+  }
+  page_set_close(&ps);
+
+  table_lookup_end(config->table_id);
+  free(missInd);
+  free(pages);
+}
+
+/**
+ * Update rows of a table in place.  The pages holding the rows are read,
+ * patched and written back as batched async I/O across the queues qid to
+ * qid+nq-1 of the table's devices, then flushed, so only those pages are
+ * rewritten.  Cached copies of the pages are patched too.  The update is
+ * ordered against lookups of the table: new lookups are held back while it
+ * waits for the ones in flight (including streamed batches not yet
+ * acquired, which the stream's own thread first finishes) and until the
+ * rows are written, so steady lookup traffic does not starve it.
+ * When a row is given more than once, the last vector wins.
+ * @param   rows        row ids
+ * @param   vectors     nrows float rows of vector_length
+ * @return  0 if ok else -1.
+ */
+int unvme_update_rows(int table_id, const int* rows, const float* vectors,
+    int nrows, int vector_length, int qid, int nq)
+{
+  embed_view_t v;
+  int i, s;
+  if (nrows <= 0) return 0;
+  if (nq <= 0) nq = 1;
+
+  sls_stream_finish_own();
+  table_update_begin(table_id);
+  if (table_view(table_id, &v) || v.shard[0].vector_length != (u32)vector_length) {
+    table_update_end(table_id);
+    return -1;
+  }
+  const embed_table_t* last = &v.shard[v.nshards - 1];
+  for (i = 0; i < nrows; i++) {
+    if (rows[i] < 0 || (u64)rows[i] >= last->row0 + last->table_length) {
+      table_update_end(table_id);
+      return -1;
+    }
+  }
+
+  // collect the pages of the rows (more than one for a row straddling pages)
+  u64 rowbytes = table_rowbytes(&v.shard[0]);
+  u64* pages = malloc(nrows * (rowbytes / 4096 + 2) * sizeof(u64));
+  u64* offs = malloc(nrows * sizeof(u64));
+  int n = 0;
+  for (i = 0; i < nrows; i++) {
+    s = table_shard(&v, rows[i]);
+    offs[i] = table_row_offset(&v.shard[s], rows[i] - v.shard[s].row0);
+    u64 p;
+    for (p = offs[i] / 4096; p <= (offs[i] + rowbytes - 1) / 4096; p++)
+      pages[n++] = page_key(s, p);
+  }
+  qsort(pages, n, sizeof(u64), page_compare);
+  int npages = 0;
+  for (i = 0; i < n; i++) {
+    if (npages == 0 || pages[i] != pages[npages-1]) pages[npages++] = pages[i];
+  }
+
+  // read, patch and write back the pages (the pages of a straddling row
+  // are consecutive in its shard buffer)
+  page_set_t ps;
+  page_set_open(&ps, &v, pages, npages);
+  page_set_io(&ps, qid, nq, 0);
+  for (i = 0; i < nrows; i++) {
+    s = table_shard(&v, rows[i]);
+    int p = page_find(pages, npages, page_key(s, offs[i] / 4096));
+    unvme_encode_table(vectors + (u64)i * vector_length,
+                       page_set_buf(&ps, p) + offs[i] % 4096,
+                       vector_length, 1, v.shard[s].dtype);
+  }
+  page_set_io(&ps, qid, nq, 1);
+
+  if (cache.npages) {
+    pthread_mutex_lock(&cache.lock);
+    for (i = 0; i < npages; i++) {
+      char* cached = cache_lookup(&v.shard[pages[i] >> 48], pages[i] & ((1UL << 48) - 1));
+      if (cached) memcpy(cached, page_set_buf(&ps, i), CACHE_PAGESIZE);
+    }
+    pthread_mutex_unlock(&cache.lock);
+  }
+  page_set_close(&ps);
+  for (s = 0; s < v.nshards; s++) {
+    if (ps.first[s+1] > ps.first[s]) unvme_flush(devs[v.dev[s]].ns, qid);
+  }
+  table_update_end(table_id);
+
+  free(offs);
+  free(pages);
+  return 0;
+}
+
+/**
+ * Baseline (non-NDP) SLS on the host, spreading its page reads over
+ * queues qid to qid+nq-1.  The results are freed with unvme_free_result.
+ */
+float* unvme_sparse_length_sum_baseline_q(
     int* flatInd, int vector_length, int batchsize, int embed_per_result,
-    int table_id)
+    int table_id, int qid, int nq)
 {
-  int buffersize = (4*vector_length*batchsize > (4*2*batchsize*embed_per_result + 20)) ?
-    4*vector_length*batchsize:(4*2*batchsize*embed_per_result + 20);
-  void* result_ptr = unvme_alloc(ns, buffersize);
+  // the rows are accumulated on the host into zeroed results
+  float* result_ptr = calloc(vector_length * batchsize, sizeof(float));
   embed_config_t *config = (embed_config_t*)malloc(
           4*2*batchsize*embed_per_result + 20);
   config->attribute_size = 4;
@@ -276,11 +2060,22 @@ float* unvme_sparse_length_sum_baseline(
   for(i = 0; i < 2*batchsize*embed_per_result; i++)
     config->embedding_id_list[i] = flatInd[i];
 
-  int q = 0;
-  embedding_lookup_io(q,
-      slba + (table_id * table_stride),
-      result_ptr,
-      config);
+  embedding_lookup_io(qid, nq > 0 ? nq : 1, result_ptr, config);
+  free(config);
+  if (pooling == EMBED_POOLING_MEAN) {
+    int* counts = calloc(batchsize, sizeof(int));
+    pool_counts(counts, flatInd, batchsize * embed_per_result, batchsize);
+    pool_means(result_ptr, counts, batchsize, vector_length);
+    free(counts);
+  }
+
+  return result_ptr;
+}
 
-  return (float*)result_ptr;
+float* unvme_sparse_length_sum_baseline(
+    int* flatInd, int vector_length, int batchsize, int embed_per_result,
+    int table_id)
+{
+  return unvme_sparse_length_sum_baseline_q(flatInd, vector_length, batchsize,
+                                            embed_per_result, table_id, 0, 1);
 }
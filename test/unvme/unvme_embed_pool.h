@@ -0,0 +1,545 @@
+/**
+ * @file
+ * @brief Host-side embedding pooling kernels (sum, weighted sum, mean).
+ *
+ * The kernels are selected once at runtime by CPU feature (AVX-512F, then
+ * AVX2+FMA) on x86-64, use NEON on aarch64, and otherwise fall back to a
+ * plain loop.  The common embedding lengths (16/32/64/128) are dispatched
+ * to fixed length instances of each kernel.  Rows stored as fp16, bf16 or
+ * row-wise int8 are dequantized by similarly selected kernels as they are
+ * accumulated.
+ */
+
+#ifndef _UNVME_EMBED_POOL_H
+#define _UNVME_EMBED_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+/// Pooling kernel: to[0..n) += w * from[0..n)
+typedef void (*embed_pool_fn)(float* to, const float* from, float w, int n);
+
+/// Scaling kernel: to[0..n) *= s
+typedef void (*embed_pool_scale_fn)(float* to, float s, int n);
+
+/// Pooling modes of the lookups (see unvme_sls_set_pooling)
+#define EMBED_POOLING_SUM   0   ///< sum of the rows of each result
+#define EMBED_POOLING_MEAN  1   ///< mean of the rows of each result
+
+/// Expand fixed length instances of a kernel for the common lengths
+#define EMBED_POOL_DISPATCH(kernel, to, from, w, n)                     \
+            switch (n) {                                                \
+            case 16:  kernel(to, from, w, 16);  break;                  \
+            case 32:  kernel(to, from, w, 32);  break;                  \
+            case 64:  kernel(to, from, w, 64);  break;                  \
+            case 128: kernel(to, from, w, 128); break;                  \
+            default:  kernel(to, from, w, n);   break;                  \
+            }
+
+/**
+ * Portable kernel.
+ */
+static inline __attribute__((always_inline))
+void embed_pool_scalar_n(float* restrict to, const float* restrict from,
+                         float w, int n)
+{
+    int i;
+    if (w == 1.0f) {
+        for (i = 0; i < n; i++) to[i] += from[i];
+    } else {
+        for (i = 0; i < n; i++) to[i] += w * from[i];
+    }
+}
+
+static void embed_pool_scalar(float* to, const float* from, float w, int n)
+{
+    EMBED_POOL_DISPATCH(embed_pool_scalar_n, to, from, w, n);
+}
+
+static void embed_pool_scale_scalar(float* to, float s, int n)
+{
+    int i;
+    for (i = 0; i < n; i++) to[i] *= s;
+}
+
+#if defined(__x86_64__)
+
+/**
+ * AVX-512 kernel.
+ */
+static inline __attribute__((always_inline, target("avx512f")))
+void embed_pool_avx512_n(float* to, const float* from, float w, int n)
+{
+    __m512 vw = _mm512_set1_ps(w);
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512 v = _mm512_fmadd_ps(vw, _mm512_loadu_ps(from + i),
+                                   _mm512_loadu_ps(to + i));
+        _mm512_storeu_ps(to + i, v);
+    }
+    for (; i < n; i++) to[i] += w * from[i];
+}
+
+static __attribute__((target("avx512f")))
+void embed_pool_avx512(float* to, const float* from, float w, int n)
+{
+    EMBED_POOL_DISPATCH(embed_pool_avx512_n, to, from, w, n);
+}
+
+static __attribute__((target("avx512f")))
+void embed_pool_scale_avx512(float* to, float s, int n)
+{
+    __m512 vs = _mm512_set1_ps(s);
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+        _mm512_storeu_ps(to + i, _mm512_mul_ps(vs, _mm512_loadu_ps(to + i)));
+    for (; i < n; i++) to[i] *= s;
+}
+
+/**
+ * AVX2 kernel.
+ */
+static inline __attribute__((always_inline, target("avx2,fma")))
+void embed_pool_avx2_n(float* to, const float* from, float w, int n)
+{
+    __m256 vw = _mm256_set1_ps(w);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 v = _mm256_fmadd_ps(vw, _mm256_loadu_ps(from + i),
+                                   _mm256_loadu_ps(to + i));
+        _mm256_storeu_ps(to + i, v);
+    }
+    for (; i < n; i++) to[i] += w * from[i];
+}
+
+static __attribute__((target("avx2,fma")))
+void embed_pool_avx2(float* to, const float* from, float w, int n)
+{
+    EMBED_POOL_DISPATCH(embed_pool_avx2_n, to, from, w, n);
+}
+
+static __attribute__((target("avx2")))
+void embed_pool_scale_avx2(float* to, float s, int n)
+{
+    __m256 vs = _mm256_set1_ps(s);
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+        _mm256_storeu_ps(to + i, _mm256_mul_ps(vs, _mm256_loadu_ps(to + i)));
+    for (; i < n; i++) to[i] *= s;
+}
+
+#elif defined(__aarch64__)
+
+/**
+ * NEON kernel.
+ */
+static inline __attribute__((always_inline))
+void embed_pool_neon_n(float* to, const float* from, float w, int n)
+{
+    float32x4_t vw = vdupq_n_f32(w);
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+        vst1q_f32(to + i, vfmaq_f32(vld1q_f32(to + i), vw, vld1q_f32(from + i)));
+    for (; i < n; i++) to[i] += w * from[i];
+}
+
+static void embed_pool_neon(float* to, const float* from, float w, int n)
+{
+    EMBED_POOL_DISPATCH(embed_pool_neon_n, to, from, w, n);
+}
+
+static void embed_pool_scale_neon(float* to, float s, int n)
+{
+    int i = 0;
+    for (; i + 4 <= n; i += 4) vst1q_f32(to + i, vmulq_n_f32(vld1q_f32(to + i), s));
+    for (; i < n; i++) to[i] *= s;
+}
+
+#endif
+
+/**
+ * Select the pooling kernel for this CPU.
+ */
+static embed_pool_fn embed_pool_select(void)
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return embed_pool_avx512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return embed_pool_avx2;
+    return embed_pool_scalar;
+#elif defined(__aarch64__)
+    return embed_pool_neon;
+#else
+    return embed_pool_scalar;
+#endif
+}
+
+/**
+ * Select the scaling kernel for this CPU.
+ */
+static embed_pool_scale_fn embed_pool_scale_select(void)
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return embed_pool_scale_avx512;
+    if (__builtin_cpu_supports("avx2")) return embed_pool_scale_avx2;
+    return embed_pool_scale_scalar;
+#elif defined(__aarch64__)
+    return embed_pool_scale_neon;
+#else
+    return embed_pool_scale_scalar;
+#endif
+}
+
+/**
+ * Accumulate w times an embedding row into a result row.
+ */
+static inline void embed_pool_wsum(float* to, const float* from, float w, int n)
+{
+    static embed_pool_fn pool = NULL;
+    if (!pool) pool = embed_pool_select();
+    pool(to, from, w, n);
+}
+
+/**
+ * Accumulate an embedding row into a result row.
+ */
+static inline void embed_pool_sum(float* to, const float* from, int n)
+{
+    embed_pool_wsum(to, from, 1.0f, n);
+}
+
+/**
+ * Scale a summed result row by 1/count to pool by mean.
+ */
+static inline void embed_pool_mean(float* to, int count, int n)
+{
+    static embed_pool_scale_fn scale = NULL;
+    if (count <= 1) return;
+    if (!scale) scale = embed_pool_scale_select();
+    scale(to, 1.0f / count, n);
+}
+
+
+/// Table element types
+#define EMBED_DTYPE_FP32    0   ///< 32-bit float
+#define EMBED_DTYPE_FP16    1   ///< IEEE half float
+#define EMBED_DTYPE_BF16    2   ///< bfloat16
+#define EMBED_DTYPE_INT8    3   ///< row-wise uint8, float scale and bias after the row
+#define EMBED_DTYPE_COUNT   4
+
+/**
+ * Return the bytes of an n element row of a type.
+ */
+static inline size_t embed_dtype_rowbytes(int dtype, int n)
+{
+    switch (dtype) {
+    case EMBED_DTYPE_FP16:
+    case EMBED_DTYPE_BF16:  return 2 * (size_t)n;
+    case EMBED_DTYPE_INT8:  return (size_t)n + 2 * sizeof(float);
+    default:                return 4 * (size_t)n;
+    }
+}
+
+/**
+ * Convert a half float to float.
+ */
+static inline float embed_fp16_to_float(uint16_t h)
+{
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t man = h & 0x3ff;
+    uint32_t bits;
+    float f;
+
+    if (exp == 0) {
+        f = man * (1.0f / (1 << 24));
+        return sign ? -f : f;
+    }
+    if (exp == 31) bits = sign | 0x7f800000 | (man << 13);
+    else bits = sign | ((exp + 112) << 23) | (man << 13);
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+/**
+ * Convert a float to half float, rounding to nearest even.
+ */
+static inline uint16_t embed_float_to_fp16(float f)
+{
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    uint16_t sign = (x >> 16) & 0x8000;
+    uint32_t exp = (x >> 23) & 0xff;
+    uint32_t man = x & 0x7fffff;
+
+    if (exp == 0xff) return sign | 0x7c00 | (man ? 0x200 : 0);
+    int e = (int)exp - 112;
+    if (e >= 31) return sign | 0x7c00;
+    if (e <= 0) {
+        if (e < -10) return sign;
+        // subnormal: shift in the implicit bit and round
+        man |= 0x800000;
+        int shift = 14 - e;
+        uint32_t h = man >> shift;
+        uint32_t rem = man & ((1u << shift) - 1);
+        uint32_t half = 1u << (shift - 1);
+        if (rem > half || (rem == half && (h & 1))) h++;
+        return sign | h;
+    }
+    uint32_t h = ((uint32_t)e << 10) | (man >> 13);
+    uint32_t rem = man & 0x1fff;
+    if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) h++;
+    return sign | h;
+}
+
+/**
+ * Convert a bfloat16 to float.
+ */
+static inline float embed_bf16_to_float(uint16_t b)
+{
+    uint32_t bits = (uint32_t)b << 16;
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+/**
+ * Convert a float to bfloat16, rounding to nearest even.
+ */
+static inline uint16_t embed_float_to_bf16(float f)
+{
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    if ((x & 0x7fffffff) > 0x7f800000) return (x >> 16) | 0x40;
+    return (x + 0x7fff + ((x >> 16) & 1)) >> 16;
+}
+
+/// Dequantizing pooling kernel: to[0..n) += decoded row of n elements
+typedef void (*embed_pool_dq_fn)(float* to, const void* from, int n);
+
+/**
+ * Get the scale and bias stored after an int8 row.
+ */
+static inline void embed_int8_params(const void* from, int n, float* scale, float* bias)
+{
+    memcpy(scale, (const uint8_t*)from + n, sizeof(float));
+    memcpy(bias, (const uint8_t*)from + n + sizeof(float), sizeof(float));
+}
+
+/**
+ * Portable dequantizing kernels.
+ */
+static void embed_pool_fp16_scalar(float* to, const void* from, int n)
+{
+    const uint16_t* h = from;
+    int i;
+    for (i = 0; i < n; i++) to[i] += embed_fp16_to_float(h[i]);
+}
+
+static void embed_pool_bf16_scalar(float* to, const void* from, int n)
+{
+    const uint16_t* b = from;
+    int i;
+    for (i = 0; i < n; i++) to[i] += embed_bf16_to_float(b[i]);
+}
+
+static void embed_pool_int8_scalar(float* to, const void* from, int n)
+{
+    const uint8_t* q = from;
+    float scale, bias;
+    int i;
+    embed_int8_params(from, n, &scale, &bias);
+    for (i = 0; i < n; i++) to[i] += scale * q[i] + bias;
+}
+
+#if defined(__x86_64__)
+
+/**
+ * AVX-512 dequantizing kernels.
+ */
+static __attribute__((target("avx512f")))
+void embed_pool_fp16_avx512(float* to, const void* from, int n)
+{
+    const uint16_t* h = from;
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512 v = _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)(h + i)));
+        _mm512_storeu_ps(to + i, _mm512_add_ps(_mm512_loadu_ps(to + i), v));
+    }
+    for (; i < n; i++) to[i] += embed_fp16_to_float(h[i]);
+}
+
+static __attribute__((target("avx512f")))
+void embed_pool_bf16_avx512(float* to, const void* from, int n)
+{
+    const uint16_t* b = from;
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512i w = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(b + i)));
+        __m512 v = _mm512_castsi512_ps(_mm512_slli_epi32(w, 16));
+        _mm512_storeu_ps(to + i, _mm512_add_ps(_mm512_loadu_ps(to + i), v));
+    }
+    for (; i < n; i++) to[i] += embed_bf16_to_float(b[i]);
+}
+
+static __attribute__((target("avx512f")))
+void embed_pool_int8_avx512(float* to, const void* from, int n)
+{
+    const uint8_t* q = from;
+    float scale, bias;
+    int i = 0;
+    embed_int8_params(from, n, &scale, &bias);
+    __m512 vs = _mm512_set1_ps(scale);
+    __m512 vb = _mm512_set1_ps(bias);
+    for (; i + 16 <= n; i += 16) {
+        __m512i w = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)(q + i)));
+        __m512 v = _mm512_fmadd_ps(vs, _mm512_cvtepi32_ps(w), vb);
+        _mm512_storeu_ps(to + i, _mm512_add_ps(_mm512_loadu_ps(to + i), v));
+    }
+    for (; i < n; i++) to[i] += scale * q[i] + bias;
+}
+
+/**
+ * AVX2 dequantizing kernels.
+ */
+static __attribute__((target("avx2,fma,f16c")))
+void embed_pool_fp16_avx2(float* to, const void* from, int n)
+{
+    const uint16_t* h = from;
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 v = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(h + i)));
+        _mm256_storeu_ps(to + i, _mm256_add_ps(_mm256_loadu_ps(to + i), v));
+    }
+    for (; i < n; i++) to[i] += embed_fp16_to_float(h[i]);
+}
+
+static __attribute__((target("avx2,fma")))
+void embed_pool_bf16_avx2(float* to, const void* from, int n)
+{
+    const uint16_t* b = from;
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i w = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(b + i)));
+        __m256 v = _mm256_castsi256_ps(_mm256_slli_epi32(w, 16));
+        _mm256_storeu_ps(to + i, _mm256_add_ps(_mm256_loadu_ps(to + i), v));
+    }
+    for (; i < n; i++) to[i] += embed_bf16_to_float(b[i]);
+}
+
+static __attribute__((target("avx2,fma")))
+void embed_pool_int8_avx2(float* to, const void* from, int n)
+{
+    const uint8_t* q = from;
+    float scale, bias;
+    int i = 0;
+    embed_int8_params(from, n, &scale, &bias);
+    __m256 vs = _mm256_set1_ps(scale);
+    __m256 vb = _mm256_set1_ps(bias);
+    for (; i + 8 <= n; i += 8) {
+        __m256i w = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(q + i)));
+        __m256 v = _mm256_fmadd_ps(vs, _mm256_cvtepi32_ps(w), vb);
+        _mm256_storeu_ps(to + i, _mm256_add_ps(_mm256_loadu_ps(to + i), v));
+    }
+    for (; i < n; i++) to[i] += scale * q[i] + bias;
+}
+
+#elif defined(__aarch64__)
+
+/**
+ * NEON dequantizing kernels.
+ */
+static void embed_pool_fp16_neon(float* to, const void* from, int n)
+{
+    const uint16_t* h = from;
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        float32x4_t v = vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(h + i)));
+        vst1q_f32(to + i, vaddq_f32(vld1q_f32(to + i), v));
+    }
+    for (; i < n; i++) to[i] += embed_fp16_to_float(h[i]);
+}
+
+static void embed_pool_bf16_neon(float* to, const void* from, int n)
+{
+    const uint16_t* b = from;
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        float32x4_t v = vreinterpretq_f32_u32(vshll_n_u16(vld1_u16(b + i), 16));
+        vst1q_f32(to + i, vaddq_f32(vld1q_f32(to + i), v));
+    }
+    for (; i < n; i++) to[i] += embed_bf16_to_float(b[i]);
+}
+
+static void embed_pool_int8_neon(float* to, const void* from, int n)
+{
+    const uint8_t* q = from;
+    float scale, bias;
+    int i = 0;
+    embed_int8_params(from, n, &scale, &bias);
+    float32x4_t vs = vdupq_n_f32(scale);
+    float32x4_t vb = vdupq_n_f32(bias);
+    for (; i + 8 <= n; i += 8) {
+        uint16x8_t w = vmovl_u8(vld1_u8(q + i));
+        float32x4_t lo = vcvtq_f32_u32(vmovl_u16(vget_low_u16(w)));
+        float32x4_t hi = vcvtq_f32_u32(vmovl_u16(vget_high_u16(w)));
+        vst1q_f32(to + i, vaddq_f32(vld1q_f32(to + i), vfmaq_f32(vb, vs, lo)));
+        vst1q_f32(to + i + 4, vaddq_f32(vld1q_f32(to + i + 4), vfmaq_f32(vb, vs, hi)));
+    }
+    for (; i < n; i++) to[i] += scale * q[i] + bias;
+}
+
+#endif
+
+/**
+ * Select the dequantizing pooling kernel of a type for this CPU.
+ */
+static embed_pool_dq_fn embed_pool_dq_select(int dtype)
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        if (dtype == EMBED_DTYPE_FP16) return embed_pool_fp16_avx512;
+        if (dtype == EMBED_DTYPE_BF16) return embed_pool_bf16_avx512;
+        return embed_pool_int8_avx512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        if (dtype == EMBED_DTYPE_FP16 && __builtin_cpu_supports("f16c"))
+            return embed_pool_fp16_avx2;
+        if (dtype == EMBED_DTYPE_BF16) return embed_pool_bf16_avx2;
+        if (dtype == EMBED_DTYPE_INT8) return embed_pool_int8_avx2;
+    }
+#elif defined(__aarch64__)
+    if (dtype == EMBED_DTYPE_FP16) return embed_pool_fp16_neon;
+    if (dtype == EMBED_DTYPE_BF16) return embed_pool_bf16_neon;
+    return embed_pool_int8_neon;
+#endif
+    if (dtype == EMBED_DTYPE_FP16) return embed_pool_fp16_scalar;
+    if (dtype == EMBED_DTYPE_BF16) return embed_pool_bf16_scalar;
+    return embed_pool_int8_scalar;
+}
+
+/**
+ * Accumulate a table row of any type into a float result row.
+ */
+static inline void embed_pool_row(float* to, const void* from, int dtype, int n)
+{
+    static embed_pool_dq_fn pool[EMBED_DTYPE_COUNT];
+    if (dtype == EMBED_DTYPE_FP32) {
+        embed_pool_sum(to, from, n);
+        return;
+    }
+    if (!pool[dtype]) pool[dtype] = embed_pool_dq_select(dtype);
+    pool[dtype](to, from, n);
+}
+
+#endif  // _UNVME_EMBED_POOL_H
@@ -20,23 +20,16 @@
 #include "unvme.h"
 #include "unvme_log.h"
 #include "rdtsc.h"
+#include "unvme_embed_pool.h"
 
 /// Print fatal error and exit
-#define FATAL(fmt, arg...)  do { ERROR(fmt, ##arg); abort(); } while (0)
+#define FATAL(fmt, arg...)  do { ERROR(fmt, ##arg); log_flush(); abort(); } while (0)
 
 /// macro to print an io related error message
-#define IOERROR(s, p)   errx(1, "ERROR: " s " lba=%#lx", (p)->lba)
+#define IOERROR(s, lba) errx(1, "ERROR: " s " lba=%#lx", (u64)(lba))
 
 static int stride = 1;
 
-/// page structure
-typedef struct {
-    void*           buf;        ///< IO buffer
-    u64             lba;        ///< lba
-    unvme_iod_t     iod;        ///< returned IO descriptor
-    u64             tsc;        ///< tsc time
-} bw_page_t;
-
 typedef struct {
   u32 attribute_size;
   u32 embedding_length;
@@ -58,68 +51,82 @@ static sem_t sm_start;          ///< semaphore to start test
 static pthread_t* ses;          ///< array of thread sessions
 static int validate = 0;        ///< Run functional validation test
 
+/// region write job of one queue
+typedef struct {
+  void* buf;                    ///< region buffer
+  u64 slba;                     ///< region starting block address
+  u64 nlb;                      ///< region number of blocks
+  int q;                        ///< queue to write through
+} region_job_t;
+
 /**
- * Submit an io and record the submission latency time.
+ * Submit a write of up to maxbpio blocks of a region.  Returns the next lba.
  */
-static void io_submit(int q, int rw, bw_page_t* p)
+static u64 io_submit(region_job_t* job, u64 lba)
 {
-    p->tsc = rdtsc();
-    if (rw) {
-        p->iod = unvme_awrite(ns, q, p->buf, p->lba, ns->nbpp);
-        if (!p->iod) IOERROR("awrite", p);
-    } else {
-        p->iod = unvme_aread(ns, q, p->buf, p->lba, ns->nbpp);
-        if (!p->iod) IOERROR("aread", p);
-    }
+    u64 elba = job->slba + job->nlb;
+    u32 nlb = elba - lba < ns->maxbpio ? elba - lba : ns->maxbpio;
+    void* buf = job->buf + ((lba - job->slba) << ns->blockshift);
+    if (!unvme_awrite(ns, job->q, buf, lba, nlb)) IOERROR("awrite", lba);
+    return lba + (u64)qcount * ns->maxbpio;
 }
 
 /**
- * Reads/writes a region of data.
+ * Write every qcount-th maxbpio sized piece of a region through one queue.
  */
-static void rw_region(void *buf, u64 slba, u64 nlb,
-                      int rw, int q)
+static void* write_region_q(void* arg)
 {
-  u64 lba = slba;
+  region_job_t* job = arg;
+  u64 lba = job->slba + (u64)job->q * ns->maxbpio;
+  u64 elba = job->slba + job->nlb;
   int qdepth = qsize - 1;
 
-  bw_page_t* pages = calloc(qdepth, sizeof(bw_page_t));
-  void* buf_p = buf;
-  bw_page_t* p = pages;
-  int i;
-  for (i = 0; i < qdepth; i++) {
-    p->buf = buf_p;
-    p->lba = lba;
-    buf_p += ns->pagesize;
-    lba += ns->nbpp;
-    p++;
+  unvme_cpl_t* cpls = calloc(qdepth, sizeof(unvme_cpl_t));
+  int pending = 0;
+  while (pending < qdepth && lba < elba) {
+    lba = io_submit(job, lba);
+    pending++;
   }
 
-  for (i = 0; i < qdepth; i++) io_submit(q, rw, pages + i);
-
-  i = 0;
-  int pending = qdepth;
-  do {
-    p = pages + i;
-    if (p->iod) {
-      if (unvme_apoll(p->iod, 0) == 0) {
-        if (lba < slba + nlb) {
-          p->buf = buf_p;
-          p->lba = lba;
-          buf_p += ns->pagesize;
-          lba += ns->nbpp;
-          io_submit(q, rw, p);
-        } else {
-          p->iod = 0;
-          pending--;
-        }
-      } else if ((rdtsc_elapse(p->tsc)) > timeout) {
-        IOERROR("apoll timeout", p);
-      }
+  // resubmit the next piece for each reaped completion
+  u64 tsc = rdtsc();
+  while (pending > 0) {
+    int i, n = unvme_reap(ns, job->q, cpls, qdepth, 0);
+    if (n == 0) {
+      if ((rdtsc_elapse(tsc)) > timeout) IOERROR("reap timeout", lba);
+      continue;
     }
-    if (++i == qdepth) i = 0;
-  } while (pending > 0);
+    for (i = 0; i < n; i++) {
+      if (cpls[i].stat) IOERROR("I/O status", cpls[i].slba);
+      if (lba < elba) lba = io_submit(job, lba);
+      else pending--;
+    }
+    tsc = rdtsc();
+  }
+
+  free(cpls);
+  return 0;
+}
 
-  free(pages);
+/**
+ * Write a region striped across all the test queues with maxbpio sized
+ * commands, one thread per queue, and print the achieved GB/s.
+ */
+static void write_region(void *buf, u64 slba, u64 nlb)
+{
+  region_job_t jobs[qcount];
+  int q;
+
+  u64 tsc = rdtsc();
+  for (q = 0; q < qcount; q++) {
+    jobs[q] = (region_job_t){ buf, slba, nlb, q };
+    pthread_create(&ses[q], 0, write_region_q, &jobs[q]);
+  }
+  for (q = 0; q < qcount; q++) pthread_join(ses[q], 0);
+
+  double secs = (double)rdtsc_elapse(tsc) / rdtsc_second();
+  printf("Wrote %lu blocks over %d queues in %.3f secs (%.2f GB/s)\n",
+         nlb, qcount, secs, (nlb << ns->blockshift) / secs / 1e9);
 }
 
 /* DRAM based implementation of lookup. */
@@ -130,7 +137,7 @@ static void embedding_lookup(void *table, void *results,
   {
     char bytes[config->attribute_size];
   } *fromBase, *fromAtr, *toBase, *toEmbed, *toAtr;
-  unsigned int resultidx, embedlistidx, embedidx, atridx;
+  unsigned int resultidx, embedlistidx, embedidx;
 
   fromBase = table;
   fromAtr = fromBase;
@@ -148,15 +155,8 @@ static void embedding_lookup(void *table, void *results,
 
     embedidx = config->embedding_id_list[embedlistidx+1];
     fromAtr = fromBase + (embedidx * config->embedding_length);
-    for (atridx = 0;
-         atridx < config->embedding_length;
-         atridx++)
-    {
-      // Assume floats for now
-      *((float*)toAtr) += *((float*)fromAtr);
-      toAtr++;
-      fromAtr++;
-    }
+    // Assume floats for now
+    embed_pool_sum((float*)toAtr, (float*)fromAtr, config->embedding_length);
   }
 }
 
@@ -168,7 +168,7 @@ static void embedding_lookup_file(FILE *table, void *results,
   {
     char bytes[config->attribute_size];
   } *toBase, *toEmbed, *toAtr, *fromAtr, fromEmbed[config->embedding_length];
-  unsigned int resultidx, embedlistidx, embedidx, atridx;
+  unsigned int resultidx, embedlistidx, embedidx;
 
   toBase = results;
   toEmbed = toBase;
@@ -191,15 +191,8 @@ static void embedding_lookup_file(FILE *table, void *results,
               1, table);
     if (!err) errx(1, "reading fileiotest");
     fromAtr = fromEmbed;
-    for (atridx = 0;
-         atridx < config->embedding_length;
-         atridx++)
-    {
-      // Assume floats for now
-      *((float*)toAtr) += *((float*)fromAtr);
-      toAtr++;
-      fromAtr++;
-    }
+    // Assume floats for now
+    embed_pool_sum((float*)toAtr, (float*)fromAtr, config->embedding_length);
   }
 }
 
@@ -211,7 +204,7 @@ static void embedding_lookup_io(unsigned int qid,
   {
     char bytes[config->attribute_size];
   } *toBase, *toEmbed, *toAtr, *fromAtr, *fromEmbed, *fromPage;
-  unsigned int resultidx, embedlistidx, embedidx, atridx;
+  unsigned int resultidx, embedlistidx, embedidx;
   fromPage = unvme_alloc(ns, 4096);
 
   toBase = results;
@@ -233,15 +226,8 @@ static void embedding_lookup_io(unsigned int qid,
     fromEmbed = fromPage +
         ((embedidx % (4096 / (config->attribute_size * config->embedding_length))) * config->embedding_length);
     fromAtr = fromEmbed;
-    for (atridx = 0;
-         atridx < config->embedding_length;
-         atridx++)
-    {
-      // Assume floats for now
-      *((float*)toAtr) += *((float*)fromAtr);
-      toAtr++;
-      fromAtr++;
-    }
+    // Assume floats for now
+    embed_pool_sum((float*)toAtr, (float*)fromAtr, config->embedding_length);
   }
   unvme_free(ns, fromPage);
 }
@@ -520,7 +506,7 @@ void run_test(long numbatches, long batchsize, long embedperrequest)
     // Leaving it as garbage for now, will do functional validation in another test
 
     // Write test table to Flash
-    rw_region(dram_table, slba, tablesize / ns->blocksize, 1, 0);
+    write_region(dram_table, slba, tablesize / ns->blocksize);
     // Write fence before translation
     unvme_flush(ns, 0);
 
@@ -195,6 +195,7 @@ void run_test(const char* name, int rw)
     endtsc = rdtsc() + (runtime * tsec);
     timeout = UNVME_TIMEOUT * tsec;
 
+    unvme_reset_stats(ns);
     for (q = 0; q < qcount; q++) sem_post(&sm_start);
     for (q = 0; q < qcount; q++) pthread_join(ses[q], 0);
 
@@ -210,6 +211,15 @@ void run_test(const char* name, int rw)
             (double)avg_slat/ioc/utsc, (double)min_clat/utsc,
             (double)max_clat/utsc, (double)avg_clat/ioc/utsc, ioc);
 
+    unvme_qstats_t st;
+    unvme_get_stats(ns, -1, &st);
+    unvme_lat_hist_t* h = &st.lat[rw ? UNVME_STAT_WRITE : UNVME_STAT_READ];
+    printf("%s: lat=(p50=%.2f p99=%.2f p99.9=%.2f) usecs sqdb=%lu cqdb=%lu sqfull=%lu\n",
+            name, unvme_stats_percentile(h, 50) / 1000.0,
+            unvme_stats_percentile(h, 99) / 1000.0,
+            unvme_stats_percentile(h, 99.9) / 1000.0,
+            st.sqdb, st.cqdb, st.sqfull);
+
     sem_destroy(&sm_ready);
     sem_destroy(&sm_start);
 }
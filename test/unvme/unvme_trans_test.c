@@ -22,7 +22,7 @@
 #include "rdtsc.h"
 
 /// Print fatal error and exit
-#define FATAL(fmt, arg...)  do { ERROR(fmt, ##arg); abort(); } while (0)
+#define FATAL(fmt, arg...)  do { ERROR(fmt, ##arg); log_flush(); abort(); } while (0)
 
 /// macro to print an io related error message
 #define IOERROR(s, p)   errx(1, "ERROR: " s " lba=%#lx", (p)->lba)